@@ -2,7 +2,9 @@
 #define  BENIGN_NGRAM_STORAGE_HH
 #include <map>
 #include <string>
+#include <vector>
 #include <inttypes.h>
+#include <fasguardfilter/NgramSpan.hh>
 
 /*!
  * \brief do-nothing function with C linkage
@@ -35,7 +37,8 @@ public:
    */
   BenignNgramStorage(int ip_protocol_num, int port_num, int min_ngram_size,
                      int max_ngram_size);
-  BenignNgramStorage()
+  BenignNgramStorage() :
+    m_bytes_processed(0)
   {}
   /**
    * This method is used for restoring a BenignNgramStorage
@@ -66,6 +69,71 @@ public:
   virtual bool contains(uint8_t const * data,
                         size_t length) = 0;
 
+  /**
+   * Insert an ngram without copying it. Implementations override this to
+   * avoid the heap allocations of insert().
+   * @param ngram The ngram to insert.
+   */
+  virtual void insertSpan(const NgramSpan &ngram)
+  {
+    insert(ngram.data,ngram.length);
+  }
+
+  /**
+   * Check to see if an ngram is stored in the data structure without copying
+   * it. Implementations override this to avoid the heap allocations of
+   * contains().
+   * @param ngram The ngram to search for.
+   */
+  virtual bool containsSpan(const NgramSpan &ngram)
+  {
+    return contains(ngram.data,ngram.length);
+  }
+
+  /**
+   * Check a batch of ngrams. Implementations override this to overlap the
+   * memory accesses of many lookups.
+   * @param ngrams The ngrams to search for.
+   * @param results Resized to ngrams.size(); results[i] is true iff
+   *    ngrams[i] is stored in the data structure.
+   */
+  virtual void containsBatch(const std::vector<NgramSpan> &ngrams,
+                             std::vector<bool> &results)
+  {
+    results.resize(ngrams.size());
+    for(size_t i = 0 ; i < ngrams.size() ; i++)
+      {
+        results[i] = containsSpan(ngrams[i]);
+      }
+  }
+
+  /**
+   * Insert every ngram of a payload whose length is between min_ngram_size
+   * and max_ngram_size. Implementations override this to hash the ngrams
+   * straight from the payload.
+   * @param data The content from the packet.
+   * @param length The length of data.
+   * @param min_ngram_size The minimum number of bytes in an inserted ngram.
+   * @param max_ngram_size The maximum number of bytes in an inserted ngram.
+   */
+  virtual void insertNgrams(uint8_t const * data, size_t length,
+                            int min_ngram_size, int max_ngram_size);
+
+  /**
+   * Called once all the payloads have been inserted.
+   */
+  virtual void signalDone()
+  {
+    // No-op, unless threaded
+  }
+  /**
+   * Return once the insertions started before signalDone() are complete.
+   */
+  virtual void threadsCompleted()
+  {
+    // No-op, unless threaded
+  }
+
   /**
    * Flush the data structure to a file.
    * @param filename Name of file used for persistence.
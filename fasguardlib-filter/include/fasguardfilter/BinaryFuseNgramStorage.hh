@@ -0,0 +1,189 @@
+#ifndef BINARY_FUSE_NGRAM_STORAGE_HH
+#define BINARY_FUSE_NGRAM_STORAGE_HH
+#include <fstream>
+#include <string>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+#include <fasguardfilter/BenignNgramStorage.hh>
+#include <fasguardfilter/BloomFilterBase.hh>
+#include <fasguardfilter/CacheAlignedAllocator.hh>
+
+/**
+ * @brief Static binary fuse filter implementation of benign ngram storage.
+ *
+ * A binary fuse filter (Graf and Lemire, 2022) stores an f-bit fingerprint
+ * per slot such that the fingerprint of every stored ngram is the xor of
+ * three slots picked by its hash, from three adjacent segments. A lookup
+ * reads exactly three slots, the false positive rate is 2^-f, and the
+ * filter takes about 1.13 * f bits per distinct ngram: about 19 bits at
+ * 1e-5, where a Bloom filter takes 24.
+ *
+ * The filter can not be changed once built. While it is being built,
+ * insert() only records a 64-bit hash of each ngram, spilling the hashes to
+ * one of NUM_SPILL_PARTITIONS files by their top bits. flush() then sorts
+ * and deduplicates the partitions one at a time, constructs the filter from
+ * the distinct hashes and writes it. contains() is only available on a
+ * filter restored from a file.
+ *
+ * The file has a HeaderLengthInBytes text header whose first line is
+ * FileFirstLine, followed by the packed slots.
+ */
+class BinaryFuseNgramStorage : public BenignNgramStorage
+{
+public:
+  /**
+   * Constructor for building a filter.
+   * @param probability_false_positive Desired probability of false postive.
+   *    Used to choose the fingerprint size.
+   * @param ip_protocol_num This is the protocol field number that appears in
+   *    the ip header.
+   * @param port_num The tcp or udp port number of the captured traffic.
+   * @param min_ngram_size The minimum number of bytes in a stored ngram.
+   * @param max_ngram_size The maximum number of bytes in a stored ngram.
+   * @param spill_prefix Prefix of the names of the files that hold the
+   *    ngram hashes until flush(). They are removed by flush().
+   */
+  BinaryFuseNgramStorage(double probability_false_positive,
+                         int ip_protocol_num, int port_num,
+                         int min_ngram_size, int max_ngram_size,
+                         const std::string &spill_prefix);
+  /**
+   * Constructor for restoring a binary fuse filter from persistent store.
+   * @param filename Name of file containing the persistent filter.
+   * @param load_mode How the slots are accessed. LOAD_STREAM is treated as
+   *    LOAD_MEMORY.
+   * @param mmap_hints BloomMmapHint values or'ed together. Only used with
+   *    LOAD_MMAP.
+   */
+  BinaryFuseNgramStorage(const std::string &filename,
+                         BloomLoadMode load_mode,
+                         unsigned int mmap_hints = MMAP_HINT_RANDOM);
+  /**
+   * Destructor. Removes the spill files of a filter that was never flushed.
+   */
+  ~BinaryFuseNgramStorage();
+
+  virtual void insert(uint8_t const * data, size_t length);
+
+  virtual bool contains(uint8_t const * data, size_t length);
+
+  /**
+   * Record the hash of an ngram for the filter being built.
+   * @param ngram The ngram to insert.
+   */
+  virtual void insertSpan(const NgramSpan &ngram);
+
+  /**
+   * Check to see if an ngram is stored in the filter.
+   * @param ngram The ngram to search for.
+   */
+  virtual bool containsSpan(const NgramSpan &ngram);
+
+  /**
+   * Check a batch of ngrams. The slots of a group of ngrams are prefetched
+   * before the previous group is resolved.
+   * @param ngrams The ngrams to search for.
+   * @param results Resized to ngrams.size(); results[i] is true iff
+   *    ngrams[i] is stored in the filter.
+   */
+  virtual void containsBatch(const std::vector<NgramSpan> &ngrams,
+                             std::vector<bool> &results);
+
+  /**
+   * Construct the filter from the recorded hashes, if it is being built,
+   * and write it to a file.
+   * @param filename Name of file used for persistence.
+   */
+  virtual bool flush(std::string filename);
+
+  /**
+   * Check whether a file holds a binary fuse filter.
+   * @param filename Name of the file.
+   */
+  static bool isBinaryFuseFile(const std::string &filename);
+
+  uint64_t getNumKeys() const
+  {
+    return m_num_keys;
+  }
+
+  unsigned int getFingerprintBits() const
+  {
+    return m_fingerprint_bits;
+  }
+
+  static const std::string FileFirstLine;
+  static const unsigned int NUM_SPILL_PARTITIONS = 64;
+  /**
+   * Number of hashes buffered per partition before they are appended to
+   * its spill file.
+   */
+  static const unsigned int SPILL_BUFFER_KEYS = 16384;
+  static const unsigned int MAX_CONSTRUCTION_ATTEMPTS = 100;
+  static const unsigned int MIN_FINGERPRINT_BITS = 4;
+  static const unsigned int MAX_FINGERPRINT_BITS = 32;
+  static const unsigned int BATCH_GROUP_SIZE = 8;
+
+  typedef std::vector<uint8_t, CacheAlignedAllocator<uint8_t> >
+    slot_array_type;
+
+protected:
+  /**
+   * 64-bit hash of an ngram, the key the filter is built from.
+   */
+  static uint64_t ngramKey(uint8_t const * data, size_t length);
+  /**
+   * The three slots of a key.
+   */
+  void slotIndeces(uint64_t hash, uint64_t indeces[3]) const;
+  uint32_t fingerprint(uint64_t hash) const;
+  uint32_t getSlot(uint64_t index) const;
+  void setSlot(uint64_t index, uint32_t value);
+  bool containsKey(uint64_t key) const;
+  /**
+   * Size the filter for num_keys keys.
+   */
+  void setGeometry(uint64_t num_keys);
+  /**
+   * Append the buffered hashes of a partition to its spill file.
+   */
+  void spill(unsigned int partition);
+  /**
+   * Sort and deduplicate the spill files, construct the filter from the
+   * distinct keys, and remove the spill files.
+   */
+  void build();
+  /**
+   * Try to construct the filter with m_seed.
+   * @return false if the keys could not be peeled.
+   */
+  bool construct(const std::vector<uint64_t> &keys);
+  size_t slotBytes() const;
+  void mapSlots(const std::string &filename, unsigned int mmap_hints);
+
+  unsigned int m_fingerprint_bits;
+  uint64_t m_num_keys;
+  uint64_t m_seed;
+  uint64_t m_segment_length;
+  uint64_t m_segment_count_length;
+  uint64_t m_array_length;
+
+  // Build state
+  bool m_building;
+  std::string m_spill_prefix;
+  std::vector<std::vector<uint64_t> > m_spill_buffers;
+  std::vector<boost::shared_ptr<std::ofstream> > m_spill_files;
+
+  slot_array_type m_slot_array;
+
+  // The slots: the data of m_slot_array, or the read-only mapping of a
+  // LOAD_MMAP filter
+  uint8_t *m_slots;
+
+  BloomLoadMode m_load_mode;
+
+  void *m_mmap_addr;
+
+  size_t m_mmap_length;
+};
+#endif
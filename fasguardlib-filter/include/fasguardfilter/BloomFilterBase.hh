@@ -1,11 +1,121 @@
 #ifndef BLOOM_FILTER_BASE_HH
 #define BLOOM_FILTER_BASE_HH
+#include <algorithm>
 #include <vector>
 #include <fstream>
 #include <boost/shared_ptr.hpp>
 #include <boost/unordered_map.hpp>
 #include <fasguardfilter/lru_cache_using_std.h>
 #include <fasguardfilter/BenignNgramStorage.hh>
+#include <fasguardfilter/CacheAlignedAllocator.hh>
+#include <fasguardfilter/IncrementalNgramHash.hh>
+
+/**
+ * @brief How the bits for a single ngram are laid out in the Bloom filter.
+ *
+ * With LAYOUT_STANDARD each of the k bits may land anywhere in the filter.
+ * With LAYOUT_BLOCKED the ngram is first hashed to one 512-bit (64-byte)
+ * block and all k bits are set within that block, so a lookup touches a
+ * single cache line (or needs a single read when the filter is not held in
+ * memory).
+ */
+enum BloomLayout
+{
+  LAYOUT_STANDARD = 0,
+  LAYOUT_BLOCKED = 1
+};
+
+/**
+ * @brief How the k bit indeces for an ngram are derived from hashes.
+ *
+ * INDEX_PER_SEED runs MurmurHash3 once per hash function, each time with a
+ * different seed. INDEX_DOUBLE_HASH runs MurmurHash3 once and derives all k
+ * indeces from the two 64-bit halves of the result using enhanced double
+ * hashing (Kirsch-Mitzenmacher with a cubic term, Dillinger-Manolios).
+ */
+enum BloomIndexMode
+{
+  INDEX_PER_SEED = 0,
+  INDEX_DOUBLE_HASH = 1
+};
+
+/**
+ * @brief Hash function applied to an ngram.
+ *
+ * HASH_MURMUR3 is MurmurHash3_x86_128. HASH_INCREMENTAL is
+ * IncrementalNgramHash, which lets all the ngram lengths at an offset be
+ * hashed in one pass. HASH_INCREMENTAL yields a single hash and so is only
+ * used with INDEX_DOUBLE_HASH.
+ */
+enum BloomHashFamily
+{
+  HASH_MURMUR3 = 0,
+  HASH_INCREMENTAL = 1
+};
+
+/**
+ * @brief How the number of bits in the Bloom filter is chosen.
+ *
+ * SIZING_POWER_OF_2 rounds the optimal number of bits up to a power of 2,
+ * which lets a filter be folded in half, and reduces a hash to a bit index
+ * by masking. This is how all filters with a text header and no SIZING
+ * key were built. SIZING_EXACT keeps the optimal number of bits (rounded
+ * up to a whole byte, or block for LAYOUT_BLOCKED) and reduces a 64-bit
+ * hash h to a range of size n with (h * n) >> 64 (Lemire's
+ * multiply-shift), which needs no division.
+ */
+enum BloomSizing
+{
+  SIZING_POWER_OF_2 = 0,
+  SIZING_EXACT = 1
+};
+
+/**
+ * @brief How the shortest ngrams are stored.
+ *
+ * SHORT_NGRAMS_HASHED hashes every ngram into the Bloom filter.
+ * SHORT_NGRAMS_EXACT gives each ngram length of at most
+ * CalcBitIndeces::MAX_EXACT_NGRAM_SIZE bytes a bitmap with one bit for every
+ * possible ngram of that length, indexed by the bytes of the ngram. The
+ * bitmaps follow the Bloom filter bits and take 2 MB for 3-byte ngrams.
+ * Short ngrams are then looked up with a single load and no hashing, and
+ * never give a false positive.
+ */
+enum BloomShortNgrams
+{
+  SHORT_NGRAMS_HASHED = 0,
+  SHORT_NGRAMS_EXACT = 1
+};
+
+/**
+ * @brief How the bits of a Bloom filter restored from a file are accessed.
+ *
+ * LOAD_STREAM seeks and reads the file for every lookup. LOAD_MEMORY reads
+ * the bits into a private copy. LOAD_MMAP maps the file read-only and looks
+ * the bits up in the mapping, so processes that load the same filter share
+ * one copy in the page cache and start without reading the file.
+ */
+enum BloomLoadMode
+{
+  LOAD_STREAM = 0,
+  LOAD_MEMORY = 1,
+  LOAD_MMAP = 2
+};
+
+/**
+ * @brief Hints for a LOAD_MMAP Bloom filter, or'ed together.
+ *
+ * MMAP_HINT_POPULATE prefaults the whole mapping when it is created
+ * (MAP_POPULATE). MMAP_HINT_RANDOM and MMAP_HINT_WILLNEED are passed to
+ * madvise as MADV_RANDOM and MADV_WILLNEED.
+ */
+enum BloomMmapHint
+{
+  MMAP_HINT_NONE = 0,
+  MMAP_HINT_POPULATE = 1,
+  MMAP_HINT_RANDOM = 2,
+  MMAP_HINT_WILLNEED = 4
+};
 
 /**
  * @brief Stores data for caching of Bloom hash lookup.
@@ -24,20 +134,235 @@ protected:
 class CalcBitIndeces
 {
 public:
-  CalcBitIndeces(size_t num_hash_func, uint64_t filter_size_in_bits);
-  CalcBitIndeces()
+  CalcBitIndeces(size_t num_hash_func, uint64_t filter_size_in_bits,
+                 BloomLayout layout = LAYOUT_STANDARD,
+                 BloomIndexMode index_mode = INDEX_PER_SEED,
+                 BloomHashFamily hash_family = HASH_MURMUR3,
+                 BloomSizing sizing = SIZING_POWER_OF_2,
+                 int exact_min_ngram_size = 1,
+                 int exact_max_ngram_size = 0);
+  CalcBitIndeces() :
+    m_exact_min_ngram_size(1),
+    m_exact_max_ngram_size(0)
   {}
   const std::vector<uint64_t> &
   operator()(const std::string &ngram);
+  /**
+   * Compute the bit indeces for an ngram.
+   * @param data The ngram.
+   * @param length The length of data.
+   * @param bit_indeces Output array with room for getNumHashFunc() entries.
+   */
+  void calcIndeces(const void *data, size_t length,
+                   uint64_t *bit_indeces) const;
+  /**
+   * Check whether ngrams of a length are stored in an exact bitmap. Every
+   * bit index computed for such an ngram is its bit in the bitmap.
+   * @param length The length of the ngram.
+   */
+  bool isExact(size_t length) const
+  {
+    return length >= (size_t)m_exact_min_ngram_size &&
+      length <= (size_t)m_exact_max_ngram_size;
+  }
+  /**
+   * Number of distinct bit indeces of an ngram: 1 if it is stored in an
+   * exact bitmap, getNumHashFunc() otherwise.
+   * @param length The length of the ngram.
+   */
+  size_t numIndeces(size_t length) const
+  {
+    return isExact(length) ? 1 : m_num_hash_func;
+  }
+  /**
+   * Bit index of an ngram in the exact bitmap for its length.
+   * @param data The ngram.
+   * @param length The length of data. isExact(length) must hold.
+   */
+  uint64_t exactIndex(const void *data, size_t length) const
+  {
+    const uint8_t *bytes = (const uint8_t *)data;
+    uint64_t value = 0;
+
+    for(size_t i = 0 ; i < length ; i++)
+      {
+        value = (value << 8) | bytes[i];
+      }
+    return m_exact_offset[length] + value;
+  }
+  /**
+   * Number of bits taken by the exact bitmaps for the ngram lengths from
+   * exact_min_ngram_size to exact_max_ngram_size, padded to a whole block.
+   */
+  static uint64_t exactBits(int exact_min_ngram_size,
+                            int exact_max_ngram_size);
+  /**
+   * Compute the bit indeces for eight ngrams of the same length at once.
+   * @param data The eight ngrams.
+   * @param length The length of each ngram.
+   * @param bit_indeces Output array with room for 8 * getNumHashFunc()
+   * entries; the indeces of ngram j start at j * getNumHashFunc().
+   */
+  void calcIndecesX8(const void * const data[8], size_t length,
+                     uint64_t *bit_indeces) const;
+  /**
+   * Compute the bit indeces for an ngram from its 128-bit hash using double
+   * hashing.
+   * @param hash_pair The two 64-bit halves of the ngram hash.
+   * @param bit_indeces Output array with room for getNumHashFunc() entries.
+   */
+  void indecesFromHashPair(const uint64_t hash_pair[2],
+                           uint64_t *bit_indeces) const;
+  /**
+   * Compute the bit indeces of every ngram of a payload whose length is
+   * between min_ngram_size and max_ngram_size. The ngrams are visited in
+   * whatever order hashes them fastest.
+   * @param data The content from the packet.
+   * @param length The length of data.
+   * @param min_ngram_size The minimum number of bytes in an ngram.
+   * @param max_ngram_size The maximum number of bytes in an ngram.
+   * @param sink Functor called with a pointer to the getNumHashFunc() bit
+   *    indeces of each ngram.
+   */
+  template <typename Sink>
+  void payloadIndeces(uint8_t const * data, size_t length,
+                      int min_ngram_size, int max_ngram_size,
+                      Sink sink) const;
   size_t getNumHashFunc() const
   {
     return m_num_hash_func;
   }
+  BloomLayout getLayout() const
+  {
+    return m_layout;
+  }
+  BloomIndexMode getIndexMode() const
+  {
+    return m_index_mode;
+  }
+  BloomHashFamily getHashFamily() const
+  {
+    return m_hash_family;
+  }
+  BloomSizing getSizing() const
+  {
+    return m_sizing;
+  }
+  /**
+   * Number of bits in a block of a LAYOUT_BLOCKED filter. This is one
+   * 64-byte cache line.
+   */
+  static const unsigned int BLOCK_SIZE_BITS = 512;
+  /**
+   * Longest ngram that can be stored in an exact bitmap.
+   */
+  static const int MAX_EXACT_NGRAM_SIZE = 3;
 protected:
   size_t m_num_hash_func;
   uint64_t m_filter_size_in_bits;
+  BloomLayout m_layout;
+  BloomIndexMode m_index_mode;
+  BloomHashFamily m_hash_family;
+  BloomSizing m_sizing;
+  int m_exact_min_ngram_size;
+  int m_exact_max_ngram_size;
+  // Bit index of the exact bitmap of each ngram length. The bitmaps follow
+  // the m_filter_size_in_bits Bloom filter bits.
+  uint64_t m_exact_offset[MAX_EXACT_NGRAM_SIZE + 1];
   std::vector<uint64_t> m_bit_index_vec;
+private:
+  /**
+   * Map a 64-bit hash to [0, range). range is a power of 2 unless the
+   * filter is SIZING_EXACT.
+   */
+  uint64_t reduce(uint64_t hash, uint64_t range) const
+  {
+    if(m_sizing == SIZING_EXACT)
+      {
+        return (uint64_t)(((unsigned __int128)hash * range) >> 64);
+      }
+    return hash & (range - 1);
+  }
 };
+
+template <typename Sink>
+void
+CalcBitIndeces::payloadIndeces(uint8_t const * data, size_t length,
+                               int min_ngram_size, int max_ngram_size,
+                               Sink sink) const
+{
+  size_t min_lgth = (min_ngram_size < 1) ? 1 : min_ngram_size;
+  std::vector<uint64_t> bit_indeces(8 * m_num_hash_func);
+
+  if(m_hash_family == HASH_MURMUR3)
+    {
+      // MurmurHash3 starts over for every ngram, so hash eight ngrams of the
+      // same length at a time instead, one ngram length after another.
+      for(size_t i = min_lgth ; i <= (size_t)max_ngram_size && i <= length ;
+          i++)
+        {
+          size_t num_ngrams = length - i + 1;
+          size_t offset = 0;
+
+          for( ; offset + 8 <= num_ngrams ; offset += 8)
+            {
+              const void *keys[8];
+
+              for(size_t lane = 0 ; lane < 8 ; lane++)
+                {
+                  keys[lane] = data + offset + lane;
+                }
+              calcIndecesX8(keys,i,bit_indeces.data());
+              for(size_t lane = 0 ; lane < 8 ; lane++)
+                {
+                  sink(bit_indeces.data() + lane * m_num_hash_func);
+                }
+            }
+          for( ; offset < num_ngrams ; offset++)
+            {
+              calcIndeces(data + offset,i,bit_indeces.data());
+              sink(bit_indeces.data());
+            }
+        }
+      return;
+    }
+
+  for(size_t offset = 0 ; offset < length ; offset++)
+    {
+      const uint8_t *cur = data + offset;
+      size_t cur_max_lgth = length - offset;
+
+      if(cur_max_lgth > (size_t)max_ngram_size)
+        {
+          cur_max_lgth = max_ngram_size;
+        }
+
+      // Each ngram at this offset extends the hash of the one before it
+      IncrementalNgramHash ngram_hash;
+
+      for(size_t i = 1 ; i <= cur_max_lgth ; i++)
+        {
+          ngram_hash.extend(cur[i - 1]);
+          if(i < min_lgth)
+            {
+              continue;
+            }
+          if(isExact(i))
+            {
+              std::fill(bit_indeces.begin(),
+                        bit_indeces.begin() + m_num_hash_func,
+                        exactIndex(cur,i));
+              sink(bit_indeces.data());
+              continue;
+            }
+          uint64_t hash_pair[2];
+          ngram_hash.finalize(i,hash_pair);
+          indecesFromHashPair(hash_pair,bit_indeces.data());
+          sink(bit_indeces.data());
+        }
+    }
+}
+
 //boost::shared_ptr<std::vector<uint64_t> >
 //calcBitIndeces(std::string ngram);
 /**
@@ -45,6 +370,16 @@ protected:
  *
  * This stores a Bloom filter for a range of ngram sizes from the payload of
  * large numbers of packets for a single TCP or UDP service.
+ *
+ * By default a filter must only be used from one thread at a time:
+ * contains() goes through an LRU cache of bit indeces that every lookup
+ * updates, and a LOAD_STREAM filter seeks a single stream. After
+ * setConcurrentReads(true), contains(), containsSpan() and containsBatch()
+ * may be called on the same filter from any number of threads at once,
+ * without locks. Lookups then compute their bit indeces on the stack,
+ * bypassing the cache, and a LOAD_STREAM filter reads its file with
+ * pread() on a descriptor of its own. LOAD_MMAP or LOAD_MEMORY are still
+ * the faster choice for many threads. Insertions are refused in this mode.
  */
 class BloomFilterBase : public BenignNgramStorage
 {
@@ -64,10 +399,27 @@ public:
    * @param port_num The tcp or udp port number of the captured traffic.
    * @param min_ngram_size The minimum number of bytes in a stored ngram.
    * @param max_ngram_size The maximum number of bytes in a stored ngram.
+   * @param layout Placement of the bits for an ngram, recorded in the
+   *    layout field of the binary file header.
+   * @param index_mode Derivation of the bit indeces from hashes, recorded in
+   *    the index_mode field of the binary file header.
+   * @param hash_family Hash function applied to ngrams, recorded in the
+   *    hash_family field of the binary file header. HASH_INCREMENTAL forces
+   *    INDEX_DOUBLE_HASH.
+   * @param sizing Choice of the number of bits, recorded in the sizing field
+   *    of the binary file header.
+   * @param short_ngrams Storage of the shortest ngrams. With
+   *    SHORT_NGRAMS_EXACT the longest ngram in an exact bitmap is recorded in
+   *    the exact_max_ngram_size field of the binary file header, 0 without
+   *    exact bitmaps.
    */
   BloomFilterBase(size_t inserted_items, double probability_false_positive,
               int ip_protocol_num, int port_num, int min_ngram_size,
-              int max_ngram_size);
+              int max_ngram_size, BloomLayout layout = LAYOUT_STANDARD,
+              BloomIndexMode index_mode = INDEX_PER_SEED,
+              BloomHashFamily hash_family = HASH_MURMUR3,
+              BloomSizing sizing = SIZING_EXACT,
+              BloomShortNgrams short_ngrams = SHORT_NGRAMS_HASHED);
   /**
    * Constructor for restoring Bloom filter from persistent store.
    * @param filename Name of file containing persistent Bloom filter.
@@ -75,6 +427,19 @@ public:
    *    false, file is accesed for each Bloom filter bit using fseek.
    */
   BloomFilterBase(const std::string &filename,bool from_mem_p);
+  /**
+   * Constructor for restoring Bloom filter from persistent store. The file
+   * starts with a binary header carrying a CRC, or with the text header of
+   * older files. A corrupt header, or a file too short for the bits, is
+   * rejected before any bits are read. With LOAD_MEMORY the CRC of the bits
+   * is checked as well.
+   * @param filename Name of file containing persistent Bloom filter.
+   * @param load_mode How the Bloom filter bits are accessed.
+   * @param mmap_hints BloomMmapHint values or'ed together. Only used with
+   *    LOAD_MMAP.
+   */
+  BloomFilterBase(const std::string &filename,BloomLoadMode load_mode,
+                  unsigned int mmap_hints = MMAP_HINT_RANDOM);
   /**
    * Destructor.
    */
@@ -95,7 +460,50 @@ public:
   virtual bool contains(uint8_t const * data, size_t length) = 0;
 
   /**
-   * Flush the data structure to a file.
+   * Insert an ngram. The bit indeces are computed into a buffer on the stack
+   * instead of going through the hash cache, so nothing is allocated.
+   * @param ngram The ngram to insert.
+   */
+  virtual void insertSpan(const NgramSpan &ngram);
+
+  /**
+   * Check to see if an ngram is stored in the Bloom filter. The bit indeces
+   * are computed into a buffer on the stack instead of going through the
+   * hash cache, so nothing is allocated.
+   * @param ngram The ngram to search for.
+   */
+  virtual bool containsSpan(const NgramSpan &ngram);
+
+  /**
+   * Check a batch of ngrams. The bit indeces for a group of ngrams are
+   * computed and their first bytes prefetched, and the group is resolved only
+   * after the next group's prefetches have been issued, so many cache misses
+   * are outstanding at once. The scratch vectors are reused from call to
+   * call, except in concurrent read mode.
+   * @param ngrams The ngrams to search for.
+   * @param results Resized to ngrams.size(); results[i] is true iff
+   *    ngrams[i] is stored in the Bloom filter.
+   */
+  virtual void containsBatch(const std::vector<NgramSpan> &ngrams,
+                             std::vector<bool> &results);
+
+  /**
+   * Insert every ngram of a payload whose length is between min_ngram_size
+   * and max_ngram_size. With HASH_INCREMENTAL the bit indeces are computed
+   * straight from the payload, without building a string or going through
+   * the hash cache, and each longer ngram at an offset extends the hash of
+   * the shorter one. Otherwise each ngram goes through insert().
+   * @param data The content from the packet.
+   * @param length The length of data.
+   * @param min_ngram_size The minimum number of bytes in an inserted ngram.
+   * @param max_ngram_size The maximum number of bytes in an inserted ngram.
+   */
+  virtual void insertNgrams(uint8_t const * data, size_t length,
+                            int min_ngram_size, int max_ngram_size);
+
+  /**
+   * Flush the data structure to a file. A LOAD_STREAM filter can not be
+   * flushed: its file already holds its bits.
    * @param filename Name of file used for persistence.
    */
   virtual bool flush(std::string filename);
@@ -116,14 +524,22 @@ public:
    */
   void WriteCombined(BloomFilterBase &other,std::string output_file);
 
-  virtual void signalDone()
-  {
-    // No-op, unless threaded
-  }
-  virtual void threadsCompleted()
-  {
-    // No-op, unless threaded
-  }
+  /**
+   * Writes out a Bloom filter that is the combination of several Bloom
+   * filters with the same parameters, having processed all their payload
+   * bytes. The bits are or'ed a chunk at a time, by several threads, from
+   * memory or the mapping of each filter when they are loaded or mapped,
+   * and read from the file otherwise; LOAD_MMAP is the fastest way to load
+   * large filters for this.
+   * @param filters The Bloom filters to combine.
+   * @param output_file Filename into which result Bloom Filter will be
+   *    written.
+   * @param num_threads Number of threads combining each chunk.
+   */
+  static void WriteCombined(const std::vector<BloomFilterBase *> &filters,
+                            std::string output_file,
+                            unsigned int num_threads = 1);
+
   virtual bool bloomInsertionDone()
   {
     return true;
@@ -132,6 +548,8 @@ public:
   static const unsigned int CHAR_SIZE_BITS = 8;
   static const uint32_t HeaderLengthInBytes = 4096;
   static const unsigned int NUM_CACHE_ENTRIES = 200000;
+  static const unsigned int BATCH_GROUP_SIZE = 8;
+  static const unsigned int BATCH_PREFETCH_HASHES = 4;
 
   /**
      @brief Type to use for the length (in bits) of a bloom filter
@@ -143,9 +561,192 @@ public:
   */
   typedef uint_fast64_t num_hashes_type;
 
+  /**
+     @brief Storage for the bits of the filter, aligned so that a block of
+     a LAYOUT_BLOCKED filter occupies exactly one cache line.
+  */
+  typedef std::vector<uint8_t, CacheAlignedAllocator<uint8_t> > bit_array_type;
+
   const static unsigned char BIT_MASK[];
 
+  BloomLayout getLayout() const
+  {
+    return m_layout;
+  }
+
+  BloomIndexMode getIndexMode() const
+  {
+    return m_index_mode;
+  }
+
+  BloomHashFamily getHashFamily() const
+  {
+    return m_hash_family;
+  }
+
+  BloomSizing getSizing() const
+  {
+    return m_sizing;
+  }
+
+  BloomLoadMode getLoadMode() const
+  {
+    return m_load_mode;
+  }
+
+  /**
+   * Have flush() compress the bits of a sparsely filled filter, as runs of
+   * zero and literal 64-bit words or as the gaps between set bits,
+   * whichever is smallest, when that is smaller than the bits. The bits are
+   * expanded again when the filter is loaded, whatever the load mode.
+   * @param compress Whether to compress.
+   */
+  void setCompressOutput(bool compress)
+  {
+    m_compress_output = compress;
+  }
+
+  /**
+   * Number of set bits of the Bloom filter, not counting the exact bitmaps.
+   * For a LOAD_STREAM or LOAD_MMAP filter whose header records it, this is
+   * taken from the header; otherwise the bits are counted.
+   */
+  uint64_t setBitCount();
+
+  /**
+   * Fraction of the bits of the Bloom filter that are set. A filter sized
+   * for the ngrams it holds is about half full; a fuller filter is
+   * saturated and should be rebuilt larger.
+   */
+  double fillRatio();
+
+  /**
+   * Number of distinct ngrams in the Bloom filter, estimated from
+   * setBitCount().
+   */
+  double estimatedNgrams();
+
+  /**
+   * False positive rate of the Bloom filter, estimated from setBitCount().
+   */
+  double estimatedFalsePositiveRate();
+
+  /**
+   * Describe the statistics of the Bloom filter derived from setBitCount().
+   */
+  std::string statisticsString();
+
+  /**
+   * Switch concurrent read mode on or off. Must not be called while
+   * lookups are running on other threads.
+   * @param concurrent Whether lookups may run on many threads at once.
+   */
+  void setConcurrentReads(bool concurrent);
+
+  bool getConcurrentReads() const
+  {
+    return m_concurrent_reads;
+  }
+
+  /**
+   * Longest ngram stored in an exact bitmap, or 0 if none is.
+   */
+  int getExactMaxNgramSize() const
+  {
+    return m_exact_max_ngram_size;
+  }
+
 protected:
+  /**
+   * Turn on the bits at the given indeces, either in memory or in the
+   * backing file.
+   * @param indeces Bit indeces produced by CalcBitIndeces.
+   * @param num_indeces Number of entries in indeces.
+   */
+  void setBitIndeces(const uint64_t *indeces, size_t num_indeces);
+  void setBitIndeces(const std::vector<uint64_t> &indeces)
+  {
+    setBitIndeces(indeces.data(),indeces.size());
+  }
+  /**
+   * Test the bits at the given indeces, either in memory or in the
+   * backing file.
+   * @param indeces Bit indeces produced by CalcBitIndeces.
+   * @param num_indeces Number of entries in indeces.
+   * @return True iff all the bits are on.
+   */
+  bool testBitIndeces(const uint64_t *indeces, size_t num_indeces);
+  bool testBitIndeces(const std::vector<uint64_t> &indeces)
+  {
+    return testBitIndeces(indeces.data(),indeces.size());
+  }
+  /**
+   * Serialize the binary header that precedes the bits in a .bloom file.
+   * @param bytes_processed Number of payload bytes the filter was built
+   *    from.
+   * @param has_payload_crc Whether payload_crc is the CRC of the bits.
+   * @param payload_crc CRC-32C of the bits.
+   * @param encoding The BloomFilterHeader flag of the compression of the
+   *    bits, or 0 if they are written as they are.
+   * @param set_bits Number of set bits of the Bloom filter, or -1 if not
+   *    known.
+   */
+  std::string headerString(unsigned long long int bytes_processed,
+                           bool has_payload_crc,
+                           uint32_t payload_crc = 0,
+                           uint8_t encoding = 0,
+                           int64_t set_bits = -1) const;
+  /**
+   * Count the set bits of the Bloom filter, not counting the exact bitmaps.
+   */
+  uint64_t countSetBits();
+  /**
+   * Load the Bloom filter specific properties of a text header, as written
+   * before the binary header, and remove them from bf_properties.
+   */
+  void loadTextProperties(std::map<std::string,std::string>
+                          &bf_properties);
+  /**
+   * Rewrite the header of a LOAD_STREAM filter without the CRC of the bits,
+   * before they are first modified in place.
+   */
+  void dropPayloadCrc();
+  /**
+   * Copy bytes of the bits, from memory or from the backing file.
+   * @param offset Offset of the first byte within the bits.
+   * @param buffer Receives the bytes.
+   * @param length Number of bytes to copy.
+   * @return False if the file could not be read.
+   */
+  bool readBitBytes(uint64_t offset, char *buffer, size_t length);
+  /**
+   * Read bytes of the bits from the backing file: through the stream, or
+   * with pread() in concurrent read mode.
+   * @param offset Offset of the first byte within the bits.
+   * @param buffer Receives the bytes.
+   * @param length Number of bytes to read.
+   * @return False if the file could not be read.
+   */
+  bool readFileBytes(uint64_t offset, void *buffer, size_t length);
+  /**
+   * Map the bits of a LOAD_MMAP filter read-only and point m_bits at them.
+   * @param filename Name of file containing persistent Bloom filter.
+   * @param mmap_hints BloomMmapHint values or'ed together.
+   */
+  void mapBits(const std::string &filename,unsigned int mmap_hints);
+  /**
+   * Build the CalcBitIndeces for the parameters of the filter.
+   */
+  CalcBitIndeces makeCalcBitIndeces() const;
+  /**
+   * Number of bytes of filter data: the Bloom filter bits followed by the
+   * exact bitmaps.
+   */
+  size_t bitArrayBytes() const
+  {
+    return (m_bitlength + m_exact_bitlength) >> 3;
+  }
+
   /**
      @brief Number of bits in the bloom filter.
   */
@@ -156,10 +757,70 @@ protected:
   */
   num_hashes_type m_num_hashes;
 
-  std::vector<uint8_t> mBloomFilter;
+  bit_array_type mBloomFilter;
+
+  /**
+     @brief The bits of the filter when they are addressable: the data of
+     mBloomFilter, or the read-only mapping of a LOAD_MMAP filter. NULL for
+     LOAD_STREAM.
+  */
+  uint8_t *m_bits;
+
+  BloomLoadMode m_load_mode;
+
+  void *m_mmap_addr;
+
+  size_t m_mmap_length;
+
+  BloomLayout m_layout;
+
+  BloomIndexMode m_index_mode;
+
+  BloomHashFamily m_hash_family;
+  BloomSizing m_sizing;
+
+  /**
+     @brief Longest ngram stored in an exact bitmap, or 0 if none is. The
+     bitmaps cover the lengths from m_min_ngram_size up.
+  */
+  int m_exact_max_ngram_size;
+
+  /**
+     @brief Number of bits of the exact bitmaps, which follow the
+     m_bitlength bits of the Bloom filter.
+  */
+  index_type m_exact_bitlength;
 
   bool m_blm_frm_mem;
 
+  /**
+     @brief The header of a LOAD_STREAM filter's file still holds the CRC
+     of its bits.
+  */
+  bool m_stream_payload_crc;
+
+  /**
+     @brief flush() compresses the bits when that saves space.
+  */
+  bool m_compress_output;
+
+  /**
+     @brief Number of set bits recorded in the header, or -1 if the header
+     records none or the bits have changed since.
+  */
+  int64_t m_header_set_bits;
+
+  /**
+     @brief Lookups may run on many threads at once.
+  */
+  bool m_concurrent_reads;
+
+  /**
+     @brief Read-only descriptor of a LOAD_STREAM filter's file, for
+     concurrent reads, or -1.
+  */
+  int m_read_fd;
+
   std::fstream m_bf_stream;
 
   boost::shared_ptr<lru_cache_using_std<
@@ -168,5 +829,13 @@ protected:
                       boost::unordered_map> > m_cache;
   CalcBitIndeces m_calc_bit_indeces;
 
+  /**
+     @brief Scratch space of containsBatch(), kept between calls unless
+     lookups may run on many threads at once.
+  */
+  std::vector<size_t> m_batch_first_of_length;
+  std::vector<size_t> m_batch_order;
+  std::vector<uint64_t> m_batch_indeces;
+
 };
 #endif
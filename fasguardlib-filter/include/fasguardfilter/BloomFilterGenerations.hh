@@ -0,0 +1,169 @@
+#ifndef BLOOM_FILTER_GENERATIONS_HH
+#define BLOOM_FILTER_GENERATIONS_HH
+#include <deque>
+#include <string>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+#include <fasguardfilter/BenignNgramStorage.hh>
+#include <fasguardfilter/BloomFilterBase.hh>
+
+/**
+ * @brief Benign ngram storage made of a rotating set of filters.
+ *
+ * Each generation is an ordinary, partitioned or scalable Bloom, cuckoo or
+ * binary fuse filter, typically built by makebloom from a day of traffic.
+ * An ngram is contained if any generation contains it. Adding a generation
+ * beyond the maximum drops the oldest one, so old traffic ages out and new
+ * traffic is added without rebuilding the filters for the traffic that is
+ * kept.
+ *
+ * The store is persisted as a manifest file, which lists the generations
+ * oldest first, and one filter file per generation next to it named after
+ * the manifest. The first line of the manifest is ManifestFirstLine, so a
+ * reader can tell a manifest from a .bloom file.
+ */
+class BloomFilterGenerations : public BenignNgramStorage
+{
+public:
+  /**
+   * Constructor for an empty store.
+   * @param max_generations Number of generations kept.
+   * @param ip_protocol_num This is the protocol field number that appears in
+   *    the ip header.
+   * @param port_num The tcp or udp port number of the captured traffic.
+   * @param min_ngram_size The minimum number of bytes in a stored ngram.
+   * @param max_ngram_size The maximum number of bytes in a stored ngram.
+   */
+  BloomFilterGenerations(unsigned int max_generations, int ip_protocol_num,
+                         int port_num, int min_ngram_size,
+                         int max_ngram_size);
+  /**
+   * Constructor for restoring the store from a manifest. The newest
+   * generation is always loaded in memory so that it can take insertions,
+   * unless it is a binary fuse filter, which can not.
+   * @param filename Name of the manifest file.
+   * @param load_mode How the bits of the older generations are accessed.
+   * @param mmap_hints BloomMmapHint values or'ed together. Only used with
+   *    LOAD_MMAP.
+   */
+  BloomFilterGenerations(const std::string &filename,
+                         BloomLoadMode load_mode,
+                         unsigned int mmap_hints = MMAP_HINT_RANDOM);
+  /**
+   * Destructor.
+   */
+  ~BloomFilterGenerations();
+
+  /**
+   * Insert an ngram into the newest generation.
+   * @param data The ngram.
+   * @param length The length of data.
+   */
+  virtual void insert(uint8_t const * data, size_t length);
+
+  /**
+   * Check to see if an ngram is stored in any generation.
+   * @param data The string to search for.
+   * @param length The length of data.
+   */
+  virtual bool contains(uint8_t const * data, size_t length);
+
+  /**
+   * Insert an ngram into the newest generation without copying it.
+   * @param ngram The ngram to insert.
+   */
+  virtual void insertSpan(const NgramSpan &ngram);
+
+  /**
+   * Check to see if an ngram is stored in any generation without copying
+   * it. The newest generation is checked first.
+   * @param ngram The ngram to search for.
+   */
+  virtual bool containsSpan(const NgramSpan &ngram);
+
+  /**
+   * Check a batch of ngrams. Each generation, newest first, looks up only
+   * the ngrams that no newer generation contains.
+   * @param ngrams The ngrams to search for.
+   * @param results Resized to ngrams.size(); results[i] is true iff
+   *    ngrams[i] is stored in some generation.
+   */
+  virtual void containsBatch(const std::vector<NgramSpan> &ngrams,
+                             std::vector<bool> &results);
+
+  /**
+   * Write the generations that changed since the store was loaded to new
+   * files, then the manifest, then remove the files of the generations that
+   * were dropped or replaced. The manifest is replaced with a rename, so a
+   * reader sees either the old or the new set of generations.
+   * @param filename Name of the manifest file.
+   */
+  virtual bool flush(std::string filename);
+
+  /**
+   * Make a filter the newest generation, and drop the oldest generations
+   * beyond the maximum. The filter must store the same kind of traffic as
+   * the store; its type, size and hashing may differ from the other
+   * generations.
+   * @param generation The new generation. It must be held in memory.
+   */
+  void addGeneration(boost::shared_ptr<BenignNgramStorage> generation);
+
+  /**
+   * Change the number of generations kept. Excess generations are dropped
+   * oldest first.
+   * @param max_generations Number of generations kept.
+   */
+  void setMaxGenerations(unsigned int max_generations);
+
+  unsigned int getMaxGenerations() const
+  {
+    return m_max_generations;
+  }
+
+  size_t getNumGenerations() const
+  {
+    return m_generations.size();
+  }
+
+  /**
+   * Check whether a file is a manifest written by flush().
+   * @param filename Name of the file.
+   */
+  static bool isManifest(const std::string &filename);
+
+  static const std::string ManifestFirstLine;
+
+protected:
+  /**
+   * A generation and the name of its file. The name is empty until the
+   * generation is first flushed, and dirty is set when the generation has
+   * changed since it was last written.
+   */
+  struct Generation
+  {
+    boost::shared_ptr<BenignNgramStorage> filter;
+    std::string file;
+    bool dirty;
+  };
+
+  /**
+   * Drop the oldest generations beyond m_max_generations.
+   */
+  void dropExcess();
+
+  std::deque<Generation> m_generations;
+
+  /**
+   * Files of dropped generations, removed by the next flush().
+   */
+  std::vector<std::string> m_dropped_files;
+
+  unsigned int m_max_generations;
+
+  /**
+   * Sequence number for the file of the next generation flushed.
+   */
+  unsigned long int m_next_sequence;
+};
+#endif
@@ -0,0 +1,250 @@
+#ifndef BLOOM_FILTER_PARTITIONED_HH
+#define BLOOM_FILTER_PARTITIONED_HH
+#include <string>
+#include <vector>
+#include <fasguardfilter/BenignNgramStorage.hh>
+#include <fasguardfilter/BloomFilterBase.hh>
+#include <fasguardfilter/CacheAlignedAllocator.hh>
+
+/**
+ * @brief Bloom filter with one partition per ngram length.
+ *
+ * Every ngram length from MIN_NGRAM_SIZE to MAX_NGRAM_SIZE has its own
+ * Bloom filter, sized for the number of distinct ngrams of that length, so
+ * every length gets the requested false positive rate and a lookup only
+ * touches the partition for its length. Short lengths have few distinct
+ * ngrams, so their partitions are small and stay in the cache. A partition
+ * for a length of at most CalcBitIndeces::MAX_EXACT_NGRAM_SIZE bytes is an
+ * exact bitmap instead whenever the bitmap is no larger than the Bloom
+ * filter would be.
+ *
+ * The number of distinct ngrams of each length is only known once all of
+ * them have been seen. While the filter is being built, insert() records a
+ * 64-bit hash of each ngram per length (or the ngram itself, for the
+ * lengths that may get an exact bitmap), and flush() sizes the partitions
+ * from the distinct hashes, sets their bits and writes the filter. The
+ * hashes are deduplicated whenever their number doubles, so until flush()
+ * they take 8 to 16 bytes per distinct ngram, before vector growth. That
+ * is several times the finished filter, which needs about 3 bytes per
+ * ngram at a false positive rate of 1e-5, so use the constructor that
+ * takes estimates when memory is tight. contains() is only available on a
+ * filter restored from a file, which can also take further insertions.
+ *
+ * A filter constructed with an estimate of the number of distinct ngrams of
+ * each length, from NgramCardinalityEstimator, is sized up front instead.
+ * insert() then sets the bits straight away, no hashes are recorded and
+ * contains() is available throughout.
+ *
+ * The file has a HeaderLengthInBytes text header whose first line is
+ * FileFirstLine, followed by the partitions in order of length. Each
+ * partition starts on a cache line.
+ */
+class BloomFilterPartitioned : public BenignNgramStorage
+{
+public:
+  /**
+   * Constructor for building a filter. Every distinct ngram inserted is kept
+   * as a 64-bit hash until flush(), see above.
+   * @param probability_false_positive Desired probability of false postive
+   *    for each partition. Used for partition sizing.
+   * @param ip_protocol_num This is the protocol field number that appears in
+   *    the ip header.
+   * @param port_num The tcp or udp port number of the captured traffic.
+   * @param min_ngram_size The minimum number of bytes in a stored ngram.
+   * @param max_ngram_size The maximum number of bytes in a stored ngram.
+   */
+  BloomFilterPartitioned(double probability_false_positive,
+                         int ip_protocol_num, int port_num,
+                         int min_ngram_size, int max_ngram_size);
+  /**
+   * Constructor for building a filter whose partitions are sized from
+   * estimates rather than from the ngrams inserted.
+   * @param estimated_items estimated_items[i] is the estimated number of
+   *    distinct ngrams of length min_ngram_size + i. Missing lengths are
+   *    sized for none.
+   * @param probability_false_positive Desired probability of false postive
+   *    for each partition. Used for partition sizing.
+   * @param ip_protocol_num This is the protocol field number that appears in
+   *    the ip header.
+   * @param port_num The tcp or udp port number of the captured traffic.
+   * @param min_ngram_size The minimum number of bytes in a stored ngram.
+   * @param max_ngram_size The maximum number of bytes in a stored ngram.
+   */
+  BloomFilterPartitioned(const std::vector<uint64_t> &estimated_items,
+                         double probability_false_positive,
+                         int ip_protocol_num, int port_num,
+                         int min_ngram_size, int max_ngram_size);
+  /**
+   * Constructor for restoring a partitioned filter from persistent store.
+   * @param filename Name of file containing the persistent filter.
+   * @param load_mode How the bits are accessed. LOAD_STREAM is treated as
+   *    LOAD_MEMORY.
+   * @param mmap_hints BloomMmapHint values or'ed together. Only used with
+   *    LOAD_MMAP.
+   */
+  BloomFilterPartitioned(const std::string &filename,
+                         BloomLoadMode load_mode,
+                         unsigned int mmap_hints = MMAP_HINT_RANDOM);
+  /**
+   * Destructor.
+   */
+  ~BloomFilterPartitioned();
+
+  virtual void insert(uint8_t const * data, size_t length);
+
+  virtual bool contains(uint8_t const * data, size_t length);
+
+  /**
+   * Insert an ngram: record its hash while the filter is being built, set
+   * its bits otherwise.
+   * @param ngram The ngram to insert.
+   */
+  virtual void insertSpan(const NgramSpan &ngram);
+
+  /**
+   * Check to see if an ngram is stored in the partition for its length.
+   * @param ngram The ngram to search for.
+   */
+  virtual bool containsSpan(const NgramSpan &ngram);
+
+  /**
+   * Check a batch of ngrams. The ngrams are visited ordered by length, so
+   * consecutive lookups share a partition, and the first bits of a group of
+   * ngrams are prefetched before the previous group is resolved.
+   * @param ngrams The ngrams to search for.
+   * @param results Resized to ngrams.size(); results[i] is true iff
+   *    ngrams[i] is stored in the filter.
+   */
+  virtual void containsBatch(const std::vector<NgramSpan> &ngrams,
+                             std::vector<bool> &results);
+
+  /**
+   * Size and fill the partitions from the recorded hashes, if the filter is
+   * being built, and write the filter to a file.
+   * @param filename Name of file used for persistence.
+   */
+  virtual bool flush(std::string filename);
+
+  /**
+   * Check whether a file holds a partitioned Bloom filter.
+   * @param filename Name of the file.
+   */
+  static bool isPartitionedFile(const std::string &filename);
+
+  static const std::string FileFirstLine;
+  static const unsigned int BATCH_GROUP_SIZE = 8;
+  static const unsigned int BATCH_PREFETCH_HASHES = 4;
+  /**
+   * Number of hashes recorded for a length before they are first
+   * deduplicated.
+   */
+  static const size_t MIN_COMPACT_KEYS = 65536;
+
+protected:
+  /**
+   * A Bloom filter or exact bitmap for a single ngram length. An exact
+   * bitmap has no hashes and one bit per possible ngram.
+   */
+  struct Partition
+  {
+    uint64_t bitlength;
+    uint64_t num_hashes;
+    uint64_t num_items;
+    // Offset of the partition in the bits, in bytes
+    uint64_t offset;
+    CalcBitIndeces calc_bit_indeces;
+  };
+
+  /**
+   * 64-bit hash of an ngram, from which the bit indeces of every partition
+   * size are derived.
+   */
+  static uint64_t ngramKey(uint8_t const * data, size_t length);
+  /**
+   * What a build records for an ngram: ngramKey(), or the bytes of the
+   * ngram itself if it is short enough for an exact bitmap.
+   */
+  static uint64_t buildKey(uint8_t const * data, size_t length);
+  /**
+   * The partition for an ngram length, or NULL if the length is not
+   * stored.
+   */
+  const Partition *partition(size_t length) const
+  {
+    if(length < (size_t)m_min_ngram_size ||
+       length > (size_t)m_max_ngram_size)
+      {
+        return NULL;
+      }
+    return &m_partitions[length - m_min_ngram_size];
+  }
+  /**
+   * Position of the partition for an ngram length, or the number of
+   * partitions if the length is not stored.
+   */
+  size_t lengthSlot(size_t length) const
+  {
+    if(length < (size_t)m_min_ngram_size ||
+       length > (size_t)m_max_ngram_size)
+      {
+        return m_partitions.size();
+      }
+    return length - m_min_ngram_size;
+  }
+  /**
+   * Compute the bit indeces of an ngram within its partition, relative to
+   * the start of the partition.
+   * @return The number of indeces.
+   */
+  size_t bitIndeces(const Partition &part, uint8_t const * data,
+                    size_t length, uint64_t *bit_indeces) const;
+  size_t keyIndeces(const Partition &part, uint64_t key,
+                    uint64_t *bit_indeces) const;
+  bool testBits(const Partition &part, const uint64_t *bit_indeces,
+                size_t num_indeces) const;
+  void setBits(const Partition &part, const uint64_t *bit_indeces,
+               size_t num_indeces);
+  /**
+   * Sort and deduplicate the hashes recorded for one length.
+   */
+  void compactKeys(size_t partition);
+  /**
+   * Size the partitions from the recorded hashes and set their bits.
+   */
+  void build();
+  /**
+   * Choose the size and number of hashes of a partition for num_items
+   * distinct ngrams of a length.
+   */
+  void sizePartition(Partition &part, size_t length, uint64_t num_items);
+  /**
+   * Compute the partition offsets and the CalcBitIndeces from their sizes.
+   * @return The number of bytes of all the partitions.
+   */
+  size_t layoutPartitions();
+  void mapBits(const std::string &filename, unsigned int mmap_hints);
+
+  double m_probability_false_positive;
+
+  std::vector<Partition> m_partitions;
+
+  // Build state
+  bool m_building;
+  std::vector<std::vector<uint64_t> > m_keys;
+  std::vector<size_t> m_compacted_size;
+
+  BloomFilterBase::bit_array_type m_bit_array;
+
+  // The partitions: the data of m_bit_array, or the read-only mapping of a
+  // LOAD_MMAP filter
+  uint8_t *m_bits;
+
+  size_t m_bits_length;
+
+  BloomLoadMode m_load_mode;
+
+  void *m_mmap_addr;
+
+  size_t m_mmap_length;
+};
+#endif
@@ -0,0 +1,175 @@
+#ifndef BLOOM_FILTER_SCALABLE_HH
+#define BLOOM_FILTER_SCALABLE_HH
+#include <deque>
+#include <string>
+#include <vector>
+#include <fasguardfilter/BenignNgramStorage.hh>
+#include <fasguardfilter/BloomFilterBase.hh>
+#include <fasguardfilter/CacheAlignedAllocator.hh>
+
+/**
+ * @brief Bloom filter that grows with the number of ngrams inserted.
+ *
+ * The filter is a chain of stages, each a Bloom filter sized for a number of
+ * ngrams, its capacity. Once the newest stage holds as many ngrams as its
+ * capacity, which leaves about half its bits set, the next ngram starts a
+ * new stage with growth times the capacity and tightening times the false
+ * positive rate. With a false positive rate of P*(1-tightening) for the
+ * first stage, the rate of the whole chain stays below P however many
+ * stages are added, so the number of ngrams need not be known in advance.
+ *
+ * An ngram already contained in some stage is not inserted again, so that
+ * the ngram counts of the stages only count distinct ngrams. Lookups test
+ * the stages newest first.
+ *
+ * The file has a HeaderLengthInBytes text header whose first line is
+ * FileFirstLine, followed by the stages oldest first. Each stage starts on
+ * a cache line.
+ */
+class BloomFilterScalable : public BenignNgramStorage
+{
+public:
+  /**
+   * Constructor for building a filter.
+   * @param initial_items Capacity of the first stage: an estimate of the
+   *    number of ngrams that will be inserted.
+   * @param probability_false_positive Desired probability of false postive
+   *    for the whole filter.
+   * @param ip_protocol_num This is the protocol field number that appears in
+   *    the ip header.
+   * @param port_num The tcp or udp port number of the captured traffic.
+   * @param min_ngram_size The minimum number of bytes in a stored ngram.
+   * @param max_ngram_size The maximum number of bytes in a stored ngram.
+   * @param growth Ratio of the capacities of consecutive stages.
+   * @param tightening Ratio of the false positive rates of consecutive
+   *    stages.
+   */
+  BloomFilterScalable(size_t initial_items,
+                      double probability_false_positive,
+                      int ip_protocol_num, int port_num,
+                      int min_ngram_size, int max_ngram_size,
+                      double growth = DEFAULT_GROWTH,
+                      double tightening = DEFAULT_TIGHTENING);
+  /**
+   * Constructor for restoring a scalable filter from persistent store.
+   * @param filename Name of file containing the persistent filter.
+   * @param load_mode How the bits are accessed. LOAD_STREAM is treated as
+   *    LOAD_MEMORY. A LOAD_MMAP filter can not take insertions.
+   * @param mmap_hints BloomMmapHint values or'ed together. Only used with
+   *    LOAD_MMAP.
+   */
+  BloomFilterScalable(const std::string &filename,
+                      BloomLoadMode load_mode,
+                      unsigned int mmap_hints = MMAP_HINT_RANDOM);
+  /**
+   * Destructor.
+   */
+  ~BloomFilterScalable();
+
+  virtual void insert(uint8_t const * data, size_t length);
+
+  virtual bool contains(uint8_t const * data, size_t length);
+
+  /**
+   * Insert an ngram into the newest stage, unless some stage already
+   * contains it. A full newest stage is followed by a new one first.
+   * @param ngram The ngram to insert.
+   */
+  virtual void insertSpan(const NgramSpan &ngram);
+
+  /**
+   * Check to see if an ngram is stored in any stage, newest first.
+   * @param ngram The ngram to search for.
+   */
+  virtual bool containsSpan(const NgramSpan &ngram);
+
+  /**
+   * Write the filter to a file.
+   * @param filename Name of file used for persistence.
+   */
+  virtual bool flush(std::string filename);
+
+  size_t getNumStages() const
+  {
+    return m_stages.size();
+  }
+
+  /**
+   * Check whether a file holds a scalable Bloom filter.
+   * @param filename Name of the file.
+   */
+  static bool isScalableFile(const std::string &filename);
+
+  static const std::string FileFirstLine;
+  static const double DEFAULT_GROWTH;
+  static const double DEFAULT_TIGHTENING;
+
+protected:
+  /**
+   * A Bloom filter in the chain.
+   */
+  struct Stage
+  {
+    uint64_t bitlength;
+    uint64_t num_hashes;
+    uint64_t capacity;
+    uint64_t num_items;
+    uint8_t *bits;
+    CalcBitIndeces calc_bit_indeces;
+  };
+
+  /**
+   * 64-bit hash of an ngram, from which the bit indeces of every stage are
+   * derived.
+   */
+  static uint64_t ngramKey(uint8_t const * data, size_t length);
+  /**
+   * Compute the bit indeces of an ngram key within a stage.
+   * @return The number of indeces.
+   */
+  size_t keyIndeces(size_t stage, uint64_t key, uint64_t *bit_indeces) const;
+  bool containsKey(uint64_t key) const;
+  /**
+   * Size a stage for its capacity and false positive rate.
+   */
+  void sizeStage(Stage &stage, double probability_false_positive) const;
+  /**
+   * Capacity and false positive rate of the stage after the last one.
+   */
+  uint64_t nextCapacity() const;
+  double nextProbability() const;
+  /**
+   * Append an empty stage, held in memory.
+   */
+  void addStage();
+  /**
+   * Byte offset of each stage in the file, after the header.
+   * @return The number of bytes of all the stages.
+   */
+  size_t layoutStages(std::vector<size_t> &offsets) const;
+  void mapBits(const std::string &filename, unsigned int mmap_hints,
+               size_t bits_length);
+
+  uint64_t m_initial_items;
+
+  double m_probability_false_positive;
+
+  double m_growth;
+
+  double m_tightening;
+
+  std::vector<Stage> m_stages;
+
+  /**
+   * Bits of the stages held in memory. A deque, so that adding a stage does
+   * not move the bits of the others.
+   */
+  std::deque<BloomFilterBase::bit_array_type> m_bit_arrays;
+
+  BloomLoadMode m_load_mode;
+
+  void *m_mmap_addr;
+
+  size_t m_mmap_length;
+};
+#endif
@@ -6,12 +6,30 @@
 #include <boost/unordered_map.hpp>
 #include <fasguardfilter/lru_cache_using_std.h>
 #include <boost/thread/thread.hpp>
-#include <boost/lockfree/queue.hpp>
 #include <fasguardfilter/BloomFilterBase.hh>
 #include <fasguardfilter/HashThread.hh>
 
 std::vector<HashThread> ht_vec;
 
+/**
+ * @brief Where the HashThreads of a BloomFilterThreaded set their bits.
+ *
+ * With BUILD_SHARED all the threads set bits in the filter with atomic
+ * operations. With BUILD_PARTIAL every thread allocates and fills a private
+ * partial filter for its share of the payloads without atomics, and the
+ * partial filters are or'ed into the filter once the threads are done. The
+ * partials are allocated by their threads, so on NUMA machines they live
+ * next to the threads that fill them. BUILD_PARTIAL_IN_PLACE is the same
+ * except that the first thread fills the filter itself, which saves the
+ * memory of one partial.
+ */
+enum BloomBuildStrategy
+{
+  BUILD_SHARED = 0,
+  BUILD_PARTIAL = 1,
+  BUILD_PARTIAL_IN_PLACE = 2
+};
+
 //boost::shared_ptr<std::vector<uint64_t> >
 //calcBitIndeces(std::string ngram);
 /**
@@ -38,17 +56,44 @@ public:
    * @param port_num The tcp or udp port number of the captured traffic.
    * @param min_ngram_size The minimum number of bytes in a stored ngram.
    * @param max_ngram_size The maximum number of bytes in a stored ngram.
+   * @param thread_num Number of HashThread threads to start.
+   * @param layout Placement of the bits for an ngram.
+   * @param index_mode Derivation of the bit indeces from hashes.
+   * @param hash_family Hash function applied to ngrams.
+   * @param sizing Choice of the number of bits.
+   * @param build_strategy Where the HashThreads set their bits.
+   * @param short_ngrams Storage of the shortest ngrams.
+   * The layout, index mode, hash family, sizing and exact bitmaps are
+   * recorded in the binary file header, as for BloomFilterBase.
    */
   BloomFilterThreaded(size_t inserted_items, double probability_false_positive,
               int ip_protocol_num, int port_num, int min_ngram_size,
-                      int max_ngram_size,int thread_num);
+                      int max_ngram_size,int thread_num,
+                      BloomLayout layout = LAYOUT_STANDARD,
+                      BloomIndexMode index_mode = INDEX_PER_SEED,
+                      BloomHashFamily hash_family = HASH_MURMUR3,
+                      BloomSizing sizing = SIZING_EXACT,
+                      BloomBuildStrategy build_strategy = BUILD_SHARED,
+                      BloomShortNgrams short_ngrams = SHORT_NGRAMS_HASHED);
   /**
-   * Constructor for restoring Bloom filter from persistent store.
+   * Constructor for restoring Bloom filter from persistent store. A restored
+   * filter has no HashThreads, so it can only be queried: load it as a
+   * BloomFilterUnthreaded to add ngrams.
    * @param filename Name of file containing persistent Bloom filter.
    * @param from_mem_p If true, Bloom filter data is loaded in memory. If
    *    false, file is accesed for each Bloom filter bit using fseek.
    */
   BloomFilterThreaded(const std::string &filename,bool from_mem_p);
+  /**
+   * Constructor for restoring Bloom filter from persistent store. Like the
+   * one above, the restored filter can only be queried.
+   * @param filename Name of file containing persistent Bloom filter.
+   * @param load_mode How the Bloom filter bits are accessed.
+   * @param mmap_hints BloomMmapHint values or'ed together. Only used with
+   *    LOAD_MMAP.
+   */
+  BloomFilterThreaded(const std::string &filename,BloomLoadMode load_mode,
+                      unsigned int mmap_hints = MMAP_HINT_RANDOM);
   /**
    * Destructor.
    */
@@ -60,6 +105,25 @@ public:
    */
   virtual void insert(uint8_t const * data, size_t length);
 
+  /**
+   * Insert an ngram. The bits are set by the HashThreads, so this goes
+   * through insert().
+   * @param ngram The ngram to insert.
+   */
+  virtual void insertSpan(const NgramSpan &ngram);
+
+  /**
+   * Insert every ngram of a payload whose length is between min_ngram_size
+   * and max_ngram_size. The payload is queued whole for a HashThread, which
+   * enumerates the ngrams itself.
+   * @param data The content from the packet.
+   * @param length The length of data.
+   * @param min_ngram_size The minimum number of bytes in an inserted ngram.
+   * @param max_ngram_size The maximum number of bytes in an inserted ngram.
+   */
+  virtual void insertNgrams(uint8_t const * data, size_t length,
+                            int min_ngram_size, int max_ngram_size);
+
   /**
    * Check to see if a string is stored in the data structure. Typically, the
    * string is an ngram.
@@ -90,29 +154,36 @@ public:
    */
   void WriteCombined(BloomFilterThreaded &other,std::string output_file);
 
-  void signalDone()
-  {
-    m_ngram_done = true;
-  }
+  /**
+   * Tell the HashThreads that no more ngrams will be inserted, waking up
+   * any that are waiting for ngrams.
+   */
+  void signalDone();
 
-  void threadsCompleted()
-  {
-    while(m_shutdown_thread_count < m_thread_num)
-      {
-        boost::this_thread::sleep_for(boost::chrono::milliseconds(HashThread::SleepTimeMilS));
-      }
-  }
+  /**
+   * Join the HashThreads. They return once signalDone() has been called and
+   * their rings are empty, at which point every bit is set. Partial filters
+   * are merged into the filter here.
+   */
+  void threadsCompleted();
 
   bool bloomInsertionDone()
   {
-    return m_bloom_insertion_done;
+    return m_threads_joined;
   }
   static const unsigned int MAX_HASHES = 512;
   static const unsigned int CHAR_SIZE_BITS = 8;
   static const uint32_t HeaderLengthInBytes = 4096;
   static const unsigned int NUM_CACHE_ENTRIES = 200000;
-  static const unsigned int NgramQueueLength = 65534;
-  static const unsigned int BloomFilterThreadedOffsetQueueLength = 65534;
+  /**
+   * Number of payload bytes gathered into a chunk before it is handed to a
+   * HashThread.
+   */
+  static const unsigned int ChunkBytes = 65536;
+  /**
+   * Number of chunks that can be queued for each HashThread.
+   */
+  static const unsigned int ChunkQueueLength = 16;
   //static const unsigned int NumThreads = 2;
 
   /**
@@ -129,17 +200,35 @@ protected:
 
   std::vector<boost::shared_ptr<HashThread> > m_thread_list;
   boost::thread_group m_ngram_hashers;
-  boost::thread_group m_bloom_insert;
   boost::atomic<bool> m_ngram_done;
-  boost::atomic<unsigned int> m_shutdown_thread_count;
-  boost::atomic<bool> m_bloom_insertion_done;
   int m_thread_num;
-   // Queue of ngrams to process
-
-  // Queue of vectors of Bloom filter offsets
+  /**
+   * Hand the current chunk to the next HashThread with room for it and
+   * start a new one.
+   */
+  void pushChunk();
 
-  //boost::lockfree::queue<uint64_t>
-  //m_bfilt_offset_q(128);
+  /**
+   * Or the partial filters of the HashThreads into the filter and free
+   * them.
+   */
+  void mergePartials();
+
+  // Ring of payload chunks to process for each HashThread. Every filter has
+  // its own rings, so several filters can be built in one process at once.
+  std::vector<boost::shared_ptr<SpscRing<PayloadChunkPtr> > > m_chunk_rings;
+  // Ring that gets the next chunk
+  size_t m_next_ring;
+  // Chunk being filled by insertNgrams()
+  PayloadChunkPtr m_chunk;
+  // Notified when chunks are added to the ring of the same index
+  std::vector<boost::shared_ptr<EventCount> > m_chunk_ready;
+  // Notified when a HashThread takes a chunk off of its ring
+  EventCount m_ring_space;
+  bool m_threads_joined;
+  BloomBuildStrategy m_build_strategy;
+  // Private partial filter of each HashThread, unless BUILD_SHARED
+  std::vector<boost::shared_ptr<bit_array_type> > m_partials;
 
 };
 
@@ -32,10 +32,21 @@ public:
    * @param port_num The tcp or udp port number of the captured traffic.
    * @param min_ngram_size The minimum number of bytes in a stored ngram.
    * @param max_ngram_size The maximum number of bytes in a stored ngram.
+   * @param layout Placement of the bits for an ngram.
+   * @param index_mode Derivation of the bit indeces from hashes.
+   * @param hash_family Hash function applied to ngrams.
+   * @param sizing Choice of the number of bits.
+   * @param short_ngrams Storage of the shortest ngrams.
+   * The layout, index mode, hash family, sizing and exact bitmaps are
+   * recorded in the binary file header, as for BloomFilterBase.
    */
   BloomFilterUnthreaded(size_t inserted_items, double probability_false_positive,
               int ip_protocol_num, int port_num, int min_ngram_size,
-              int max_ngram_size);
+              int max_ngram_size, BloomLayout layout = LAYOUT_STANDARD,
+              BloomIndexMode index_mode = INDEX_PER_SEED,
+              BloomHashFamily hash_family = HASH_MURMUR3,
+              BloomSizing sizing = SIZING_EXACT,
+              BloomShortNgrams short_ngrams = SHORT_NGRAMS_HASHED);
   /**
    * Constructor for restoring Bloom filter from persistent store.
    * @param filename Name of file containing persistent Bloom filter.
@@ -43,6 +54,15 @@ public:
    *    false, file is accesed for each Bloom filter bit using fseek.
    */
   BloomFilterUnthreaded(const std::string &filename,bool from_mem_p);
+  /**
+   * Constructor for restoring Bloom filter from persistent store.
+   * @param filename Name of file containing persistent Bloom filter.
+   * @param load_mode How the Bloom filter bits are accessed.
+   * @param mmap_hints BloomMmapHint values or'ed together. Only used with
+   *    LOAD_MMAP.
+   */
+  BloomFilterUnthreaded(const std::string &filename,BloomLoadMode load_mode,
+                        unsigned int mmap_hints = MMAP_HINT_RANDOM);
   /**
    * Destructor.
    */
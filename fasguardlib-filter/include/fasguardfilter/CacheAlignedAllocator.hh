@@ -0,0 +1,67 @@
+#ifndef CACHE_ALIGNED_ALLOCATOR_HH
+#define CACHE_ALIGNED_ALLOCATOR_HH
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+/**
+ * @brief Minimal standard allocator that hands out memory aligned on a
+ *      cache line boundary.
+ *
+ * Used for Bloom filter bit arrays so that a 64-byte block of the filter
+ * never straddles two cache lines.
+ */
+template <typename T>
+class CacheAlignedAllocator
+{
+public:
+  typedef T value_type;
+
+  static const size_t CacheLineBytes = 64;
+
+  CacheAlignedAllocator()
+  {}
+  template <typename U>
+  CacheAlignedAllocator(const CacheAlignedAllocator<U> &)
+  {}
+
+  template <typename U>
+  struct rebind
+  {
+    typedef CacheAlignedAllocator<U> other;
+  };
+
+  T *allocate(size_t n)
+  {
+    void *p = NULL;
+    if(n == 0)
+      {
+        n = 1;
+      }
+    if(posix_memalign(&p,CacheLineBytes,n * sizeof(T)) != 0)
+      {
+        throw std::bad_alloc();
+      }
+    return static_cast<T *>(p);
+  }
+
+  void deallocate(T *p, size_t)
+  {
+    free(p);
+  }
+};
+
+template <typename T, typename U>
+bool operator==(const CacheAlignedAllocator<T> &,
+                const CacheAlignedAllocator<U> &)
+{
+  return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const CacheAlignedAllocator<T> &,
+                const CacheAlignedAllocator<U> &)
+{
+  return false;
+}
+#endif
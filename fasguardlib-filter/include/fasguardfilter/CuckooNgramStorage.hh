@@ -0,0 +1,179 @@
+#ifndef CUCKOO_NGRAM_STORAGE_HH
+#define CUCKOO_NGRAM_STORAGE_HH
+#include <string>
+#include <vector>
+#include <fasguardfilter/BenignNgramStorage.hh>
+#include <fasguardfilter/BloomFilterBase.hh>
+#include <fasguardfilter/CacheAlignedAllocator.hh>
+
+/**
+ * @brief Cuckoo filter implementation of benign ngram storage.
+ *
+ * Each ngram is stored as a short fingerprint in one of two candidate
+ * buckets of BUCKET_SIZE slots, so a lookup reads at most two buckets. The
+ * second bucket is derived from the first and the fingerprint alone, which
+ * lets a fingerprint be moved to its other bucket to make room without
+ * knowing the ngram. With BUCKET_SIZE slots per bucket and f-bit
+ * fingerprints the false positive rate is about 2 * BUCKET_SIZE / 2^f, so a
+ * filter at 1e-5 takes about 21 bits per ngram where a Bloom filter takes
+ * 24.
+ *
+ * Fingerprints are packed without padding. The bucket index is reduced
+ * with Lemire's multiply-shift and the alternate bucket is
+ * (h(fingerprint) - index) mod the number of buckets, so the number of
+ * buckets need not be a power of 2.
+ *
+ * The file has a HeaderLengthInBytes text header whose first line is
+ * FileFirstLine, followed by the packed slots.
+ */
+class CuckooNgramStorage : public BenignNgramStorage
+{
+public:
+  /**
+   * Constructor. This accepts parameters that specify the benign traffic
+   * to be stored in the filter as well as parameters for its sizing.
+   * @param projected_items Number of distinct ngrams that will potentially
+   *    be inserted. Used for sizing.
+   * @param probability_false_positive Desired probability of false postive.
+   *    Used to choose the fingerprint size.
+   * @param ip_protocol_num This is the protocol field number that appears in
+   *    the ip header.
+   * @param port_num The tcp or udp port number of the captured traffic.
+   * @param min_ngram_size The minimum number of bytes in a stored ngram.
+   * @param max_ngram_size The maximum number of bytes in a stored ngram.
+   */
+  CuckooNgramStorage(size_t projected_items,
+                     double probability_false_positive,
+                     int ip_protocol_num, int port_num, int min_ngram_size,
+                     int max_ngram_size);
+  /**
+   * Constructor for restoring a cuckoo filter from persistent store.
+   * @param filename Name of file containing the persistent filter.
+   * @param load_mode How the slots are accessed. LOAD_STREAM is treated as
+   *    LOAD_MEMORY.
+   * @param mmap_hints BloomMmapHint values or'ed together. Only used with
+   *    LOAD_MMAP.
+   */
+  CuckooNgramStorage(const std::string &filename, BloomLoadMode load_mode,
+                     unsigned int mmap_hints = MMAP_HINT_RANDOM);
+  /**
+   * Destructor.
+   */
+  ~CuckooNgramStorage();
+
+  virtual void insert(uint8_t const * data, size_t length);
+
+  virtual bool contains(uint8_t const * data, size_t length);
+
+  /**
+   * Insert an ngram unless it is already contained, since a cuckoo filter
+   * holds at most 2 * BUCKET_SIZE copies of a fingerprint.
+   * @param ngram The ngram to insert.
+   */
+  virtual void insertSpan(const NgramSpan &ngram);
+
+  /**
+   * Check to see if an ngram is stored in the filter.
+   * @param ngram The ngram to search for.
+   */
+  virtual bool containsSpan(const NgramSpan &ngram);
+
+  /**
+   * Check a batch of ngrams. The buckets of a group of ngrams are
+   * prefetched before the previous group is resolved.
+   * @param ngrams The ngrams to search for.
+   * @param results Resized to ngrams.size(); results[i] is true iff
+   *    ngrams[i] is stored in the filter.
+   */
+  virtual void containsBatch(const std::vector<NgramSpan> &ngrams,
+                             std::vector<bool> &results);
+
+  /**
+   * Flush the data structure to a file.
+   * @param filename Name of file used for persistence.
+   */
+  virtual bool flush(std::string filename);
+
+  /**
+   * Check whether a file holds a cuckoo filter.
+   * @param filename Name of the file.
+   */
+  static bool isCuckooFile(const std::string &filename);
+
+  uint64_t getNumBuckets() const
+  {
+    return m_num_buckets;
+  }
+
+  unsigned int getFingerprintBits() const
+  {
+    return m_fingerprint_bits;
+  }
+
+  uint64_t getNumItems() const
+  {
+    return m_num_items;
+  }
+
+  static const std::string FileFirstLine;
+  static const unsigned int BUCKET_SIZE = 4;
+  /**
+   * Fraction of the slots the sizing constructor plans to fill. Cuckoo
+   * insertion with four slots per bucket rarely fails below this.
+   */
+  static const double MAX_LOAD_FACTOR;
+  static const unsigned int MAX_KICKS = 500;
+  static const unsigned int MIN_FINGERPRINT_BITS = 4;
+  static const unsigned int MAX_FINGERPRINT_BITS = 32;
+  static const unsigned int BATCH_GROUP_SIZE = 8;
+
+  typedef std::vector<uint8_t, CacheAlignedAllocator<uint8_t> >
+    slot_array_type;
+
+protected:
+  /**
+   * Bucket index and fingerprint of an ngram.
+   */
+  void locate(uint8_t const * data, size_t length, uint64_t &index,
+              uint32_t &fingerprint) const;
+  uint64_t altIndex(uint64_t index, uint32_t fingerprint) const;
+  uint32_t getSlot(uint64_t index, unsigned int slot) const;
+  void setSlot(uint64_t index, unsigned int slot, uint32_t fingerprint);
+  bool bucketContains(uint64_t index, uint32_t fingerprint) const;
+  /**
+   * Put a fingerprint in an empty slot of a bucket.
+   * @return false if the bucket is full.
+   */
+  bool bucketInsert(uint64_t index, uint32_t fingerprint);
+  /**
+   * Number of bytes of slots, including the padding that lets every slot be
+   * read with one unaligned 64-bit load.
+   */
+  size_t slotBytes() const;
+  void mapSlots(const std::string &filename, unsigned int mmap_hints);
+
+  uint64_t m_num_buckets;
+  unsigned int m_fingerprint_bits;
+  uint64_t m_num_items;
+
+  // An evicted fingerprint that found no room. The filter is full once it
+  // is occupied.
+  uint32_t m_victim_fingerprint;
+  uint64_t m_victim_index;
+
+  // State of the generator that picks the slot to evict
+  uint64_t m_kick_state;
+
+  slot_array_type m_slot_array;
+
+  // The slots: the data of m_slot_array, or the read-only mapping of a
+  // LOAD_MMAP filter
+  uint8_t *m_slots;
+
+  BloomLoadMode m_load_mode;
+
+  void *m_mmap_addr;
+
+  size_t m_mmap_length;
+};
+#endif
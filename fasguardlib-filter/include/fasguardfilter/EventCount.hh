@@ -0,0 +1,79 @@
+#ifndef EVENT_COUNT_HH
+#define EVENT_COUNT_HH
+#include <boost/atomic.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/thread.hpp>
+
+/**
+ * @brief Lets a thread block until a condition on lock-free state holds.
+ *
+ * The waiting thread first polls the condition for a short while, since a
+ * producer usually catches up within microseconds, and only then parks on a
+ * condition variable. notify() is a fence and a load unless a thread is
+ * parked, so it can be called after every change to the state.
+ */
+class EventCount
+{
+public:
+  EventCount() :
+    m_waiters(0)
+  {}
+
+  /**
+   * Wake up the threads waiting for the condition to change. Called after
+   * the state the condition depends on has changed.
+   */
+  void notify()
+  {
+    // Pairs with the fence in wait(): either the waiter sees the new state
+    // or this sees the waiter.
+    boost::atomic_thread_fence(boost::memory_order_seq_cst);
+    if(m_waiters.load(boost::memory_order_relaxed) != 0)
+      {
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+        m_cond.notify_all();
+      }
+  }
+
+  /**
+   * Return once ready() is true.
+   * @param ready Functor that checks the condition.
+   */
+  template <typename Predicate>
+  void wait(Predicate ready)
+  {
+    for(unsigned int i = 0 ; i < SpinCount ; i++)
+      {
+        if(ready())
+          {
+            return;
+          }
+        if(i >= SpinCount / 2)
+          {
+            boost::this_thread::yield();
+          }
+      }
+
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    m_waiters.fetch_add(1,boost::memory_order_relaxed);
+    boost::atomic_thread_fence(boost::memory_order_seq_cst);
+    while(!ready())
+      {
+        m_cond.wait(lock);
+      }
+    m_waiters.fetch_sub(1,boost::memory_order_relaxed);
+  }
+
+  /**
+   * Number of times wait() polls the condition before parking. The second
+   * half of the polls yield the CPU.
+   */
+  static const unsigned int SpinCount = 128;
+
+private:
+  boost::atomic<unsigned int> m_waiters;
+  boost::mutex m_mutex;
+  boost::condition_variable m_cond;
+};
+#endif
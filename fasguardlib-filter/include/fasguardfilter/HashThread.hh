@@ -2,45 +2,36 @@
 #define HASH_THREAD_HH
 #include <vector>
 #include <boost/shared_ptr.hpp>
-#include <boost/unordered_map.hpp>
-#include <boost/lockfree/queue.hpp>
 #include <boost/atomic.hpp>
-#include <fasguardfilter/lru_cache_using_std.h>
 #include <fasguardfilter/BloomFilterBase.hh>
-
-static const unsigned int MaxNgramLength = 16;
-static const unsigned int TrivStringBlockSize = 100;
-static const unsigned int BloomOffsetBlockSize = 24;
+#include <fasguardfilter/EventCount.hh>
+#include <fasguardfilter/SpscRing.hh>
 
 /**
- * Structure to hold strings. Needs a trivial destructor to be placed on
- * lockfree queue.
+ * A payload, or a single ngram, inside a PayloadChunk together with the
+ * range of ngram sizes to insert from it.
  */
-struct triv_string
-{
-  unsigned int length;
-  char string[MaxNgramLength];
-};
-
-typedef struct triv_string TrivString;
-
-class HashThread;
-
-struct triv_string_block
+struct PayloadSegment
 {
-  unsigned int num_items;
-  TrivString elements[TrivStringBlockSize];
+  size_t offset;
+  size_t length;
+  int min_ngram_size;
+  int max_ngram_size;
 };
 
-typedef struct triv_string_block TrivStringBlock;
-
-struct bloom_offset_block
+/**
+ * A batch of whole payloads handed to one HashThread. The thread enumerates
+ * and hashes the ngrams of every segment itself, so one queue operation
+ * covers thousands of ngrams and the work is split between the threads by
+ * payload.
+ */
+struct PayloadChunk
 {
-  unsigned int num_elems;
-  uint64_t offsets[BloomOffsetBlockSize];
+  std::vector<uint8_t> bytes;
+  std::vector<PayloadSegment> segments;
 };
 
-typedef struct bloom_offset_block BloomOffsetBlock;
+typedef boost::shared_ptr<PayloadChunk> PayloadChunkPtr;
 
 /**
  * A functor class to be handed as a paramter to each thread.
@@ -50,51 +41,69 @@ class HashThread
 public:
   /**
    * A constructor.
-   * This constructor takes both the input queue and the output queue for the
-   * thread as well as a class that calculates a list of hashed ngram values.
-   * @param ngram_q A reference to a lockfree queue of ngrams to be processed.
-   * @param bit_index_q A reference to a lockfree queue of bit indeces to
-   *    turn on in the Bloom filter.
+   * This constructor takes the input queue for the thread, the Bloom filter
+   * bits it turns on as well as a class that calculates a list of hashed
+   * ngram values.
+   * @param chunk_q A reference to the ring of payload chunks to be
+   *    processed. This thread is its only consumer.
+   * @param bits The Bloom filter bits. Every HashThread sets bits here
+   *    directly with atomic operations.
+   * @param bitlength The length of the Bloom filter in bits.
+   * @param partial If not NULL, this thread's private partial filter. The
+   *    thread sizes it to bitlength bits if it is empty and sets its bits
+   *    there without atomic operations instead of in bits.
    * @param c_bit_i A reference to a CalcBitIndeces object which takes an
    *    ngram and calculates a set of 64-bit hashes to be used as bit
    *    indeces.
    * @param ngram_done A semaphore flag to inform threads that all processing is
-   *    done and to shut down. This indicates that all ngrams have been put
-   *    on the ngram queue
-   * @param shutdown_thread_count A counter of number of threads that have
-   *    been shut down. The BloomInsertThread can only shutdown when this
-   *    is equal to the total number of threads and the bit_index_q has
-   *    been emptied.
+   *    done and to shut down. This indicates that all payloads have been put
+   *    on the chunk queues
+   * @param chunk_ready Notified when chunks are added to chunk_q or
+   *    ngram_done is set. The thread waits on it while chunk_q is empty.
+   * @param ring_space Notified by this thread whenever it takes a chunk
+   *    off of chunk_q, for a producer waiting for room.
    */
-  HashThread(boost::lockfree::queue<TrivString,
-             boost::lockfree::fixed_sized<true> > &ngram_q,
-             boost::lockfree::queue<BloomOffsetBlock,
-             boost::lockfree::fixed_sized<true> > &bit_index_q,
+  HashThread(SpscRing<PayloadChunkPtr> &chunk_q,
+             uint8_t *bits,
+             uint_fast64_t bitlength,
+             BloomFilterBase::bit_array_type *partial,
              const CalcBitIndeces &c_bit_i,
              boost::atomic<bool> &ngram_done,
-             boost::atomic<unsigned int> &shutdown_thread_count,
+             EventCount &chunk_ready,
+             EventCount &ring_space,
              unsigned int thread_index);
   /**
    * A function call operator which allows this object to behave as a functor.
-   * When invoked, it uses the CalcBitIndeces object to calculate a vector
-   * of bit indices which are then enqueued on the m_bit_index_q queue.
+   * When invoked, it uses the CalcBitIndeces object to calculate the bit
+   * indices of every ngram of the chunks it is handed, which are then turned
+   * on in the Bloom filter. Returns once ngram_done is set and chunk_q has
+   * been emptied.
    */
   void operator()();
 
-  static const unsigned int SleepTimeMilS = 10;
-  static const unsigned int SleepTimeMicroS = 1;
-
 protected:
-  boost::shared_ptr<lru_cache_using_std<
-                      CalcBitIndeces,
-                      std::string,std::vector<uint64_t>,
-                      boost::unordered_map> > m_cache;
-  boost::lockfree::queue<TrivString, boost::lockfree::fixed_sized<true> > &m_ngram_q;
-  boost::lockfree::queue<BloomOffsetBlock,
-                         boost::lockfree::fixed_sized<true> > &m_bit_index_q;
+  /**
+   * Insert the ngrams of every segment of a chunk.
+   * @param chunk The chunk to process.
+   */
+  void processChunk(const PayloadChunk &chunk);
+
+  /**
+   * Turn on bits in the Bloom filter. Other HashThreads turn on bits in the
+   * same bytes concurrently, so each byte is updated atomically.
+   * @param bit_indeces The bits to turn on.
+   * @param num_indeces The number of bits.
+   */
+  void setBits(const uint64_t *bit_indeces, size_t num_indeces);
+
+  SpscRing<PayloadChunkPtr> &m_chunk_q;
+  uint8_t *m_bits;
+  uint_fast64_t m_bitlength;
+  BloomFilterBase::bit_array_type *m_partial;
   const CalcBitIndeces &m_calc_bit_indeces;
   boost::atomic<bool> &m_done;
-  boost::atomic<unsigned int> &m_shutdown_thread_count;
+  EventCount &m_chunk_ready;
+  EventCount &m_ring_space;
   unsigned int m_thread_index;
 };
 
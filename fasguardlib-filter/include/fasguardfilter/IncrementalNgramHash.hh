@@ -0,0 +1,82 @@
+#ifndef INCREMENTAL_NGRAM_HASH_HH
+#define INCREMENTAL_NGRAM_HASH_HH
+#include <stdint.h>
+#include <cstddef>
+#include <fasguardfilter/MurmurHash3.h>
+
+/**
+ * @brief 128-bit ngram hash that can be extended one byte at a time.
+ *
+ * Hashing the ngram of length n+1 starting at an offset only costs one more
+ * extend() call after the ngram of length n at the same offset has been
+ * hashed, so all the ngrams from min to max length at an offset are hashed
+ * in a single pass over max bytes. The two 64-bit lanes are mixed with the
+ * ngram length and avalanched by the MurmurHash3 64-bit finalizer, which
+ * makes the result suitable for double hashing.
+ */
+class IncrementalNgramHash
+{
+public:
+  IncrementalNgramHash()
+  {
+    reset();
+  }
+
+  /**
+   * Start a new ngram.
+   */
+  void reset()
+  {
+    m_lane1 = Lane1Seed;
+    m_lane2 = Lane2Seed;
+  }
+
+  /**
+   * Append one byte to the ngram.
+   * @param c Next byte of the ngram.
+   */
+  void extend(uint8_t c)
+  {
+    m_lane1 = (m_lane1 ^ c) * Lane1Prime;
+    m_lane2 = (m_lane2 + c) * Lane2Prime;
+  }
+
+  /**
+   * Hash of the ngram built so far.
+   * @param length Number of bytes passed to extend() since reset().
+   * @param hash_pair Output for the two 64-bit halves of the hash.
+   */
+  void finalize(size_t length, uint64_t hash_pair[2]) const
+  {
+    hash_pair[0] = fmix64(m_lane1 ^ (uint64_t)length);
+    hash_pair[1] = fmix64(m_lane2 + hash_pair[0]);
+  }
+
+  /**
+   * Hash a complete ngram in one call.
+   * @param data The ngram.
+   * @param length The length of data.
+   * @param hash_pair Output for the two 64-bit halves of the hash.
+   */
+  static void hash(const void *data, size_t length, uint64_t hash_pair[2])
+  {
+    IncrementalNgramHash h;
+    const uint8_t *bytes = (const uint8_t *)data;
+
+    for(size_t i = 0 ; i < length ; i++)
+      {
+        h.extend(bytes[i]);
+      }
+    h.finalize(length,hash_pair);
+  }
+
+private:
+  static const uint64_t Lane1Seed = 0xcbf29ce484222325ULL;
+  static const uint64_t Lane1Prime = 0x100000001b3ULL;
+  static const uint64_t Lane2Seed = 0x243f6a8885a308d3ULL;
+  static const uint64_t Lane2Prime = 0x9e3779b97f4a7c15ULL;
+
+  uint64_t m_lane1;
+  uint64_t m_lane2;
+};
+#endif
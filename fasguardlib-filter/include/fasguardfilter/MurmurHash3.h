@@ -26,12 +26,32 @@ typedef unsigned __int64 uint64_t;
 
 //-----------------------------------------------------------------------------
 
+// 64-bit finalization mix - forces all bits of a hash block to avalanche
+
+inline uint64_t fmix64 ( uint64_t k )
+{
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+
+  return k;
+}
+
+//-----------------------------------------------------------------------------
+
 void MurmurHash3_x86_32  ( const void * key, int len, uint32_t seed, void * out );
 
 void MurmurHash3_x86_128 ( const void * key, int len, uint32_t seed, void * out );
 
 void MurmurHash3_x64_128 ( const void * key, int len, uint32_t seed, void * out );
 
+// MurmurHash3_x86_128 of eight keys of length len at once; out holds eight
+// consecutive 128-bit results. Uses AVX2 when the CPU has it.
+void MurmurHash3_x86_128_x8 ( const void * const keys[8], int len,
+                              uint32_t seed, void * out );
+
 //-----------------------------------------------------------------------------
 
 #endif // _MURMURHASH3_H_
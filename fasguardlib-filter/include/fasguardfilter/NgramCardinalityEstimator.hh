@@ -0,0 +1,134 @@
+#ifndef NGRAM_CARDINALITY_ESTIMATOR_HH
+#define NGRAM_CARDINALITY_ESTIMATOR_HH
+#include <string>
+#include <vector>
+#include <fasguardfilter/BenignNgramStorage.hh>
+
+/**
+ * @brief Estimates the number of distinct ngrams of each length.
+ *
+ * Every ngram length from MIN_NGRAM_SIZE to MAX_NGRAM_SIZE has a
+ * HyperLogLog sketch of 2^precision one-byte registers, so the number of
+ * distinct ngrams seen is estimated with a relative standard error of
+ * 1.04/sqrt(2^precision) in a fixed amount of memory. Fed through the same
+ * insertNgrams() as the filters, the estimates count exactly the ngrams a
+ * filter built from the same traffic would hold, and can be used to size
+ * it for a false positive rate before it is built.
+ *
+ * The payloads passed to insertNgrams() are also kept, up to a budget of
+ * reservoir bytes, so that once the estimates are known the filter can be
+ * built from memory without reading the traffic again. If the payloads do
+ * not fit, all of them are dropped and reservoirComplete() is false.
+ *
+ * The estimator holds no ngrams: contains() is always false, and it can
+ * not be flushed.
+ */
+class NgramCardinalityEstimator : public BenignNgramStorage
+{
+public:
+  /**
+   * Constructor.
+   * @param ip_protocol_num This is the protocol field number that appears in
+   *    the ip header.
+   * @param port_num The tcp or udp port number of the captured traffic.
+   * @param min_ngram_size The minimum number of bytes in a counted ngram.
+   * @param max_ngram_size The maximum number of bytes in a counted ngram.
+   * @param precision Log base 2 of the number of registers per length.
+   * @param reservoir_bytes Most payload bytes kept for replay(). 0 keeps
+   *    none.
+   */
+  NgramCardinalityEstimator(int ip_protocol_num, int port_num,
+                            int min_ngram_size, int max_ngram_size,
+                            unsigned int precision = DEFAULT_PRECISION,
+                            size_t reservoir_bytes = 0);
+  /**
+   * Destructor.
+   */
+  ~NgramCardinalityEstimator();
+
+  virtual void insert(uint8_t const * data, size_t length);
+
+  virtual bool contains(uint8_t const * data, size_t length);
+
+  /**
+   * Add an ngram to the sketch for its length.
+   * @param ngram The ngram to count.
+   */
+  virtual void insertSpan(const NgramSpan &ngram);
+
+  /**
+   * Keep the payload in the reservoir, if it fits, and count its ngrams.
+   */
+  virtual void insertNgrams(uint8_t const * data, size_t length,
+                            int min_ngram_size, int max_ngram_size);
+
+  /**
+   * An estimator can not be written out: always fails.
+   */
+  virtual bool flush(std::string filename);
+
+  /**
+   * Estimated number of distinct ngrams of one length, 0 for a length that
+   * is not counted.
+   */
+  uint64_t estimate(size_t length) const;
+
+  /**
+   * Estimated number of distinct ngrams of every counted length.
+   */
+  uint64_t totalEstimate() const;
+
+  /**
+   * Relative standard error of the estimates.
+   */
+  double relativeError() const;
+
+  /**
+   * Whether every payload passed to insertNgrams() is in the reservoir.
+   */
+  bool reservoirComplete() const
+  {
+    return !m_reservoir_overflowed;
+  }
+
+  /**
+   * Insert every payload of the reservoir into a storage, in the order they
+   * were seen, then drop the reservoir.
+   * @param storage Storage into which the ngrams are placed.
+   */
+  void replay(BenignNgramStorage &storage);
+
+  unsigned long long int getNumBytesProcessed() const
+  {
+    return m_bytes_processed;
+  }
+
+  static const unsigned int DEFAULT_PRECISION = 14;
+  static const unsigned int MIN_PRECISION = 4;
+  static const unsigned int MAX_PRECISION = 18;
+
+protected:
+  /**
+   * The registers of one ngram length.
+   */
+  std::vector<uint8_t> &registers(size_t length)
+  {
+    return m_registers[length - m_min_ngram_size];
+  }
+
+  unsigned int m_precision;
+
+  std::vector<std::vector<uint8_t> > m_registers;
+
+  // Chunks of payloads, each preceded by its length as a uint32_t. A
+  // payload never straddles two chunks.
+  std::vector<std::vector<uint8_t> > m_reservoir;
+
+  // Payload and length bytes in m_reservoir
+  size_t m_reservoir_used;
+
+  size_t m_reservoir_bytes;
+
+  bool m_reservoir_overflowed;
+};
+#endif
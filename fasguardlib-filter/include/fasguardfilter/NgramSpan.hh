@@ -0,0 +1,25 @@
+#ifndef NGRAM_SPAN_HH
+#define NGRAM_SPAN_HH
+#include <cstddef>
+#include <inttypes.h>
+
+/**
+ * @brief Non-owning reference to an ngram inside a larger buffer.
+ *
+ * The bytes are not copied, so the buffer must outlive the span. This lets
+ * callers look up every ngram of a packet without building a string for
+ * each one.
+ */
+struct NgramSpan
+{
+  NgramSpan() :
+    data(NULL), length(0)
+  {}
+  NgramSpan(uint8_t const * d, size_t l) :
+    data(d), length(l)
+  {}
+
+  uint8_t const * data;
+  size_t length;
+};
+#endif
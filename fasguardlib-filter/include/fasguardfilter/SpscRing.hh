@@ -0,0 +1,123 @@
+#ifndef SPSC_RING_HH
+#define SPSC_RING_HH
+#include <cstddef>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <fasguardfilter/CacheAlignedAllocator.hh>
+
+/**
+ * @brief Bounded single-producer/single-consumer ring buffer.
+ *
+ * One thread may push and one other thread may pop concurrently without
+ * locks. The head (written by the consumer) and the tail (written by the
+ * producer) sit on separate cache lines, and each side keeps a private copy
+ * of the other side's index so it only reads the shared one when the ring
+ * looks full or empty.
+ */
+template <typename T>
+class SpscRing
+{
+public:
+  /**
+   * Constructor.
+   * @param capacity Minimum number of elements the ring holds. Rounded up
+   *    to a power of 2.
+   */
+  explicit SpscRing(size_t capacity) :
+    m_head(0), m_tail_cache(0), m_tail(0), m_head_cache(0)
+  {
+    size_t size = 2;
+    while(size < capacity)
+      {
+        size <<= 1;
+      }
+    m_mask = size - 1;
+    m_elements.resize(size);
+  }
+
+  /**
+   * Add an element. Only called by the producer thread.
+   * @param elem The element to add.
+   * @return false if the ring is full.
+   */
+  bool push(const T &elem)
+  {
+    size_t tail = m_tail.load(boost::memory_order_relaxed);
+
+    if(tail - m_head_cache > m_mask)
+      {
+        m_head_cache = m_head.load(boost::memory_order_acquire);
+        if(tail - m_head_cache > m_mask)
+          {
+            return false;
+          }
+      }
+    m_elements[tail & m_mask] = elem;
+    m_tail.store(tail + 1,boost::memory_order_release);
+    return true;
+  }
+
+  /**
+   * Remove the oldest element. Only called by the consumer thread.
+   * @param elem Output for the element.
+   * @return false if the ring is empty.
+   */
+  bool pop(T &elem)
+  {
+    size_t head = m_head.load(boost::memory_order_relaxed);
+
+    if(head == m_tail_cache)
+      {
+        m_tail_cache = m_tail.load(boost::memory_order_acquire);
+        if(head == m_tail_cache)
+          {
+            return false;
+          }
+      }
+    // Reset the slot so that it does not keep what it held alive
+    elem = m_elements[head & m_mask];
+    m_elements[head & m_mask] = T();
+    m_head.store(head + 1,boost::memory_order_release);
+    return true;
+  }
+
+  /**
+   * True if the ring holds no elements. Safe to call from either thread.
+   */
+  bool empty() const
+  {
+    return m_head.load(boost::memory_order_acquire) ==
+      m_tail.load(boost::memory_order_acquire);
+  }
+
+  /**
+   * True if the ring has no room for another element. Safe to call from
+   * either thread.
+   */
+  bool full() const
+  {
+    return m_tail.load(boost::memory_order_acquire) -
+      m_head.load(boost::memory_order_acquire) > m_mask;
+  }
+
+private:
+  static const size_t CacheLineBytes =
+    CacheAlignedAllocator<char>::CacheLineBytes;
+
+  std::vector<T, CacheAlignedAllocator<T> > m_elements;
+  size_t m_mask;
+  char m_pad0[CacheLineBytes];
+
+  // Consumer side
+  boost::atomic<size_t> m_head;
+  size_t m_tail_cache;
+  char m_pad1[CacheLineBytes - sizeof(boost::atomic<size_t>) -
+              sizeof(size_t)];
+
+  // Producer side
+  boost::atomic<size_t> m_tail;
+  size_t m_head_cache;
+  char m_pad2[CacheLineBytes - sizeof(boost::atomic<size_t>) -
+              sizeof(size_t)];
+};
+#endif
@@ -16,7 +16,7 @@ BenignNgramStorage::BenignNgramStorage(int ip_protocol_num, int port_num,
                                        int min_ngram_size, int max_ngram_size):
   m_ip_protocol_num(ip_protocol_num), m_port_num(port_num),
   m_min_ngram_size(min_ngram_size),m_max_ngram_size(max_ngram_size),
-  m_insertions(0),m_unique_insertions(0)
+  m_insertions(0),m_unique_insertions(0),m_bytes_processed(0)
 {}
 
 void
@@ -62,6 +62,23 @@ BenignNgramStorage::loadParams(const std::map<std::string,std::string>
 BenignNgramStorage::~BenignNgramStorage()
 {}
 
+void
+BenignNgramStorage::insertNgrams(uint8_t const * data, size_t length,
+                                 int min_ngram_size, int max_ngram_size)
+{
+  size_t min_lgth = (min_ngram_size < 1) ? 1 : min_ngram_size;
+
+  for(size_t offset = 0 ; offset < length ; offset++)
+    {
+      for(size_t i = min_lgth ;
+          i <= (size_t)max_ngram_size && offset + i <= length ;
+          i++)
+        {
+          insertSpan(NgramSpan(data + offset,i));
+        }
+    }
+}
+
 void
 BenignNgramStorage::setNumBytesProcessed(unsigned long long int
                                          num_bytes_processed)
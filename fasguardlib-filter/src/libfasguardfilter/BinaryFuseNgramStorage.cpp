@@ -0,0 +1,634 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <sstream>
+#include <boost/log/trivial.hpp>
+#include <sys/mman.h>
+#include <fasguardfilter/BinaryFuseNgramStorage.hh>
+#include <fasguardfilter/MurmurHash3.h>
+#include "StorageFile.hh"
+
+const std::string BinaryFuseNgramStorage::FileFirstLine =
+  "BINARY_FUSE_FILTER";
+
+/**
+ * Seed for the ngram hash. The per-filter seed is mixed in afterwards, so
+ * this one never changes.
+ */
+static const uint32_t NgramKeySeed = 0x3213868e;
+
+static inline uint64_t
+mulhi(uint64_t a, uint64_t b)
+{
+  return (uint64_t)(((unsigned __int128)a * b) >> 64);
+}
+
+static std::string
+spillName(const std::string &prefix, unsigned int partition)
+{
+  std::ostringstream name;
+
+  name << prefix << ".spill." << partition;
+  return name.str();
+}
+
+BinaryFuseNgramStorage::BinaryFuseNgramStorage(
+                                   double probability_false_positive,
+                                   int ip_protocol_num, int port_num,
+                                   int min_ngram_size, int max_ngram_size,
+                                   const std::string &spill_prefix) :
+  BenignNgramStorage(ip_protocol_num,port_num,min_ngram_size,max_ngram_size),
+  m_num_keys(0),
+  m_seed(0),
+  m_segment_length(0),
+  m_segment_count_length(0),
+  m_array_length(0),
+  m_building(true),
+  m_spill_prefix(spill_prefix),
+  m_spill_buffers(NUM_SPILL_PARTITIONS),
+  m_spill_files(NUM_SPILL_PARTITIONS),
+  m_slots(NULL),
+  m_load_mode(LOAD_MEMORY),
+  m_mmap_addr(NULL),
+  m_mmap_length(0)
+{
+  m_bytes_processed = 0;
+
+  // A novel ngram matches the xor of its three slots with probability 2^-f
+  m_fingerprint_bits =
+    (unsigned int)ceil(log2(1.0 / probability_false_positive));
+  if(m_fingerprint_bits < MIN_FINGERPRINT_BITS)
+    {
+      m_fingerprint_bits = MIN_FINGERPRINT_BITS;
+    }
+  else if(m_fingerprint_bits > MAX_FINGERPRINT_BITS)
+    {
+      m_fingerprint_bits = MAX_FINGERPRINT_BITS;
+    }
+  BOOST_LOG_TRIVIAL(debug) << "Binary fuse fingerprint bits: " <<
+    m_fingerprint_bits << std::endl;
+}
+
+BinaryFuseNgramStorage::BinaryFuseNgramStorage(const std::string &filename,
+                                               BloomLoadMode load_mode,
+                                               unsigned int mmap_hints) :
+  m_fingerprint_bits(0),
+  m_num_keys(0),
+  m_seed(0),
+  m_segment_length(0),
+  m_segment_count_length(0),
+  m_array_length(0),
+  m_building(false),
+  m_slots(NULL),
+  m_load_mode((load_mode == LOAD_MMAP) ? LOAD_MMAP : LOAD_MEMORY),
+  m_mmap_addr(NULL),
+  m_mmap_length(0)
+{
+  m_insertions = 0;
+  m_unique_insertions = 0;
+  m_bytes_processed = 0;
+
+  std::ifstream bf_stream(filename.c_str(),std::ios::in | std::ios::binary);
+
+  if(!bf_stream)
+    {
+      BOOST_LOG_TRIVIAL(error) << "Unable to open: " <<
+        filename << std::endl;
+      exit(-1);
+    }
+  std::map<std::string,std::string> properties;
+
+  if(!StorageFile::readTextHeader(bf_stream,FileFirstLine,properties))
+    {
+      BOOST_LOG_TRIVIAL(error) << "Not a binary fuse filter: " <<
+        filename << std::endl;
+      exit(-1);
+    }
+
+  std::map<std::string,std::string> bf_properties;
+
+  for(std::map<std::string,std::string>::const_iterator it =
+        properties.begin() ; it != properties.end() ; ++it)
+    {
+      const std::string &key = it->first;
+      const std::string &value = it->second;
+
+      if(key.compare("FINGERPRINT_BITS") == 0)
+        {
+          std::istringstream(value) >> m_fingerprint_bits;
+        }
+      else if(key.compare("NUM_KEYS") == 0)
+        {
+          std::istringstream(value) >> m_num_keys;
+        }
+      else if(key.compare("SEED") == 0)
+        {
+          std::istringstream(value) >> m_seed;
+        }
+      else if(key.compare("SEGMENT_LENGTH") == 0)
+        {
+          std::istringstream(value) >> m_segment_length;
+        }
+      else if(key.compare("SEGMENT_COUNT_LENGTH") == 0)
+        {
+          std::istringstream(value) >> m_segment_count_length;
+        }
+      else if(key.compare("ARRAY_LENGTH") == 0)
+        {
+          std::istringstream(value) >> m_array_length;
+        }
+      else
+        {
+          bf_properties[key] = value;
+        }
+    }
+  loadParams(bf_properties); // Load params for BenignNgramStorage
+
+  if(m_fingerprint_bits < MIN_FINGERPRINT_BITS ||
+     m_fingerprint_bits > MAX_FINGERPRINT_BITS ||
+     m_segment_length == 0 ||
+     (m_segment_length & (m_segment_length - 1)) != 0 ||
+     m_array_length < m_segment_count_length + 2 * m_segment_length)
+    {
+      BOOST_LOG_TRIVIAL(error) << "Bad binary fuse filter header: " <<
+        filename << std::endl;
+      exit(-1);
+    }
+
+  if(m_load_mode == LOAD_MMAP)
+    {
+      bf_stream.close();
+      mapSlots(filename,mmap_hints);
+      return;
+    }
+
+  m_slot_array.resize(slotBytes(),0);
+  m_slots = m_slot_array.data();
+  bf_stream.seekg(BloomFilterBase::HeaderLengthInBytes);
+  bf_stream.read((char *)m_slots,m_slot_array.size());
+  if(!bf_stream)
+    {
+      BOOST_LOG_TRIVIAL(error) << "Binary fuse filter file too short: " <<
+        filename << std::endl;
+      exit(-1);
+    }
+}
+
+BinaryFuseNgramStorage::~BinaryFuseNgramStorage()
+{
+  if(m_mmap_addr != NULL)
+    {
+      munmap(m_mmap_addr,m_mmap_length);
+    }
+  if(m_building)
+    {
+      for(unsigned int p = 0 ; p < NUM_SPILL_PARTITIONS ; p++)
+        {
+          if(m_spill_files[p])
+            {
+              m_spill_files[p]->close();
+              std::remove(spillName(m_spill_prefix,p).c_str());
+            }
+        }
+    }
+}
+
+void
+BinaryFuseNgramStorage::mapSlots(const std::string &filename,
+                                 unsigned int mmap_hints)
+{
+  m_mmap_length = BloomFilterBase::HeaderLengthInBytes + slotBytes();
+  m_mmap_addr = StorageFile::mapFile(filename,m_mmap_length,mmap_hints);
+  m_slots = (uint8_t *)m_mmap_addr + BloomFilterBase::HeaderLengthInBytes;
+}
+
+size_t
+BinaryFuseNgramStorage::slotBytes() const
+{
+  uint64_t bits = m_array_length * m_fingerprint_bits;
+
+  return (bits + 7) / 8 + sizeof(uint64_t);
+}
+
+uint64_t
+BinaryFuseNgramStorage::ngramKey(uint8_t const * data, size_t length)
+{
+  uint64_t hash_pair[2];
+
+  MurmurHash3_x86_128(data,length,NgramKeySeed,hash_pair);
+  return hash_pair[0];
+}
+
+void
+BinaryFuseNgramStorage::slotIndeces(uint64_t hash, uint64_t indeces[3]) const
+{
+  uint64_t mask = m_segment_length - 1;
+
+  // One slot in each of three consecutive segments
+  indeces[0] = mulhi(hash,m_segment_count_length);
+  indeces[1] = (indeces[0] + m_segment_length) ^ ((hash >> 18) & mask);
+  indeces[2] = (indeces[0] + 2 * m_segment_length) ^ (hash & mask);
+}
+
+uint32_t
+BinaryFuseNgramStorage::fingerprint(uint64_t hash) const
+{
+  return (uint32_t)((hash ^ (hash >> 32)) &
+                    ((1ULL << m_fingerprint_bits) - 1));
+}
+
+uint32_t
+BinaryFuseNgramStorage::getSlot(uint64_t index) const
+{
+  uint64_t bit = index * m_fingerprint_bits;
+  uint64_t word;
+
+  memcpy(&word,m_slots + bit / 8,sizeof(word));
+  return (uint32_t)((word >> (bit % 8)) &
+                    ((1ULL << m_fingerprint_bits) - 1));
+}
+
+void
+BinaryFuseNgramStorage::setSlot(uint64_t index, uint32_t value)
+{
+  uint64_t bit = index * m_fingerprint_bits;
+  uint64_t mask = ((1ULL << m_fingerprint_bits) - 1) << (bit % 8);
+  uint64_t word;
+
+  memcpy(&word,m_slots + bit / 8,sizeof(word));
+  word = (word & ~mask) | (((uint64_t)value << (bit % 8)) & mask);
+  memcpy(m_slots + bit / 8,&word,sizeof(word));
+}
+
+bool
+BinaryFuseNgramStorage::containsKey(uint64_t key) const
+{
+  uint64_t hash = fmix64(key + m_seed);
+  uint64_t indeces[3];
+
+  slotIndeces(hash,indeces);
+  return (getSlot(indeces[0]) ^ getSlot(indeces[1]) ^ getSlot(indeces[2]))
+    == fingerprint(hash);
+}
+
+void
+BinaryFuseNgramStorage::insert(uint8_t const * data, size_t length)
+{
+  insertSpan(NgramSpan(data,length));
+}
+
+bool
+BinaryFuseNgramStorage::contains(uint8_t const * data, size_t length)
+{
+  return containsSpan(NgramSpan(data,length));
+}
+
+void
+BinaryFuseNgramStorage::insertSpan(const NgramSpan &ngram)
+{
+  if(!m_building)
+    {
+      BOOST_LOG_TRIVIAL(error) << "Cannot insert into a binary fuse filter "
+        "once it is built" << std::endl;
+      exit(-1);
+    }
+
+  uint64_t key = ngramKey(ngram.data,ngram.length);
+  unsigned int partition =
+    (unsigned int)((key >> 32) * NUM_SPILL_PARTITIONS >> 32);
+
+  m_spill_buffers[partition].push_back(key);
+  if(m_spill_buffers[partition].size() >= SPILL_BUFFER_KEYS)
+    {
+      spill(partition);
+    }
+}
+
+bool
+BinaryFuseNgramStorage::containsSpan(const NgramSpan &ngram)
+{
+  if(m_building)
+    {
+      BOOST_LOG_TRIVIAL(error) << "A binary fuse filter can only be queried "
+        "once it is built" << std::endl;
+      exit(-1);
+    }
+  return containsKey(ngramKey(ngram.data,ngram.length));
+}
+
+void
+BinaryFuseNgramStorage::containsBatch(const std::vector<NgramSpan> &ngrams,
+                                      std::vector<bool> &results)
+{
+  if(m_building)
+    {
+      BOOST_LOG_TRIVIAL(error) << "A binary fuse filter can only be queried "
+        "once it is built" << std::endl;
+      exit(-1);
+    }
+  results.resize(ngrams.size());
+
+  // Two groups: one being prefetched while the other is resolved
+  uint64_t hashes[2][BATCH_GROUP_SIZE];
+  size_t num_groups =
+    (ngrams.size() + BATCH_GROUP_SIZE - 1) / BATCH_GROUP_SIZE;
+
+  for(size_t group = 0 ; group <= num_groups ; group++)
+    {
+      if(group < num_groups)
+        {
+          size_t first = group * BATCH_GROUP_SIZE;
+          size_t last = std::min(first + BATCH_GROUP_SIZE,ngrams.size());
+
+          for(size_t i = first ; i < last ; i++)
+            {
+              uint64_t hash =
+                fmix64(ngramKey(ngrams[i].data,ngrams[i].length) + m_seed);
+              uint64_t indeces[3];
+
+              hashes[group % 2][i - first] = hash;
+              slotIndeces(hash,indeces);
+              for(size_t j = 0 ; j < 3 ; j++)
+                {
+                  __builtin_prefetch(m_slots +
+                                     indeces[j] * m_fingerprint_bits / 8);
+                }
+            }
+        }
+      if(group > 0)
+        {
+          size_t first = (group - 1) * BATCH_GROUP_SIZE;
+          size_t last = std::min(first + BATCH_GROUP_SIZE,ngrams.size());
+
+          for(size_t i = first ; i < last ; i++)
+            {
+              uint64_t hash = hashes[(group - 1) % 2][i - first];
+              uint64_t indeces[3];
+
+              slotIndeces(hash,indeces);
+              results[i] = (getSlot(indeces[0]) ^ getSlot(indeces[1]) ^
+                            getSlot(indeces[2])) == fingerprint(hash);
+            }
+        }
+    }
+}
+
+void
+BinaryFuseNgramStorage::spill(unsigned int partition)
+{
+  std::vector<uint64_t> &buffer = m_spill_buffers[partition];
+
+  if(buffer.empty())
+    {
+      return;
+    }
+
+  // Packets repeat a lot of ngrams, so drop the duplicates within the
+  // buffer before they reach the disk.
+  std::sort(buffer.begin(),buffer.end());
+  buffer.erase(std::unique(buffer.begin(),buffer.end()),buffer.end());
+
+  if(!m_spill_files[partition])
+    {
+      std::string name = spillName(m_spill_prefix,partition);
+
+      m_spill_files[partition].reset(new std::ofstream(name.c_str(),
+                                                       std::ios::out |
+                                                       std::ios::binary));
+      if(!*m_spill_files[partition])
+        {
+          BOOST_LOG_TRIVIAL(error) << "Unable to open: " <<
+            name << std::endl;
+          exit(-1);
+        }
+    }
+  m_spill_files[partition]->write((const char *)buffer.data(),
+                                  buffer.size() * sizeof(uint64_t));
+  buffer.clear();
+}
+
+void
+BinaryFuseNgramStorage::build()
+{
+  std::vector<uint64_t> keys;
+
+  // Partitions hold disjoint ranges of keys, so deduplicating each one on
+  // its own deduplicates them all.
+  for(unsigned int p = 0 ; p < NUM_SPILL_PARTITIONS ; p++)
+    {
+      std::vector<uint64_t> partition_keys;
+
+      partition_keys.swap(m_spill_buffers[p]);
+      if(m_spill_files[p])
+        {
+          std::string name = spillName(m_spill_prefix,p);
+
+          m_spill_files[p]->close();
+          m_spill_files[p].reset();
+
+          std::ifstream spill_file(name.c_str(),
+                                   std::ios::in | std::ios::binary);
+
+          spill_file.seekg(0,std::ios::end);
+          size_t num_spilled = spill_file.tellg() / sizeof(uint64_t);
+          size_t num_buffered = partition_keys.size();
+
+          partition_keys.resize(num_buffered + num_spilled);
+          spill_file.seekg(0,std::ios::beg);
+          spill_file.read((char *)(partition_keys.data() + num_buffered),
+                          num_spilled * sizeof(uint64_t));
+          spill_file.close();
+          std::remove(name.c_str());
+        }
+      std::sort(partition_keys.begin(),partition_keys.end());
+      partition_keys.erase(std::unique(partition_keys.begin(),
+                                       partition_keys.end()),
+                           partition_keys.end());
+      keys.insert(keys.end(),partition_keys.begin(),partition_keys.end());
+    }
+  m_building = false;
+
+  BOOST_LOG_TRIVIAL(debug) << "Binary fuse distinct ngrams: " <<
+    keys.size() << std::endl;
+
+  setGeometry(keys.size());
+  for(unsigned int attempt = 0 ; attempt < MAX_CONSTRUCTION_ATTEMPTS ;
+      attempt++)
+    {
+      m_seed = fmix64(0x9e3779b97f4a7c15ULL * (attempt + 1));
+      if(construct(keys))
+        {
+          return;
+        }
+      BOOST_LOG_TRIVIAL(debug) << "Binary fuse construction attempt " <<
+        attempt << " failed" << std::endl;
+    }
+  BOOST_LOG_TRIVIAL(error) << "Unable to construct binary fuse filter" <<
+    std::endl;
+  exit(-1);
+}
+
+void
+BinaryFuseNgramStorage::setGeometry(uint64_t num_keys)
+{
+  // Sizing from the reference implementation for three hashes
+  m_num_keys = num_keys;
+
+  double size = (num_keys < 2) ? 2.0 : (double)num_keys;
+
+  m_segment_length = 1ULL << (int)floor(log(size) / log(3.33) + 2.25);
+  if(m_segment_length > 262144)
+    {
+      m_segment_length = 262144;
+    }
+
+  double size_factor = std::max(1.125,0.875 + 0.25 * log(1000000.0) /
+                                log(size));
+  uint64_t capacity = (uint64_t)llround(size * size_factor);
+  int64_t segment_count =
+    (int64_t)((capacity + m_segment_length - 1) / m_segment_length) - 2;
+
+  if(segment_count < 1)
+    {
+      segment_count = 1;
+    }
+  m_segment_count_length = segment_count * m_segment_length;
+  m_array_length = (segment_count + 2) * m_segment_length;
+}
+
+bool
+BinaryFuseNgramStorage::construct(const std::vector<uint64_t> &keys)
+{
+  // For each slot, the number of keys that use it times 4, xor'ed with
+  // which of its three slots it is for each key, and the xor of the hashes
+  // of those keys. A slot used by a single key gives the key away.
+  std::vector<uint32_t> slot_count(m_array_length,0);
+  std::vector<uint64_t> slot_hash(m_array_length,0);
+
+  for(size_t k = 0 ; k < keys.size() ; k++)
+    {
+      uint64_t hash = fmix64(keys[k] + m_seed);
+      uint64_t indeces[3];
+
+      slotIndeces(hash,indeces);
+      for(uint32_t j = 0 ; j < 3 ; j++)
+        {
+          slot_count[indeces[j]] += 4;
+          slot_count[indeces[j]] ^= j;
+          slot_hash[indeces[j]] ^= hash;
+        }
+    }
+
+  // Peel keys off slots that only one key uses. The stack records each
+  // peeled key and the slot it owns, in peeling order.
+  std::vector<uint64_t> queue;
+  std::vector<std::pair<uint64_t,uint32_t> > stack;
+
+  stack.reserve(keys.size());
+  for(uint64_t i = 0 ; i < m_array_length ; i++)
+    {
+      if((slot_count[i] >> 2) == 1)
+        {
+          queue.push_back(i);
+        }
+    }
+  while(!queue.empty())
+    {
+      uint64_t i = queue.back();
+
+      queue.pop_back();
+      if((slot_count[i] >> 2) != 1)
+        {
+          continue;
+        }
+
+      uint64_t hash = slot_hash[i];
+      uint32_t found = slot_count[i] & 3;
+      uint64_t indeces[3];
+
+      stack.push_back(std::make_pair(hash,found));
+      slotIndeces(hash,indeces);
+      for(uint32_t j = 0 ; j < 3 ; j++)
+        {
+          slot_count[indeces[j]] -= 4;
+          slot_count[indeces[j]] ^= j;
+          slot_hash[indeces[j]] ^= hash;
+          if(j != found && (slot_count[indeces[j]] >> 2) == 1)
+            {
+              queue.push_back(indeces[j]);
+            }
+        }
+    }
+  if(stack.size() != keys.size())
+    {
+      return false;
+    }
+
+  // Assign in reverse peeling order: each key's own slot is set last among
+  // the slots it uses, so its fingerprint comes out of the xor.
+  m_slot_array.assign(slotBytes(),0);
+  m_slots = m_slot_array.data();
+  for(size_t s = stack.size() ; s > 0 ; s--)
+    {
+      uint64_t hash = stack[s - 1].first;
+      uint32_t found = stack[s - 1].second;
+      uint64_t indeces[3];
+
+      slotIndeces(hash,indeces);
+      setSlot(indeces[found],fingerprint(hash) ^
+              getSlot(indeces[(found + 1) % 3]) ^
+              getSlot(indeces[(found + 2) % 3]));
+    }
+  return true;
+}
+
+bool
+BinaryFuseNgramStorage::flush(std::string filename)
+{
+  if(m_building)
+    {
+      build();
+    }
+
+  std::ostringstream out;
+
+  out << FileFirstLine << std::endl;
+  out << "IP_PROTOCOL_NUMBER = " << m_ip_protocol_num << std::endl;
+  out << "TCP_IP_PORT_NUM = " << m_port_num << std::endl;
+  out << "MIN_NGRAM_SIZE = " << m_min_ngram_size << std::endl;
+  out << "MAX_NGRAM_SIZE = " << m_max_ngram_size << std::endl;
+  out << "NUM_PAYLOAD_BYTES_PROCESSED = " << m_bytes_processed << std::endl;
+  out << "FINGERPRINT_BITS = " << m_fingerprint_bits << std::endl;
+  out << "NUM_KEYS = " << m_num_keys << std::endl;
+  out << "SEED = " << m_seed << std::endl;
+  out << "SEGMENT_LENGTH = " << m_segment_length << std::endl;
+  out << "SEGMENT_COUNT_LENGTH = " << m_segment_count_length << std::endl;
+  out << "ARRAY_LENGTH = " << m_array_length << std::endl;
+
+  std::string serialized_header = out.str();
+  std::ofstream bfStream(filename.c_str(),std::ios::out | std::ios::binary);
+
+  if(!bfStream)
+    {
+      BOOST_LOG_TRIVIAL(error) <<
+        "Unable to open: " << filename << std::endl;
+      return false;
+    }
+
+  StorageFile::writeTextHeader(bfStream,serialized_header);
+  bfStream.write((const char *)m_slots,slotBytes());
+  bfStream.close();
+  return true;
+}
+
+bool
+BinaryFuseNgramStorage::isBinaryFuseFile(const std::string &filename)
+{
+  return StorageFile::isTextHeaderFile(filename,FileFirstLine);
+}
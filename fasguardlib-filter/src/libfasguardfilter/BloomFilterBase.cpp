@@ -2,14 +2,25 @@
 #include <config.h>
 #endif
 
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 #include <fstream>
 #include <boost/log/trivial.hpp>
-#include <boost/regex.hpp>
 #include <boost/unordered_map.hpp>
+#include <boost/thread/thread.hpp>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include <fasguardfilter/BloomFilterBase.hh>
-#include "MurmurHash3.h"
+#include <fasguardfilter/MurmurHash3.h>
+#include "BloomFilterHeader.hh"
+#include "StorageFile.hh"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define BLOOM_AVX2 1
+#include <immintrin.h>
+#endif
 
 /**
     @brief Seeds for #MAX_HASHES different hash functions.
@@ -161,17 +172,438 @@ const unsigned char BloomFilterBase::BIT_MASK[] =
     0x40,   //01000000
     0x80 }; //10000000
 
-static char Filler[BloomFilterBase::HeaderLengthInBytes];
-static char HeaderBuffer[BloomFilterBase::HeaderLengthInBytes];
+/**
+ * Bytes of filter data read, combined, checksummed and written at a time by
+ * WriteCombined.
+ */
+static const size_t CombineChunkBytes = 1 << 24;
+/**
+ * Alignment of the part of a chunk each WriteCombined thread combines.
+ */
+static const size_t CombineSliceAlign = 64;
+
+/**
+ * Or the same bytes of several filters together.
+ * @param dst Receives the combination.
+ * @param sources The filter bytes to combine.
+ * @param offset Offset in dst and in each source of the first byte.
+ * @param length Number of bytes to combine.
+ */
+static void
+combineBitsScalar(uint8_t *dst, const std::vector<const uint8_t *> &sources,
+                  size_t offset, size_t length)
+{
+  size_t end = offset + length;
+  size_t i = offset;
+
+  for( ; i + sizeof(uint64_t) <= end ; i += sizeof(uint64_t))
+    {
+      uint64_t word = 0;
+
+      for(size_t s = 0 ; s < sources.size() ; s++)
+        {
+          uint64_t src_word;
+
+          memcpy(&src_word,sources[s] + i,sizeof(src_word));
+          word |= src_word;
+        }
+      memcpy(dst + i,&word,sizeof(word));
+    }
+  for( ; i < end ; i++)
+    {
+      uint8_t byte = 0;
+
+      for(size_t s = 0 ; s < sources.size() ; s++)
+        {
+          byte |= sources[s][i];
+        }
+      dst[i] = byte;
+    }
+}
+
+#ifdef BLOOM_AVX2
+__attribute__((target("avx2"))) static void
+combineBitsAvx2(uint8_t *dst, const std::vector<const uint8_t *> &sources,
+                size_t offset, size_t length)
+{
+  size_t end = offset + length;
+  size_t i = offset;
+
+  for( ; i + sizeof(__m256i) <= end ; i += sizeof(__m256i))
+    {
+      __m256i word = _mm256_setzero_si256();
+
+      for(size_t s = 0 ; s < sources.size() ; s++)
+        {
+          word = _mm256_or_si256(word,_mm256_loadu_si256(
+                                   (const __m256i *)(sources[s] + i)));
+        }
+      _mm256_storeu_si256((__m256i *)(dst + i),word);
+    }
+  combineBitsScalar(dst,sources,i,end - i);
+}
+#endif
+
+static void
+combineBits(uint8_t *dst, const std::vector<const uint8_t *> &sources,
+            size_t offset, size_t length)
+{
+#ifdef BLOOM_AVX2
+  static const bool have_avx2 = __builtin_cpu_supports("avx2");
+
+  if(have_avx2)
+    {
+      combineBitsAvx2(dst,sources,offset,length);
+      return;
+    }
+#endif
+  combineBitsScalar(dst,sources,offset,length);
+}
+
+/**
+ * Count the set bits of filter bytes.
+ * @param bits The filter bytes.
+ * @param length Number of bytes in bits.
+ */
+static uint64_t
+countBitsScalar(const uint8_t *bits, size_t length)
+{
+  uint64_t count = 0;
+  size_t i = 0;
+
+  for( ; i + sizeof(uint64_t) <= length ; i += sizeof(uint64_t))
+    {
+      uint64_t word;
+
+      memcpy(&word,bits + i,sizeof(word));
+      count += __builtin_popcountll(word);
+    }
+  for( ; i < length ; i++)
+    {
+      count += __builtin_popcount(bits[i]);
+    }
+  return count;
+}
+
+#ifdef BLOOM_AVX2
+__attribute__((target("avx2"))) static uint64_t
+countBitsAvx2(const uint8_t *bits, size_t length)
+{
+  // Look up the count of each nibble with a byte shuffle, and add the byte
+  // counts up in 64-bit lanes
+  const __m256i nibble_counts =
+    _mm256_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,
+                     0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+  const __m256i low_nibbles = _mm256_set1_epi8(0x0f);
+  __m256i total = _mm256_setzero_si256();
+  size_t i = 0;
+
+  for( ; i + sizeof(__m256i) <= length ; i += sizeof(__m256i))
+    {
+      __m256i word = _mm256_loadu_si256((const __m256i *)(bits + i));
+      __m256i low = _mm256_and_si256(word,low_nibbles);
+      __m256i high = _mm256_and_si256(_mm256_srli_epi16(word,4),low_nibbles);
+      __m256i counts =
+        _mm256_add_epi8(_mm256_shuffle_epi8(nibble_counts,low),
+                        _mm256_shuffle_epi8(nibble_counts,high));
+
+      total = _mm256_add_epi64(total,
+                               _mm256_sad_epu8(counts,
+                                               _mm256_setzero_si256()));
+    }
+
+  uint64_t lanes[4];
+
+  _mm256_storeu_si256((__m256i *)lanes,total);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+    countBitsScalar(bits + i,length - i);
+}
+#endif
+
+static uint64_t
+countBits(const uint8_t *bits, size_t length)
+{
+#ifdef BLOOM_AVX2
+  static const bool have_avx2 = __builtin_cpu_supports("avx2");
+
+  if(have_avx2)
+    {
+      return countBitsAvx2(bits,length);
+    }
+#endif
+  return countBitsScalar(bits,length);
+}
+
+/**
+ * Write a LEB128 varint.
+ * @param out The stream, or NULL to only count the bytes.
+ * @param value The value to write.
+ * @return Number of bytes of the varint.
+ */
+static size_t
+writeVarint(std::ostream *out, uint64_t value)
+{
+  char buffer[10];
+  size_t length = 0;
+
+  while(value >= 0x80)
+    {
+      buffer[length++] = (char)((value & 0x7f) | 0x80);
+      value >>= 7;
+    }
+  buffer[length++] = (char)value;
+  if(out != NULL)
+    {
+      out->write(buffer,length);
+    }
+  return length;
+}
+
+static bool
+readVarint(std::istream &in, uint64_t &value)
+{
+  value = 0;
+  for(int shift = 0 ; shift < 64 ; shift += 7)
+    {
+      int c = in.get();
+
+      if(c == EOF)
+        {
+          return false;
+        }
+      value |= (uint64_t)(c & 0x7f) << shift;
+      if((c & 0x80) == 0)
+        {
+          return true;
+        }
+    }
+  return false;
+}
+
+static bool
+isZeroWord(const uint8_t *bits, size_t length, size_t word)
+{
+  size_t start = word * sizeof(uint64_t);
+
+  if(start + sizeof(uint64_t) <= length)
+    {
+      uint64_t value;
+
+      memcpy(&value,bits + start,sizeof(value));
+      return value == 0;
+    }
+  for(size_t i = start ; i < length ; i++)
+    {
+      if(bits[i] != 0)
+        {
+          return false;
+        }
+    }
+  return true;
+}
+
+/**
+ * Encode filter bits as runs of 64-bit words: each run is the number of
+ * zero words and the number of literal words that follow them, as LEB128
+ * varints, then the literal words. A final partial word is padded with
+ * zeros.
+ * @param bits The filter bits.
+ * @param length Number of bytes in bits.
+ * @param out Receives the encoding, or NULL to only size it.
+ * @return Number of bytes of the encoding.
+ */
+static uint64_t
+encodeZeroRuns(const uint8_t *bits, size_t length, std::ostream *out)
+{
+  static const char Padding[sizeof(uint64_t)] = {};
+  size_t words = (length + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+  size_t word = 0;
+  uint64_t encoded = 0;
+
+  while(word < words)
+    {
+      size_t zeros = 0;
+      while(word + zeros < words && isZeroWord(bits,length,word + zeros))
+        {
+          zeros++;
+        }
+      size_t literals = 0;
+      while(word + zeros + literals < words &&
+            !isZeroWord(bits,length,word + zeros + literals))
+        {
+          literals++;
+        }
+      encoded += writeVarint(out,zeros);
+      encoded += writeVarint(out,literals);
+
+      size_t start = (word + zeros) * sizeof(uint64_t);
+      size_t bytes = literals * sizeof(uint64_t);
+
+      // Only the last literal word can run past the end
+      if(out != NULL && bytes > 0)
+        {
+          size_t stored = std::min(bytes,length - start);
+
+          out->write((const char *)bits + start,stored);
+          out->write(Padding,bytes - stored);
+        }
+      encoded += bytes;
+      word += zeros + literals;
+    }
+  return encoded;
+}
+
+/**
+ * Decode filter bits written by encodeZeroRuns() from a stream.
+ * @param in The stream, positioned at the start of the encoding.
+ * @param bits Receives the filter bits.
+ * @param length Number of bytes in bits.
+ * @return False if the encoding is truncated or does not match length.
+ */
+static bool
+decodeZeroRuns(std::istream &in, uint8_t *bits, size_t length)
+{
+  size_t words = (length + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+  size_t word = 0;
+
+  while(word < words)
+    {
+      uint64_t zeros;
+      uint64_t literals;
+
+      if(!readVarint(in,zeros) || !readVarint(in,literals) ||
+         (zeros == 0 && literals == 0) || zeros > words - word ||
+         literals > words - word - zeros)
+        {
+          return false;
+        }
+
+      size_t start = word * sizeof(uint64_t);
+      size_t zero_bytes = std::min(zeros * sizeof(uint64_t),length - start);
+
+      memset(bits + start,0,zero_bytes);
+      start += zero_bytes;
+
+      size_t literal_bytes = literals * sizeof(uint64_t);
+      size_t stored_bytes = std::min(literal_bytes,length - start);
+
+      in.read((char *)bits + start,stored_bytes);
+      in.ignore(literal_bytes - stored_bytes);
+      if(!in)
+        {
+          return false;
+        }
+      word += zeros + literals;
+    }
+  return true;
+}
+
+/**
+ * Encode filter bits as their number of set bits, then the index of each set
+ * bit less the index of the previous one plus one, all as LEB128 varints.
+ * This is smaller than encodeZeroRuns() when the set bits are too spread
+ * out for many words to be zero.
+ * @param bits The filter bits.
+ * @param length Number of bytes in bits.
+ * @param set_bits Number of set bits in bits.
+ * @param out Receives the encoding, or NULL to only size it.
+ * @return Number of bytes of the encoding.
+ */
+static uint64_t
+encodeSetBitGaps(const uint8_t *bits, size_t length, uint64_t set_bits,
+                 std::ostream *out)
+{
+  uint64_t encoded = writeVarint(out,set_bits);
+  uint64_t next = 0;
+
+  for(size_t i = 0 ; i < length ; i++)
+    {
+      unsigned int byte = bits[i];
+
+      while(byte != 0)
+        {
+          uint64_t index = i * 8 + __builtin_ctz(byte);
+
+          encoded += writeVarint(out,index - next);
+          next = index + 1;
+          byte &= byte - 1;
+        }
+    }
+  return encoded;
+}
+
+/**
+ * Decode filter bits written by encodeSetBitGaps() from a stream.
+ * @param in The stream, positioned at the start of the encoding.
+ * @param bits Receives the filter bits.
+ * @param length Number of bytes in bits.
+ * @return False if the encoding is truncated or does not match length.
+ */
+static bool
+decodeSetBitGaps(std::istream &in, uint8_t *bits, size_t length)
+{
+  uint64_t bitlength = (uint64_t)length * 8;
+  uint64_t set_bits;
+
+  memset(bits,0,length);
+  if(!readVarint(in,set_bits) || set_bits > bitlength)
+    {
+      return false;
+    }
+
+  uint64_t next = 0;
+
+  for(uint64_t i = 0 ; i < set_bits ; i++)
+    {
+      uint64_t gap;
+
+      if(!readVarint(in,gap) || gap >= bitlength - next)
+        {
+          return false;
+        }
+      next += gap;
+      bits[next / 8] |= (uint8_t)(1 << (next % 8));
+      next++;
+    }
+  return true;
+}
 
 BloomFilterBase::BloomFilterBase(size_t inserted_items,
                                  double probability_false_positive,
                                  int ip_protocol_num, int port_num,
                                  int min_ngram_size,
-                                 int max_ngram_size) :
+                                 int max_ngram_size,
+                                 BloomLayout layout,
+                                 BloomIndexMode index_mode,
+                                 BloomHashFamily hash_family,
+                                 BloomSizing sizing,
+                                 BloomShortNgrams short_ngrams) :
   BenignNgramStorage(ip_protocol_num,port_num,min_ngram_size,max_ngram_size),
-  m_blm_frm_mem(true)
+  m_bits(NULL),
+  m_load_mode(LOAD_MEMORY),
+  m_mmap_addr(NULL),
+  m_mmap_length(0),
+  m_layout(layout),
+  m_index_mode(index_mode),
+  m_hash_family(hash_family),
+  m_sizing(sizing),
+  m_exact_max_ngram_size(0),
+  m_exact_bitlength(0),
+  m_blm_frm_mem(true),
+  m_stream_payload_crc(false),
+  m_compress_output(false),
+  m_header_set_bits(-1),
+  m_concurrent_reads(false),
+  m_read_fd(-1)
 {
+  if(m_hash_family == HASH_INCREMENTAL && m_index_mode != INDEX_DOUBLE_HASH)
+    {
+      // The incremental hash yields a single 128-bit hash, not one per seed.
+      BOOST_LOG_TRIVIAL(debug) << "Incremental hash uses double hashing" <<
+        std::endl;
+      m_index_mode = INDEX_DOUBLE_HASH;
+    }
+
   BOOST_LOG_TRIVIAL(debug) << "Expected number of insertions: " <<
     inserted_items << std::endl;
   BOOST_LOG_TRIVIAL(debug) << "Desired probability of false alarm: " <<
@@ -189,9 +621,11 @@ BloomFilterBase::BloomFilterBase(size_t inserted_items,
   unsigned long int bitlength_guess = 1;
   BOOST_LOG_TRIVIAL(debug) << "Start bitlength: " <<
     m_bitlength << std::endl;
-  for(int i = 0;i < (sizeof(unsigned long int)*8);i++)
+  for(unsigned int i = 0;
+      (m_sizing == SIZING_POWER_OF_2) && (i < (sizeof(unsigned long int)*8));
+      i++)
     {
-      bitlength_guess = 1L << i;
+      bitlength_guess = 1UL << i;
 
       if(bitlength_guess > m_bitlength)
         {
@@ -210,6 +644,15 @@ BloomFilterBase::BloomFilterBase(size_t inserted_items,
       // A zero-size bloom filter is useless.
       m_bitlength = 8;
     }
+
+  if(m_layout == LAYOUT_BLOCKED &&
+     m_bitlength % CalcBitIndeces::BLOCK_SIZE_BITS != 0)
+    {
+      // A blocked filter holds whole blocks. Power of 2 filters of at least
+      // one block are already a multiple of the block size.
+      m_bitlength += CalcBitIndeces::BLOCK_SIZE_BITS -
+        (m_bitlength % CalcBitIndeces::BLOCK_SIZE_BITS);
+    }
   BOOST_LOG_TRIVIAL(debug) << "Bitlength: " <<
     m_bitlength << std::endl;
 
@@ -230,11 +673,24 @@ BloomFilterBase::BloomFilterBase(size_t inserted_items,
     }
   BOOST_LOG_TRIVIAL(debug) << "Number of hashes: " <<
     m_num_hashes << std::endl;
-  mBloomFilter.resize((m_bitlength>>3),0);
+
+  if(short_ngrams == SHORT_NGRAMS_EXACT &&
+     m_min_ngram_size <= CalcBitIndeces::MAX_EXACT_NGRAM_SIZE)
+    {
+      m_exact_max_ngram_size =
+        (m_max_ngram_size < CalcBitIndeces::MAX_EXACT_NGRAM_SIZE) ?
+        m_max_ngram_size : CalcBitIndeces::MAX_EXACT_NGRAM_SIZE;
+      m_exact_bitlength = CalcBitIndeces::exactBits(m_min_ngram_size,
+                                                    m_exact_max_ngram_size);
+      BOOST_LOG_TRIVIAL(debug) << "Exact bitmap bits: " <<
+        m_exact_bitlength << std::endl;
+    }
+  mBloomFilter.resize(bitArrayBytes(),0);
+  m_bits = mBloomFilter.data();
 
   // Initialize cache
 
-  m_calc_bit_indeces = CalcBitIndeces(m_num_hashes,m_bitlength);
+  m_calc_bit_indeces = makeCalcBitIndeces();
 
     BOOST_LOG_TRIVIAL(debug) << "Before Hash Construction" <<
       std::endl;
@@ -257,9 +713,32 @@ BloomFilterBase::BloomFilterBase(size_t inserted_items,
 
 
 BloomFilterBase::BloomFilterBase(const std::string &filename, bool from_mem_p) :
-  m_blm_frm_mem(from_mem_p),m_bf_stream(filename.c_str(),
-                                        std::ios::out | std::ios::in |
-                                        std::ios::binary)
+  BloomFilterBase(filename,from_mem_p ? LOAD_MEMORY : LOAD_STREAM)
+{}
+
+BloomFilterBase::BloomFilterBase(const std::string &filename,
+                                 BloomLoadMode load_mode,
+                                 unsigned int mmap_hints) :
+  m_bits(NULL),
+  m_load_mode(load_mode),
+  m_mmap_addr(NULL),
+  m_mmap_length(0),
+  m_layout(LAYOUT_STANDARD),
+  m_index_mode(INDEX_PER_SEED),
+  m_hash_family(HASH_MURMUR3),
+  m_sizing(SIZING_POWER_OF_2),
+  m_exact_max_ngram_size(0),
+  m_exact_bitlength(0),
+  m_blm_frm_mem(load_mode != LOAD_STREAM),
+  m_stream_payload_crc(false),
+  m_compress_output(false),
+  m_header_set_bits(-1),
+  m_concurrent_reads(false),
+  m_read_fd(-1),
+  m_bf_stream(filename.c_str(),
+              (load_mode == LOAD_STREAM) ?
+              (std::ios::out | std::ios::in | std::ios::binary) :
+              (std::ios::in | std::ios::binary))
 {
     if(!m_bf_stream)
       {
@@ -268,70 +747,189 @@ BloomFilterBase::BloomFilterBase(const std::string &filename, bool from_mem_p) :
         exit(-1);
 
       }
-    m_bf_stream.read(HeaderBuffer,HeaderLengthInBytes);
+    char header_buffer[HeaderLengthInBytes];
+
+    m_bf_stream.read(header_buffer,HeaderLengthInBytes);
+    if(!m_bf_stream)
+      {
+        BOOST_LOG_TRIVIAL(error) << "Bloom filter header truncated: " <<
+          filename << std::endl;
+        exit(-1);
+      }
 
-    std::string bf_prop_string(HeaderBuffer);
+    bool has_payload_crc = false;
+    uint8_t encoding = 0;
+    uint32_t payload_crc = 0;
+    uint64_t payload_length = 0;
 
-    // Now, extract the bloom filter file header information
+    if(BloomFilterHeader::isBinaryHeader(header_buffer,HeaderLengthInBytes))
+      {
+        BloomFilterHeader header;
+        size_t offset = 0;
+
+        if(!header.unserialize(header_buffer,offset,HeaderLengthInBytes))
+          {
+            BOOST_LOG_TRIVIAL(error) << "Bad Bloom filter header in " <<
+              filename << ": " << header.serialize_error_string << std::endl;
+            exit(-1);
+          }
+        m_ip_protocol_num = header.ip_protocol_num;
+        m_port_num = header.port_num;
+        m_min_ngram_size = header.min_ngram_size;
+        m_max_ngram_size = header.max_ngram_size;
+        m_bytes_processed = header.bytes_processed;
+        m_bitlength = header.bitlength;
+        m_num_hashes = header.num_hashes;
+        m_layout = (BloomLayout)header.layout;
+        m_index_mode = (BloomIndexMode)header.index_mode;
+        m_hash_family = (BloomHashFamily)header.hash_family;
+        m_sizing = (BloomSizing)header.sizing;
+        m_exact_max_ngram_size = header.exact_max_ngram_size;
+        has_payload_crc = (header.flags & BloomFilterHeader::FLAG_PAYLOAD_CRC);
+        encoding = header.flags & (BloomFilterHeader::FLAG_ZERO_RUNS |
+                                   BloomFilterHeader::FLAG_SET_BIT_GAPS);
+        payload_crc = header.payload_crc;
+        payload_length = header.payload_length;
+        if(header.flags & BloomFilterHeader::FLAG_SET_BITS)
+          {
+            m_header_set_bits = header.set_bits;
+          }
+      }
+    else
+      {
+        // A text header, written before the binary header
+        std::map<std::string,std::string> bf_properties;
 
-    std::map<std::string,std::string> bf_properties;
+        StorageFile::parseTextHeader(header_buffer,HeaderLengthInBytes,
+                                     bf_properties);
+        loadTextProperties(bf_properties);
+        loadParams(bf_properties); // Load params for BenignNgramStorage
+      }
 
-    boost::regex exp("(\\w+)\\s*=\\s*(\\w+)");
-    boost::match_results<std::string::const_iterator> what;
-    std::string::const_iterator start = bf_prop_string.begin();
+    if(m_hash_family == HASH_INCREMENTAL && m_index_mode != INDEX_DOUBLE_HASH)
+      {
+        BOOST_LOG_TRIVIAL(error) << "HASH_FAMILY INCREMENTAL requires "
+          "INDEX_MODE DOUBLE_HASH" << std::endl;
+        exit(-1);
+      }
 
-    BOOST_LOG_TRIVIAL(debug) << "List properties: "
-                             << std::endl;
-    while(boost::regex_search(start,bf_prop_string.cend(),what,exp))
+    if(m_sizing == SIZING_POWER_OF_2 && (m_bitlength & (m_bitlength - 1)) != 0)
+      {
+        BOOST_LOG_TRIVIAL(error) << "SIZING POWER_OF_2 with BITLENGTH " <<
+          m_bitlength << std::endl;
+        exit(-1);
+      }
+
+    if(m_exact_max_ngram_size > 0)
       {
-        bf_properties[what[1]] = what[2];
-        std::string item1 = what[1];
-        std::string item2 = what[2];
-        BOOST_LOG_TRIVIAL(debug) << item1 << " = " << item2
-                                 << std::endl;
-        start = what[0].second;
+        if(m_exact_max_ngram_size > CalcBitIndeces::MAX_EXACT_NGRAM_SIZE ||
+           m_exact_max_ngram_size < m_min_ngram_size)
+          {
+            BOOST_LOG_TRIVIAL(error) << "Bad EXACT_MAX_NGRAM_SIZE: " <<
+              m_exact_max_ngram_size << std::endl;
+            exit(-1);
+          }
+        m_exact_bitlength = CalcBitIndeces::exactBits(m_min_ngram_size,
+                                                      m_exact_max_ngram_size);
       }
-    loadParams(bf_properties); // Load params for BenignNgramStorage
 
+    std::streampos bloom_size = bitArrayBytes();
+
+    if(payload_length != 0 && payload_length != (uint64_t)bloom_size)
+      {
+        BOOST_LOG_TRIVIAL(error) << "Bloom filter header of " << filename <<
+          " records " << payload_length << " bytes of filter data instead of "
+                                 << bloom_size << std::endl;
+        exit(-1);
+      }
 
-    // Now load Bloom filter specific parameters
+    if(encoding != 0)
+      {
+        // Compressed bits are expanded in memory whatever the load mode. A
+        // LOAD_MMAP filter stays read-only, a LOAD_STREAM one becomes
+        // LOAD_MEMORY.
+        mBloomFilter.resize(bloom_size,0);
 
-       std::map<std::string,std::string>::const_iterator cit =
-      bf_properties.begin();
+        bool decoded = (encoding == BloomFilterHeader::FLAG_ZERO_RUNS) ?
+          decodeZeroRuns(m_bf_stream,mBloomFilter.data(),bloom_size) :
+          decodeSetBitGaps(m_bf_stream,mBloomFilter.data(),bloom_size);
 
-    while(cit != bf_properties.end())
+        if(!decoded)
+          {
+            BOOST_LOG_TRIVIAL(error) << "Compressed Bloom filter data "
+              "truncated or corrupt: " << filename << std::endl;
+            exit(-1);
+          }
+        m_bits = mBloomFilter.data();
+        if(has_payload_crc &&
+           BloomFilterHeader::crc32c(m_bits,bloom_size) != payload_crc)
+          {
+            BOOST_LOG_TRIVIAL(error) << "Bloom filter data CRC mismatch: " <<
+              filename << std::endl;
+            exit(-1);
+          }
+        if(m_load_mode == LOAD_STREAM)
+          {
+            m_load_mode = LOAD_MEMORY;
+            m_blm_frm_mem = true;
+          }
+      }
+    else
       {
-        if((cit->first).compare(std::string("BITLENGTH")) == 0)
+        // Reject a truncated file before reading or mapping any of the bits
+        m_bf_stream.seekg(0,std::ios::end);
+        if(m_bf_stream.tellg() <
+           (std::streampos)HeaderLengthInBytes + bloom_size)
           {
-            BOOST_LOG_TRIVIAL(error) << "Found BITLENGTH " << std::endl;
+            BOOST_LOG_TRIVIAL(error) << "Bloom filter file too short: " <<
+              filename << std::endl;
+            exit(-1);
+          }
+        m_bf_stream.seekg(HeaderLengthInBytes);
 
-            std::istringstream(cit->second) >> m_bitlength;
+        if(m_load_mode == LOAD_MMAP)
+          {
+            // The bits are paged in on demand, so the payload CRC is not
+            // checked; doing so would read the whole file up front.
+            mapBits(filename,mmap_hints);
+            m_bf_stream.close();
           }
-        else if((cit->first).compare(std::string("NUM_HASHES")) == 0)
+        else if(m_blm_frm_mem)
           {
-            std::istringstream(cit->second) >> m_num_hashes;
+            mBloomFilter.resize(bloom_size,0);
+            m_bf_stream.read((char *)&mBloomFilter[0], bloom_size);
+            m_bits = mBloomFilter.data();
+            if(has_payload_crc &&
+               BloomFilterHeader::crc32c(m_bits,bloom_size) != payload_crc)
+              {
+                BOOST_LOG_TRIVIAL(error) << "Bloom filter data CRC mismatch: "
+                                         << filename << std::endl;
+                exit(-1);
+              }
           }
         else
           {
-            BOOST_LOG_TRIVIAL(error) << "Unknown property: " <<
-              cit->first << " of length: " << (cit->first).size() <<  std::endl;
+            // The file is modified in place, which invalidates the payload
+            // CRC
+            m_stream_payload_crc = has_payload_crc;
+
+            // Concurrent reads use positional reads of their own descriptor
+            // rather than the cursor of the stream
+            m_read_fd = open(filename.c_str(),O_RDONLY);
+            if(m_read_fd < 0)
+              {
+                BOOST_LOG_TRIVIAL(error) << "Unable to open: " <<
+                  filename << std::endl;
+                exit(-1);
+              }
           }
-        cit++;
-      }
-
-    std::streampos bloom_size = m_bitlength>>3;
-
-    if(m_blm_frm_mem)
-      {
-        mBloomFilter.resize(bloom_size,0);
-        m_bf_stream.read((char *)&mBloomFilter[0], bloom_size);
       }
     BOOST_LOG_TRIVIAL(debug) << "Finished constructing BloomFilter"
                              << std::endl;
   // Construct cache
     BOOST_LOG_TRIVIAL(debug) << "Before Hash Construction" <<
       std::endl;
-    m_calc_bit_indeces = CalcBitIndeces(m_num_hashes,m_bitlength);
+    m_calc_bit_indeces = makeCalcBitIndeces();
 
   m_cache = boost::shared_ptr<lru_cache_using_std<
                                   CalcBitIndeces,
@@ -346,93 +944,458 @@ BloomFilterBase::BloomFilterBase(const std::string &filename, bool from_mem_p) :
                                                         NUM_CACHE_ENTRIES));
 
 }
+
+/**
+ * Load the Bloom filter specific properties of a text header, and remove
+ * them from bf_properties.
+ */
+void
+BloomFilterBase::loadTextProperties(std::map<std::string,std::string>
+                                    &bf_properties)
+{
+  std::map<std::string,std::string>::iterator cit = bf_properties.begin();
+
+  while(cit != bf_properties.end())
+    {
+      if((cit->first).compare(std::string("BITLENGTH")) == 0)
+        {
+          std::istringstream(cit->second) >> m_bitlength;
+        }
+      else if((cit->first).compare(std::string("NUM_HASHES")) == 0)
+        {
+          std::istringstream(cit->second) >> m_num_hashes;
+        }
+      else if((cit->first).compare(std::string("LAYOUT")) == 0)
+        {
+          if((cit->second).compare(std::string("STANDARD")) == 0)
+            {
+              m_layout = LAYOUT_STANDARD;
+            }
+          else if((cit->second).compare(std::string("BLOCKED")) == 0)
+            {
+              m_layout = LAYOUT_BLOCKED;
+            }
+          else
+            {
+              BOOST_LOG_TRIVIAL(error) << "Unknown LAYOUT: " <<
+                cit->second << std::endl;
+              exit(-1);
+            }
+        }
+      else if((cit->first).compare(std::string("INDEX_MODE")) == 0)
+        {
+          if((cit->second).compare(std::string("PER_SEED")) == 0)
+            {
+              m_index_mode = INDEX_PER_SEED;
+            }
+          else if((cit->second).compare(std::string("DOUBLE_HASH")) == 0)
+            {
+              m_index_mode = INDEX_DOUBLE_HASH;
+            }
+          else
+            {
+              BOOST_LOG_TRIVIAL(error) << "Unknown INDEX_MODE: " <<
+                cit->second << std::endl;
+              exit(-1);
+            }
+        }
+      else if((cit->first).compare(std::string("HASH_FAMILY")) == 0)
+        {
+          if((cit->second).compare(std::string("MURMUR3")) == 0)
+            {
+              m_hash_family = HASH_MURMUR3;
+            }
+          else if((cit->second).compare(std::string("INCREMENTAL")) == 0)
+            {
+              m_hash_family = HASH_INCREMENTAL;
+            }
+          else
+            {
+              BOOST_LOG_TRIVIAL(error) << "Unknown HASH_FAMILY: " <<
+                cit->second << std::endl;
+              exit(-1);
+            }
+        }
+      else if((cit->first).compare(std::string("SIZING")) == 0)
+        {
+          if((cit->second).compare(std::string("POWER_OF_2")) == 0)
+            {
+              m_sizing = SIZING_POWER_OF_2;
+            }
+          else if((cit->second).compare(std::string("EXACT")) == 0)
+            {
+              m_sizing = SIZING_EXACT;
+            }
+          else
+            {
+              BOOST_LOG_TRIVIAL(error) << "Unknown SIZING: " <<
+                cit->second << std::endl;
+              exit(-1);
+            }
+        }
+      else if((cit->first).compare(std::string("EXACT_MAX_NGRAM_SIZE"))
+              == 0)
+        {
+          std::istringstream(cit->second) >> m_exact_max_ngram_size;
+        }
+      else
+        {
+          // Left for BenignNgramStorage::loadParams()
+          cit++;
+          continue;
+        }
+      bf_properties.erase(cit++);
+    }
+}
+
   /**
    * Destructor.
    */
 BloomFilterBase::~BloomFilterBase()
 {
+  if(m_mmap_addr != NULL)
+    {
+      munmap(m_mmap_addr,m_mmap_length);
+    }
   if(!m_blm_frm_mem)
     {
       m_bf_stream.close();
     }
+  if(m_read_fd >= 0)
+    {
+      close(m_read_fd);
+    }
 }
 
-/**
- * Flush the data structure to a file.
- * @param filename Name of file used for persistence.
- */
-bool
-BloomFilterBase::flush(std::string filename)
+CalcBitIndeces
+BloomFilterBase::makeCalcBitIndeces() const
 {
-  std::string serialized_header;
+  return CalcBitIndeces(m_num_hashes,m_bitlength,m_layout,m_index_mode,
+                        m_hash_family,m_sizing,m_min_ngram_size,
+                        m_exact_max_ngram_size);
+}
 
-  std::ostringstream out;
+void
+BloomFilterBase::mapBits(const std::string &filename,unsigned int mmap_hints)
+{
+  // Map from the start of the file so the offset is page aligned, and skip
+  // the header in the mapping.
+  m_mmap_length = HeaderLengthInBytes + bitArrayBytes();
+  m_mmap_addr = StorageFile::mapFile(filename,m_mmap_length,mmap_hints);
+  m_bits = (uint8_t *)m_mmap_addr + HeaderLengthInBytes;
+}
 
-  out << "IP_PROTOCOL_NUMBER = " << m_ip_protocol_num << std::endl;
-  out << "TCP_IP_PORT_NUM = " << m_port_num << std::endl;
-  out << "BITLENGTH = " << m_bitlength << std::endl;
-  out << "NUM_HASHES = " << m_num_hashes << std::endl;
-  out << "MIN_NGRAM_SIZE = " << m_min_ngram_size << std::endl;
-  out << "MAX_NGRAM_SIZE = " << m_max_ngram_size << std::endl;
-  out << "NUM_PAYLOAD_BYTES_PROCESSED = " << m_bytes_processed << std::endl;
-  serialized_header = out.str();
+std::string
+BloomFilterBase::headerString(unsigned long long int bytes_processed,
+                              bool has_payload_crc,
+                              uint32_t payload_crc,
+                              uint8_t encoding,
+                              int64_t set_bits) const
+{
+  BloomFilterHeader header;
+  char buffer[HeaderLengthInBytes];
+  size_t offset = 0;
 
-  const char *persist_filename = filename.c_str();
-  std::ofstream bfStream(persist_filename,std::ios::out | std::ios::binary);
+  header.flags = has_payload_crc ? BloomFilterHeader::FLAG_PAYLOAD_CRC : 0;
+  header.flags |= encoding;
+  if(set_bits >= 0)
+    {
+      header.flags |= BloomFilterHeader::FLAG_SET_BITS;
+      header.set_bits = set_bits;
+    }
+  header.ip_protocol_num = m_ip_protocol_num;
+  header.port_num = m_port_num;
+  header.min_ngram_size = m_min_ngram_size;
+  header.max_ngram_size = m_max_ngram_size;
+  header.exact_max_ngram_size = m_exact_max_ngram_size;
+  header.layout = m_layout;
+  header.index_mode = m_index_mode;
+  header.hash_family = m_hash_family;
+  header.sizing = m_sizing;
+  header.num_hashes = m_num_hashes;
+  header.bitlength = m_bitlength;
+  header.bytes_processed = bytes_processed;
+  header.payload_length = bitArrayBytes();
+  header.payload_crc = payload_crc;
+  if(!header.serialize(buffer,offset,sizeof(buffer)))
+    {
+      BOOST_LOG_TRIVIAL(error) << "Unable to serialize Bloom filter header: "
+                               << header.serialize_error_string << std::endl;
+      exit(-1);
+    }
+  return std::string(buffer,offset);
+}
 
-  if(!bfStream)
+void
+BloomFilterBase::insertSpan(const NgramSpan &ngram)
+{
+  if(m_calc_bit_indeces.isExact(ngram.length))
     {
-      BOOST_LOG_TRIVIAL(error) <<
-        "Unable to open: " << filename << std::endl;
-      return false;
+      uint64_t bit_index =
+        m_calc_bit_indeces.exactIndex(ngram.data,ngram.length);
+
+      setBitIndeces(&bit_index,1);
+      return;
     }
-  const char *raw_bytes =
-    reinterpret_cast<const char *>(serialized_header.c_str());
-  unsigned int raw_size = serialized_header.size();
 
-  bfStream.write(raw_bytes,raw_size);
-  bfStream.write(Filler,HeaderLengthInBytes-raw_size);
+  uint64_t bit_indeces[MAX_HASHES];
 
+  m_calc_bit_indeces.calcIndeces(ngram.data,ngram.length,bit_indeces);
+  setBitIndeces(bit_indeces,m_num_hashes);
+}
 
-  //  bfStream.write(it,mBloomFilter.size());
-  BOOST_LOG_TRIVIAL(debug) << "Before output: " << std::endl;
-  unsigned int e_above = entryAbove(1);
-  if(e_above > 1)
+bool
+BloomFilterBase::containsSpan(const NgramSpan &ngram)
+{
+  if(m_calc_bit_indeces.isExact(ngram.length))
     {
-      std::cout << "Entry above 1 is " << e_above << std::endl;
+      uint64_t bit_index =
+        m_calc_bit_indeces.exactIndex(ngram.data,ngram.length);
+
+      return testBitIndeces(&bit_index,1);
     }
-  else
+
+  uint64_t bit_indeces[MAX_HASHES];
+
+  m_calc_bit_indeces.calcIndeces(ngram.data,ngram.length,bit_indeces);
+  return testBitIndeces(bit_indeces,m_num_hashes);
+}
+
+void
+BloomFilterBase::containsBatch(const std::vector<NgramSpan> &ngrams,
+                               std::vector<bool> &results)
+{
+  results.resize(ngrams.size());
+
+  if(m_bits == NULL)
     {
-      std::cout << "FAILED ENTRY ABOVE TEST" << std::endl;
+      // Nothing to prefetch when the bits are read from the file
+      for(size_t i = 0 ; i < ngrams.size() ; i++)
+        {
+          results[i] = containsSpan(ngrams[i]);
+        }
+      return;
     }
 
-  std::vector<unsigned int> histo(255,0);
-  std::vector<uint8_t>::iterator it = mBloomFilter.begin();
+  // Concurrent lookups can not share the scratch vectors of the filter
+  std::vector<size_t> local_first, local_order;
+  std::vector<uint64_t> local_indeces;
+  std::vector<size_t> &first_of_length =
+    m_concurrent_reads ? local_first : m_batch_first_of_length;
+  std::vector<size_t> &order =
+    m_concurrent_reads ? local_order : m_batch_order;
+  std::vector<uint64_t> &indeces =
+    m_concurrent_reads ? local_indeces : m_batch_indeces;
+
+  // Visit the ngrams ordered by length so that groups of eight ngrams of the
+  // same length can be hashed together. A counting sort.
+  size_t max_length = 0;
+  for(size_t i = 0 ; i < ngrams.size() ; i++)
+    {
+      max_length = std::max(max_length,ngrams[i].length);
+    }
+  first_of_length.assign(max_length + 2,0);
+  for(size_t i = 0 ; i < ngrams.size() ; i++)
+    {
+      first_of_length[ngrams[i].length + 1]++;
+    }
+  for(size_t l = 1 ; l < first_of_length.size() ; l++)
+    {
+      first_of_length[l] += first_of_length[l - 1];
+    }
+  order.resize(ngrams.size());
+  for(size_t i = 0 ; i < ngrams.size() ; i++)
+    {
+      order[first_of_length[ngrams[i].length]++] = i;
+    }
 
-  while(it != mBloomFilter.end())
+  // Two groups of indeces: one being prefetched while the other is resolved
+  indeces.resize(2 * BATCH_GROUP_SIZE * m_num_hashes);
+  size_t num_groups =
+    (ngrams.size() + BATCH_GROUP_SIZE - 1) / BATCH_GROUP_SIZE;
+
+  for(size_t group = 0 ; group <= num_groups ; group++)
     {
-      uint8_t val = *it;
-      histo[*it] += 1;
-     it++;
+      if(group < num_groups)
+        {
+          size_t first = group * BATCH_GROUP_SIZE;
+          size_t last = std::min(first + BATCH_GROUP_SIZE,ngrams.size());
+          uint64_t *group_indeces =
+            &indeces[(group % 2) * BATCH_GROUP_SIZE * m_num_hashes];
+
+          if(BATCH_GROUP_SIZE == 8 && last - first == 8 &&
+             ngrams[order[first]].length == ngrams[order[last - 1]].length)
+            {
+              const void *keys[8];
+
+              for(size_t i = first ; i < last ; i++)
+                {
+                  keys[i - first] = ngrams[order[i]].data;
+                }
+              m_calc_bit_indeces.calcIndecesX8(keys,ngrams[order[first]].length,
+                                               group_indeces);
+            }
+          else
+            {
+              for(size_t i = first ; i < last ; i++)
+                {
+                  m_calc_bit_indeces.calcIndeces(ngrams[order[i]].data,
+                                                 ngrams[order[i]].length,
+                                                 group_indeces +
+                                                 (i - first) * m_num_hashes);
+                }
+            }
+
+          // A blocked filter keeps all the bits in one cache line. Most
+          // lookups of novel ngrams stop at one of the first few bits, so
+          // only those are prefetched for a standard filter.
+          size_t num_prefetch = (m_layout == LAYOUT_BLOCKED) ? 1 :
+            std::min((size_t)BATCH_PREFETCH_HASHES,(size_t)m_num_hashes);
+          for(size_t i = first ; i < last ; i++)
+            {
+              const uint64_t *bit_indeces =
+                group_indeces + (i - first) * m_num_hashes;
+
+              for(size_t j = 0 ; j < num_prefetch ; j++)
+                {
+                  __builtin_prefetch(&m_bits[bit_indeces[j] / CHAR_SIZE_BITS]);
+                }
+            }
+        }
+      if(group > 0)
+        {
+          size_t first = (group - 1) * BATCH_GROUP_SIZE;
+          size_t last = std::min(first + BATCH_GROUP_SIZE,ngrams.size());
+          const uint64_t *group_indeces =
+            &indeces[((group - 1) % 2) * BATCH_GROUP_SIZE * m_num_hashes];
+
+          for(size_t i = first ; i < last ; i++)
+            {
+              // Short ngrams in an exact bitmap have a single bit
+              results[order[i]] =
+                testBitIndeces(group_indeces + (i - first) * m_num_hashes,
+                               m_calc_bit_indeces.numIndeces(
+                                 ngrams[order[i]].length));
+            }
+        }
     }
+}
 
-  for(int i=0;i<255;i++)
+void
+BloomFilterBase::insertNgrams(uint8_t const * data, size_t length,
+                              int min_ngram_size, int max_ngram_size)
+{
+  m_calc_bit_indeces.payloadIndeces(data,length,min_ngram_size,max_ngram_size,
+                                    [this](const uint64_t *bit_indeces)
+                                    {
+                                      setBitIndeces(bit_indeces,m_num_hashes);
+                                    });
+}
+
+bool
+BloomFilterBase::flush(std::string filename)
+{
+  // The bits of a LOAD_STREAM filter are only in its file, which is kept up
+  // to date as bits are set
+  if(m_bits == NULL)
+    {
+      BOOST_LOG_TRIVIAL(error) << "A streamed Bloom filter can not be "
+        "flushed to " << filename << std::endl;
+      return false;
+    }
+
+  size_t bloom_size = bitArrayBytes();
+  uint64_t set_bits = countSetBits();
+  // Including the exact bitmaps
+  uint64_t all_set_bits = 0;
+  uint8_t encoding = 0;
+
+  if(m_compress_output)
+    {
+      // Every set bit takes at least a byte of the set bit gaps, so they
+      // are only sized when that could beat the other encodings. The
+      // chosen encoding is written straight to the file below.
+      all_set_bits = set_bits + countBits(m_bits + (m_bitlength >> 3),
+                                          bloom_size - (m_bitlength >> 3));
+      uint64_t best_size = bloom_size;
+      uint64_t run_size = encodeZeroRuns(m_bits,bloom_size,NULL);
+
+      BOOST_LOG_TRIVIAL(debug) << "Compressed Bloom filter size: " <<
+        run_size << " as zero runs" << std::endl;
+      if(run_size < best_size)
+        {
+          encoding = BloomFilterHeader::FLAG_ZERO_RUNS;
+          best_size = run_size;
+        }
+      if(all_set_bits < best_size)
+        {
+          uint64_t gap_size =
+            encodeSetBitGaps(m_bits,bloom_size,all_set_bits,NULL);
+
+          BOOST_LOG_TRIVIAL(debug) << "Compressed Bloom filter size: " <<
+            gap_size << " as set bit gaps" << std::endl;
+          if(gap_size < best_size)
+            {
+              encoding = BloomFilterHeader::FLAG_SET_BIT_GAPS;
+            }
+        }
+    }
+
+  fasguard::bloom_filter_statistics stats(m_bitlength,m_num_hashes,
+                                          set_bits);
+
+  BOOST_LOG_TRIVIAL(info) << stats.to_string() << std::endl;
+  if(stats.fill_ratio() > 0.5)
+    {
+      BOOST_LOG_TRIVIAL(warning) << "Bloom filter is more than half full: "
+        "it holds more ngrams than it was sized for" << std::endl;
+    }
+
+  std::string serialized_header =
+    headerString(m_bytes_processed,true,
+                 BloomFilterHeader::crc32c(m_bits,bloom_size),
+                 encoding,set_bits);
+
+  const char *persist_filename = filename.c_str();
+  std::ofstream bfStream(persist_filename,std::ios::out | std::ios::binary);
+
+  if(!bfStream)
     {
-      BOOST_LOG_TRIVIAL(debug) << "histo[" << i << "]="
-                               << histo[i] << std::endl;
+      BOOST_LOG_TRIVIAL(error) <<
+        "Unable to open: " << filename << std::endl;
+      return false;
     }
+  const char *raw_bytes =
+    reinterpret_cast<const char *>(serialized_header.c_str());
+  unsigned int raw_size = serialized_header.size();
+
+  bfStream.write(raw_bytes,raw_size);
+  StorageFile::writePadding(bfStream,HeaderLengthInBytes-raw_size);
+
 
   BOOST_LOG_TRIVIAL(debug) << "Bloom Filter Size: " <<
-    mBloomFilter.size() << std::endl;
+    bloom_size << std::endl;
 
-  bfStream.write((char *)mBloomFilter.data(),mBloomFilter.size());
+  if(encoding == BloomFilterHeader::FLAG_ZERO_RUNS)
+    {
+      encodeZeroRuns(m_bits,bloom_size,&bfStream);
+    }
+  else if(encoding == BloomFilterHeader::FLAG_SET_BIT_GAPS)
+    {
+      encodeSetBitGaps(m_bits,bloom_size,all_set_bits,&bfStream);
+    }
+  else
+    {
+      bfStream.write((const char *)m_bits,bloom_size);
+    }
   bfStream.close();
+  return true;
 }
 
 unsigned int
 BloomFilterBase::entryAbove(unsigned int val)
 {
-  std::vector<uint8_t>::iterator it = mBloomFilter.begin();
+  bit_array_type::iterator it = mBloomFilter.begin();
 
   //  bfStream.write(it,mBloomFilter.size());
 
@@ -453,27 +1416,47 @@ BloomFilterBase::entryAbove(unsigned int val)
 void
 BloomFilterBase::WriteCombined(BloomFilterBase &other,std::string output_file)
 {
-  if(!Compare(other) || (m_bitlength != other.m_bitlength) ||
-     (m_num_hashes != other.m_num_hashes))
+  std::vector<BloomFilterBase *> filters;
+
+  filters.push_back(this);
+  filters.push_back(&other);
+  WriteCombined(filters,output_file);
+}
+
+void
+BloomFilterBase::WriteCombined(const std::vector<BloomFilterBase *> &filters,
+                               std::string output_file,
+                               unsigned int num_threads)
+{
+  if(filters.empty())
     {
-      BOOST_LOG_TRIVIAL(error) << "Bloom filters don't match. Aborting..."
+      BOOST_LOG_TRIVIAL(error) << "No Bloom filters to combine. Aborting..."
                                << std::endl;
       exit(-1);
     }
 
-  std::string serialized_header;
-
-  std::ostringstream out;
+  BloomFilterBase &first = *filters[0];
+  unsigned long long int bytes_processed = 0;
 
-  out << "IP_PROTOCOL_NUMBER = " << m_ip_protocol_num << std::endl;
-  out << "TCP_IP_PORT_NUM = " << m_port_num << std::endl;
-  out << "BITLENGTH = " << m_bitlength << std::endl;
-  out << "NUM_HASHES = " << m_num_hashes << std::endl;
-  out << "MIN_NGRAM_SIZE = " << m_min_ngram_size << std::endl;
-  out << "MAX_NGRAM_SIZE = " << m_max_ngram_size << std::endl;
-  out << "NUM_PAYLOAD_BYTES_PROCESSED = " << m_bytes_processed +
-      other.m_bytes_processed<< std::endl;
-  serialized_header = out.str();
+  for(size_t f = 0 ; f < filters.size() ; f++)
+    {
+      BloomFilterBase &other = *filters[f];
+
+      if(!first.Compare(other) || (first.m_bitlength != other.m_bitlength) ||
+         (first.m_num_hashes != other.m_num_hashes) ||
+         (first.m_layout != other.m_layout) ||
+         (first.m_index_mode != other.m_index_mode) ||
+         (first.m_hash_family != other.m_hash_family) ||
+         (first.m_sizing != other.m_sizing) ||
+         (first.m_exact_max_ngram_size != other.m_exact_max_ngram_size))
+        {
+          BOOST_LOG_TRIVIAL(error) << "Bloom filter " << f << " doesn't "
+            "match Bloom filter 0. Aborting..." << std::endl;
+          exit(-1);
+        }
+      bytes_processed += other.m_bytes_processed;
+    }
+  num_threads = std::max(num_threads,1u);
 
   const char *persist_filename = output_file.c_str();
   std::ofstream bfStream(persist_filename,std::ios::out | std::ios::binary);
@@ -485,48 +1468,583 @@ BloomFilterBase::WriteCombined(BloomFilterBase &other,std::string output_file)
       exit(-1);
     }
 
-  const char *raw_bytes =
-    reinterpret_cast<const char *>(serialized_header.c_str());
-  unsigned int raw_size = serialized_header.size();
+  // The header is written once the CRC of the combined bits is known
+  StorageFile::writePadding(bfStream,HeaderLengthInBytes);
 
-  bfStream.write(raw_bytes,raw_size);
-  bfStream.write(Filler,HeaderLengthInBytes-raw_size);
-  //bfStream.close();
-  //exit(-1);
-  m_bf_stream.seekg(HeaderLengthInBytes);
-  other.m_bf_stream.seekg(HeaderLengthInBytes);
+  uint_fast64_t total = first.bitArrayBytes();
+  size_t chunk_bytes = std::min((uint_fast64_t)CombineChunkBytes,total);
+  std::vector<uint8_t> bits(chunk_bytes);
+  // Chunks of the filters whose bits are neither in memory nor mapped
+  std::vector<std::vector<uint8_t> > streamed(filters.size());
+  std::vector<const uint8_t *> sources(filters.size());
+  uint32_t payload_crc = 0;
+  uint_fast64_t bloom_bytes = first.m_bitlength >> 3;
+  uint64_t set_bits = 0;
 
-  for(uint_fast64_t i=0;i<(m_bitlength>>3);i++)
+  for(uint_fast64_t done = 0 ; done < total ; done += chunk_bytes)
     {
-      uint_fast8_t val1,val2,rval;
-      m_bf_stream.read((char *)&val1,sizeof(val1));
-      other.m_bf_stream.read((char *)&val2,sizeof(val2));
-      rval = (val1 | val2);
-      bfStream.write((char *)&rval,sizeof(rval));
+      size_t chunk = std::min((uint_fast64_t)chunk_bytes,total - done);
+
+      for(size_t f = 0 ; f < filters.size() ; f++)
+        {
+          if(filters[f]->m_bits != NULL)
+            {
+              sources[f] = filters[f]->m_bits + done;
+              continue;
+            }
+          streamed[f].resize(chunk_bytes);
+          if(!filters[f]->readBitBytes(done,(char *)streamed[f].data(),
+                                       chunk))
+            {
+              BOOST_LOG_TRIVIAL(error) << "Unable to read Bloom filter " <<
+                f << ". Aborting..." << std::endl;
+              exit(-1);
+            }
+          sources[f] = streamed[f].data();
+        }
+
+      // Each thread combines a slice of the chunk
+      size_t slice = (chunk + num_threads - 1) / num_threads;
+
+      slice = (slice + CombineSliceAlign - 1) / CombineSliceAlign *
+        CombineSliceAlign;
+      if(slice >= chunk)
+        {
+          combineBits(bits.data(),sources,0,chunk);
+        }
+      else
+        {
+          boost::thread_group combiners;
+
+          for(size_t start = 0 ; start < chunk ; start += slice)
+            {
+              size_t length = std::min(slice,chunk - start);
+              uint8_t *dst = bits.data();
+
+              combiners.create_thread([dst,&sources,start,length]()
+                                      {
+                                        combineBits(dst,sources,start,
+                                                    length);
+                                      });
+            }
+          combiners.join_all();
+        }
+      if(done < bloom_bytes)
+        {
+          set_bits += countBits(bits.data(),
+                                std::min((uint_fast64_t)chunk,
+                                         bloom_bytes - done));
+        }
+      payload_crc = BloomFilterHeader::crc32c(bits.data(),chunk,payload_crc);
+      bfStream.write((const char *)bits.data(),chunk);
     }
+
+  std::string serialized_header =
+    first.headerString(bytes_processed,true,payload_crc,0,set_bits);
+
+  bfStream.seekp(0);
+  bfStream.write(serialized_header.c_str(),serialized_header.size());
   bfStream.close();
+  if(!bfStream)
+    {
+      BOOST_LOG_TRIVIAL(error) << "Unable to write: " << persist_filename <<
+        std::endl;
+      exit(-1);
+    }
+}
+
+bool
+BloomFilterBase::readBitBytes(uint64_t offset, char *buffer, size_t length)
+{
+  if(m_bits != NULL)
+    {
+      memcpy(buffer,m_bits + offset,length);
+      return true;
+    }
+  return readFileBytes(offset,buffer,length);
+}
+
+bool
+BloomFilterBase::readFileBytes(uint64_t offset, void *buffer, size_t length)
+{
+  if(!m_concurrent_reads)
+    {
+      m_bf_stream.seekg(HeaderLengthInBytes + offset);
+      m_bf_stream.read((char *)buffer,length);
+      return (bool)m_bf_stream;
+    }
+
+  // pread() leaves the file offset alone, so any number of threads can read
+  // at once
+  char *dst = (char *)buffer;
+  off_t position = HeaderLengthInBytes + offset;
+
+  while(length > 0)
+    {
+      ssize_t num_read = pread(m_read_fd,dst,length,position);
+
+      if(num_read <= 0)
+        {
+          return false;
+        }
+      dst += num_read;
+      position += num_read;
+      length -= num_read;
+    }
+  return true;
+}
+
+void
+BloomFilterBase::setConcurrentReads(bool concurrent)
+{
+  if(concurrent && !m_blm_frm_mem)
+    {
+      // Positional reads bypass the buffer of the stream
+      m_bf_stream.flush();
+    }
+  m_concurrent_reads = concurrent;
+}
+
+void
+BloomFilterBase::dropPayloadCrc()
+{
+  std::string serialized_header = headerString(m_bytes_processed,false);
+
+  m_bf_stream.seekp(0);
+  m_bf_stream.write(serialized_header.c_str(),serialized_header.size());
+  m_stream_payload_crc = false;
+  m_header_set_bits = -1;
+}
+
+uint64_t
+BloomFilterBase::countSetBits()
+{
+  uint64_t bloom_bytes = m_bitlength >> 3;
+
+  if(m_bits != NULL)
+    {
+      return countBits(m_bits,bloom_bytes);
+    }
+
+  std::vector<char> bits(CombineChunkBytes);
+  uint64_t count = 0;
+
+  for(uint64_t done = 0 ; done < bloom_bytes ; done += bits.size())
+    {
+      size_t chunk = std::min((uint64_t)bits.size(),bloom_bytes - done);
+
+      if(!readBitBytes(done,bits.data(),chunk))
+        {
+          BOOST_LOG_TRIVIAL(error) << "Unable to read the Bloom filter" <<
+            std::endl;
+          exit(-1);
+        }
+      count += countBits((const uint8_t *)bits.data(),chunk);
+    }
+  return count;
+}
+
+uint64_t
+BloomFilterBase::setBitCount()
+{
+  if(m_load_mode != LOAD_MEMORY && m_header_set_bits >= 0)
+    {
+      return m_header_set_bits;
+    }
+  return countSetBits();
+}
+
+double
+BloomFilterBase::fillRatio()
+{
+  return fasguard::bloom_filter_statistics(m_bitlength,m_num_hashes,
+                                           setBitCount()).fill_ratio();
+}
+
+double
+BloomFilterBase::estimatedNgrams()
+{
+  return fasguard::bloom_filter_statistics(m_bitlength,m_num_hashes,
+                                           setBitCount()).estimated_items();
+}
+
+double
+BloomFilterBase::estimatedFalsePositiveRate()
+{
+  return fasguard::bloom_filter_statistics(m_bitlength,m_num_hashes,
+                                           setBitCount())
+    .false_positive_rate();
+}
+
+std::string
+BloomFilterBase::statisticsString()
+{
+  return fasguard::bloom_filter_statistics(m_bitlength,m_num_hashes,
+                                           setBitCount()).to_string();
+}
+
+void
+BloomFilterBase::setBitIndeces(const uint64_t *indeces, size_t num_indeces)
+{
+  if(m_load_mode == LOAD_MMAP)
+    {
+      BOOST_LOG_TRIVIAL(error) << "Cannot insert into a memory mapped "
+        "Bloom filter" << std::endl;
+      exit(-1);
+    }
+  if(m_concurrent_reads)
+    {
+      BOOST_LOG_TRIVIAL(error) << "Cannot insert into a Bloom filter in "
+        "concurrent read mode" << std::endl;
+      exit(-1);
+    }
+  if(m_stream_payload_crc)
+    {
+      dropPayloadCrc();
+    }
+  if(m_blm_frm_mem)
+    {
+      for(const uint64_t *it = indeces;
+          it != indeces + num_indeces;
+          it++)
+        {
+          uint64_t bit_index = *it;
+
+          if((bit_index / CHAR_SIZE_BITS) >= mBloomFilter.size())
+            {
+              BOOST_LOG_TRIVIAL(error) << "Bad index " <<
+                bit_index << (bit_index / CHAR_SIZE_BITS) <<
+                " greater than size " << mBloomFilter.size() << std::endl;
+              exit(-1);
+            }
+          m_bits[bit_index / CHAR_SIZE_BITS] |=
+            BIT_MASK[bit_index % CHAR_SIZE_BITS];
+        }
+    }
+  else if(m_layout == LAYOUT_BLOCKED && num_indeces > 0)
+    {
+      // All the bits are in the same block, so read-modify-write the block
+      // once rather than once per bit.
+      const unsigned int block_bytes =
+        CalcBitIndeces::BLOCK_SIZE_BITS / CHAR_SIZE_BITS;
+      uint64_t block_start = (indeces[0] / CalcBitIndeces::BLOCK_SIZE_BITS) *
+        block_bytes;
+      unsigned char block[block_bytes];
+
+      m_bf_stream.seekg(HeaderLengthInBytes + block_start);
+      m_bf_stream.read((char *)block,block_bytes);
+      for(const uint64_t *it = indeces;
+          it != indeces + num_indeces;
+          it++)
+        {
+          block[(*it / CHAR_SIZE_BITS) - block_start] |=
+            BIT_MASK[*it % CHAR_SIZE_BITS];
+        }
+      m_bf_stream.seekp(HeaderLengthInBytes + block_start);
+      m_bf_stream.write((char *)block,block_bytes);
+    }
+  else
+    {
+      for(const uint64_t *it = indeces;
+          it != indeces + num_indeces;
+          it++)
+        {
+          uint64_t bit_index = *it;
+
+          m_bf_stream.seekg(HeaderLengthInBytes+(bit_index / CHAR_SIZE_BITS));
+          unsigned char val;
+          m_bf_stream.read((char *)&val,1);
+          val |= BIT_MASK[bit_index % CHAR_SIZE_BITS];
+          m_bf_stream.seekp(HeaderLengthInBytes+(bit_index / CHAR_SIZE_BITS));
+          m_bf_stream.write((char *)&val,1);
+        }
+    }
+}
+
+bool
+BloomFilterBase::testBitIndeces(const uint64_t *indeces, size_t num_indeces)
+{
+  // Process the Ngram with each hash function and see if it exists in
+  // the Bloom filter. Notice that the Ngram is only declared to be
+  // contained by the Bloom filter if *all* the hash functions report
+  // its existence.
+  if(m_blm_frm_mem)
+    {
+      for(const uint64_t *it = indeces;
+          it != indeces + num_indeces;
+          it++)
+        {
+          uint64_t bit = *it % CHAR_SIZE_BITS;
+
+          // if the given bit index in the Bloom filter hasn't been marked,
+          // we definitely have never seen this Ngram before
+          if((m_bits[*it / CHAR_SIZE_BITS] & BIT_MASK[bit]) !=
+             BIT_MASK[bit])
+            {
+              return false;
+            }
+        }
+    }
+  else if(m_layout == LAYOUT_BLOCKED && num_indeces > 0)
+    {
+      // One read brings in the whole block holding all the bits.
+      const unsigned int block_bytes =
+        CalcBitIndeces::BLOCK_SIZE_BITS / CHAR_SIZE_BITS;
+      uint64_t block_start = (indeces[0] / CalcBitIndeces::BLOCK_SIZE_BITS) *
+        block_bytes;
+      unsigned char block[block_bytes];
+
+      if(!readFileBytes(block_start,block,block_bytes))
+        {
+          BOOST_LOG_TRIVIAL(error) << "Unable to read the Bloom filter" <<
+            std::endl;
+          exit(-1);
+        }
+      for(const uint64_t *it = indeces;
+          it != indeces + num_indeces;
+          it++)
+        {
+          uint64_t bit = *it % CHAR_SIZE_BITS;
+
+          if((block[(*it / CHAR_SIZE_BITS) - block_start] & BIT_MASK[bit]) !=
+             BIT_MASK[bit])
+            {
+              return false;
+            }
+        }
+    }
+  else
+    {
+      for(const uint64_t *it = indeces;
+          it != indeces + num_indeces;
+          it++)
+        {
+          uint64_t bit = *it % CHAR_SIZE_BITS;
+
+          unsigned char val;
+          if(!readFileBytes(*it / CHAR_SIZE_BITS,&val,1))
+            {
+              BOOST_LOG_TRIVIAL(error) << "Unable to read the Bloom filter" <<
+                std::endl;
+              exit(-1);
+            }
+          if((val &  BIT_MASK[bit]) != BIT_MASK[bit])
+            {
+              return false;
+            }
+        }
+    }
+
+  // It appears that the Ngram has been seen before
+  // NOTE: This answer is not 100% reliable. See the class comments for details
+  // on false drop probability
+  return true;
 }
 
 CalcBitIndeces::CalcBitIndeces(size_t num_hash_func,
-                               uint64_t filter_size_in_bits) :
+                               uint64_t filter_size_in_bits,
+                               BloomLayout layout,
+                               BloomIndexMode index_mode,
+                               BloomHashFamily hash_family,
+                               BloomSizing sizing,
+                               int exact_min_ngram_size,
+                               int exact_max_ngram_size) :
   m_num_hash_func(num_hash_func), m_filter_size_in_bits(filter_size_in_bits),
+  m_layout(layout), m_index_mode(index_mode), m_hash_family(hash_family),
+  m_sizing(sizing),
+  m_exact_min_ngram_size((exact_min_ngram_size < 1) ? 1 :
+                         exact_min_ngram_size),
+  m_exact_max_ngram_size(exact_max_ngram_size),
   m_bit_index_vec(num_hash_func)
-{}
+{
+  uint64_t offset = m_filter_size_in_bits;
+
+  for(int i = 0 ; i <= MAX_EXACT_NGRAM_SIZE ; i++)
+    {
+      m_exact_offset[i] = offset;
+      if(isExact(i))
+        {
+          offset += 1ULL << (8 * i);
+        }
+    }
+}
+
+uint64_t
+CalcBitIndeces::exactBits(int exact_min_ngram_size, int exact_max_ngram_size)
+{
+  uint64_t bits = 0;
+
+  for(int i = (exact_min_ngram_size < 1) ? 1 : exact_min_ngram_size ;
+      i <= exact_max_ngram_size ; i++)
+    {
+      bits += 1ULL << (8 * i);
+    }
+  // Whole blocks, so a block read from a stream filter stays in the file
+  if(bits % BLOCK_SIZE_BITS != 0)
+    {
+      bits += BLOCK_SIZE_BITS - (bits % BLOCK_SIZE_BITS);
+    }
+  return bits;
+}
 
 const std::vector<uint64_t> &
 CalcBitIndeces::operator()(const std::string &ngram)
 {
+  calcIndeces(ngram.data(),ngram.size(),m_bit_index_vec.data());
+  return m_bit_index_vec;
+}
+
+void
+CalcBitIndeces::indecesFromHashPair(const uint64_t hash_pair[2],
+                                    uint64_t *bit_indeces) const
+{
+  // Enhanced double hashing: g_i = h1 + i*h2 + (i^3 - i)/6, computed
+  // incrementally.
+  if(m_layout == LAYOUT_BLOCKED)
+    {
+      // The first half picks the block, the second half the bits
+      // within the block. The halves of MurmurHash3_x86_128 share a final
+      // additive mix, so the second half is avalanched again to keep the
+      // bits within a block independent of the choice of block.
+      uint64_t num_blocks = m_filter_size_in_bits / BLOCK_SIZE_BITS;
+      uint64_t block_base = reduce(hash_pair[0],num_blocks) * BLOCK_SIZE_BITS;
+      uint64_t in_block = fmix64(hash_pair[1]);
+      uint32_t x = (uint32_t)in_block;
+      uint32_t y = (uint32_t)(in_block >> 32);
+
+      for(size_t i = 0 ; i < m_num_hash_func ; i++)
+        {
+          bit_indeces[i] = block_base + (x % BLOCK_SIZE_BITS);
+          x += y;
+          y += i + 1;
+        }
+      return;
+    }
+
+  uint64_t x = hash_pair[0];
+  uint64_t y = hash_pair[1];
+
+  for(size_t i = 0 ; i < m_num_hash_func ; i++)
+    {
+      bit_indeces[i] = reduce(x,m_filter_size_in_bits);
+      x += y;
+      y += i + 1;
+    }
+}
+
+void
+CalcBitIndeces::calcIndeces(const void *data, size_t length,
+                            uint64_t *bit_indeces) const
+{
+  if(isExact(length))
+    {
+      // Every index is the one bit of the ngram in its exact bitmap
+      std::fill(bit_indeces,bit_indeces + m_num_hash_func,
+                exactIndex(data,length));
+      return;
+    }
+
+  if(m_index_mode == INDEX_DOUBLE_HASH)
+    {
+      // One 128-bit hash provides everything.
+      uint64_t hash_pair[2];
+      if(m_hash_family == HASH_INCREMENTAL)
+        {
+          IncrementalNgramHash::hash(data,length,hash_pair);
+        }
+      else
+        {
+          MurmurHash3_x86_128(data,length,hash_seeds[0],hash_pair);
+        }
+      indecesFromHashPair(hash_pair,bit_indeces);
+      return;
+    }
+
+  if(m_layout == LAYOUT_BLOCKED)
+    {
+      // The first hash picks the block, then every hash function picks a bit
+      // within that block.
+      uint64_t num_blocks = m_filter_size_in_bits / BLOCK_SIZE_BITS;
+      uint64_t block_base = 0;
+
+      for(size_t i = 0 ; i < m_num_hash_func ; i++)
+        {
+          uint64_t hash_pair[2];
+          MurmurHash3_x86_128(data,length,hash_seeds[i],hash_pair);
+          if(i == 0)
+            {
+              block_base = reduce(hash_pair[0],num_blocks) * BLOCK_SIZE_BITS;
+            }
+          bit_indeces[i] = block_base + (hash_pair[1] % BLOCK_SIZE_BITS);
+        }
+      return;
+    }
 
   for(size_t i = 0 ; i < m_num_hash_func ; i++)
     {
       // bit index into the Bloom filter where this Ngram would have been marked
       // by the i'th hash function
       uint64_t hash_pair[2];
-      MurmurHash3_x86_128(ngram.data(),ngram.size(),hash_seeds[i],hash_pair);
+      MurmurHash3_x86_128(data,length,hash_seeds[i],hash_pair);
       uint64_t bit_index
-        = hash_pair[1] % m_filter_size_in_bits;
+        = reduce(hash_pair[1],m_filter_size_in_bits);
 
-      m_bit_index_vec[i] = bit_index;
+      bit_indeces[i] = bit_index;
+    }
+}
+
+void
+CalcBitIndeces::calcIndecesX8(const void * const data[8], size_t length,
+                              uint64_t *bit_indeces) const
+{
+  if(m_hash_family == HASH_INCREMENTAL || isExact(length))
+    {
+      for(size_t lane = 0 ; lane < 8 ; lane++)
+        {
+          calcIndeces(data[lane],length,bit_indeces + lane * m_num_hash_func);
+        }
+      return;
+    }
+
+  uint64_t hash_pairs[8][2];
+
+  if(m_index_mode == INDEX_DOUBLE_HASH)
+    {
+      MurmurHash3_x86_128_x8(data,length,hash_seeds[0],hash_pairs);
+      for(size_t lane = 0 ; lane < 8 ; lane++)
+        {
+          indecesFromHashPair(hash_pairs[lane],
+                              bit_indeces + lane * m_num_hash_func);
+        }
+      return;
+    }
+
+  // Same indeces as calcIndeces(), one seed at a time for all eight ngrams
+  uint64_t num_blocks = m_filter_size_in_bits / BLOCK_SIZE_BITS;
+  uint64_t block_base[8];
+
+  for(size_t i = 0 ; i < m_num_hash_func ; i++)
+    {
+      MurmurHash3_x86_128_x8(data,length,hash_seeds[i],hash_pairs);
+      for(size_t lane = 0 ; lane < 8 ; lane++)
+        {
+          uint64_t *lane_indeces = bit_indeces + lane * m_num_hash_func;
+
+          if(m_layout == LAYOUT_BLOCKED)
+            {
+              if(i == 0)
+                {
+                  block_base[lane] =
+                    reduce(hash_pairs[lane][0],num_blocks) * BLOCK_SIZE_BITS;
+                }
+              lane_indeces[i] =
+                block_base[lane] + (hash_pairs[lane][1] % BLOCK_SIZE_BITS);
+            }
+          else
+            {
+              lane_indeces[i] =
+                reduce(hash_pairs[lane][1],m_filter_size_in_bits);
+            }
+        }
     }
-  return m_bit_index_vec;
 }
@@ -0,0 +1,379 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <boost/log/trivial.hpp>
+#include <fasguardfilter/BinaryFuseNgramStorage.hh>
+#include <fasguardfilter/BloomFilterGenerations.hh>
+#include <fasguardfilter/BloomFilterPartitioned.hh>
+#include <fasguardfilter/BloomFilterScalable.hh>
+#include <fasguardfilter/BloomFilterUnthreaded.hh>
+#include <fasguardfilter/CuckooNgramStorage.hh>
+#include "StorageFile.hh"
+
+const std::string BloomFilterGenerations::ManifestFirstLine =
+  "BLOOM_GENERATIONS";
+
+/**
+ * Directory part of a file name, including the trailing '/', or the empty
+ * string for a file in the current directory.
+ */
+static std::string
+dirName(const std::string &filename)
+{
+  std::string::size_type slash = filename.rfind('/');
+
+  return (slash == std::string::npos) ? std::string() :
+    filename.substr(0,slash + 1);
+}
+
+BloomFilterGenerations::BloomFilterGenerations(unsigned int max_generations,
+                                               int ip_protocol_num,
+                                               int port_num,
+                                               int min_ngram_size,
+                                               int max_ngram_size) :
+  BenignNgramStorage(ip_protocol_num,port_num,min_ngram_size,max_ngram_size),
+  m_max_generations(max_generations),
+  m_next_sequence(0)
+{
+  m_bytes_processed = 0;
+  if(m_max_generations < 1)
+    {
+      m_max_generations = 1;
+    }
+}
+
+BloomFilterGenerations::BloomFilterGenerations(const std::string &filename,
+                                               BloomLoadMode load_mode,
+                                               unsigned int mmap_hints) :
+  m_max_generations(1),
+  m_next_sequence(0)
+{
+  m_insertions = 0;
+  m_unique_insertions = 0;
+  m_bytes_processed = 0;
+
+  std::ifstream manifest(filename.c_str());
+
+  if(!manifest)
+    {
+      BOOST_LOG_TRIVIAL(error) << "Unable to open: " <<
+        filename << std::endl;
+      exit(-1);
+    }
+
+  std::string line;
+
+  if(!std::getline(manifest,line) || line != ManifestFirstLine)
+    {
+      BOOST_LOG_TRIVIAL(error) << "Not a Bloom filter generations manifest: "
+                               << filename << std::endl;
+      exit(-1);
+    }
+
+  std::map<std::string,std::string> properties;
+  std::vector<std::string> files;
+  std::string key;
+  std::string value;
+
+  // GENERATION repeats, so the lines are parsed one at a time
+  while(std::getline(manifest,line))
+    {
+      if(!StorageFile::parsePropertyLine(line,key,value))
+        {
+          continue;
+        }
+      if(key == "MAX_GENERATIONS")
+        {
+          std::istringstream(value) >> m_max_generations;
+        }
+      else if(key == "NEXT_SEQUENCE")
+        {
+          std::istringstream(value) >> m_next_sequence;
+        }
+      else if(key == "GENERATION")
+        {
+          files.push_back(value);
+        }
+      else
+        {
+          properties[key] = value;
+        }
+    }
+  loadParams(properties); // Load params for BenignNgramStorage
+
+  std::string dir = dirName(filename);
+
+  for(size_t i = 0 ; i < files.size() ; i++)
+    {
+      Generation generation;
+
+      generation.file = (files[i][0] == '/') ? files[i] : dir + files[i];
+      generation.dirty = false;
+
+      // The newest generation takes insertions, so it has to be writable
+      BloomLoadMode mode = (i + 1 == files.size()) ? LOAD_MEMORY : load_mode;
+
+      BOOST_LOG_TRIVIAL(debug) << "Loading generation " <<
+        generation.file << std::endl;
+      if(BinaryFuseNgramStorage::isBinaryFuseFile(generation.file))
+        {
+          generation.filter.reset(new BinaryFuseNgramStorage(generation.file,
+                                                             mode,
+                                                             mmap_hints));
+        }
+      else if(BloomFilterPartitioned::isPartitionedFile(generation.file))
+        {
+          generation.filter.reset(new BloomFilterPartitioned(generation.file,
+                                                             mode,
+                                                             mmap_hints));
+        }
+      else if(BloomFilterScalable::isScalableFile(generation.file))
+        {
+          generation.filter.reset(new BloomFilterScalable(generation.file,
+                                                          mode,mmap_hints));
+        }
+      else if(CuckooNgramStorage::isCuckooFile(generation.file))
+        {
+          generation.filter.reset(new CuckooNgramStorage(generation.file,mode,
+                                                         mmap_hints));
+        }
+      else
+        {
+          generation.filter.reset(new BloomFilterUnthreaded(generation.file,
+                                                            mode,
+                                                            mmap_hints));
+        }
+      if(!Compare(*generation.filter))
+        {
+          BOOST_LOG_TRIVIAL(error) << "Generation " << generation.file <<
+            " doesn't match " << filename << ". Aborting..." << std::endl;
+          exit(-1);
+        }
+      m_generations.push_back(generation);
+    }
+  dropExcess();
+}
+
+BloomFilterGenerations::~BloomFilterGenerations()
+{}
+
+void
+BloomFilterGenerations::insert(uint8_t const * data, size_t length)
+{
+  insertSpan(NgramSpan(data,length));
+}
+
+bool
+BloomFilterGenerations::contains(uint8_t const * data, size_t length)
+{
+  return containsSpan(NgramSpan(data,length));
+}
+
+void
+BloomFilterGenerations::insertSpan(const NgramSpan &ngram)
+{
+  if(m_generations.empty())
+    {
+      BOOST_LOG_TRIVIAL(error) << "Cannot insert into a Bloom filter "
+        "generations store without generations" << std::endl;
+      exit(-1);
+    }
+  m_generations.back().filter->insertSpan(ngram);
+  m_generations.back().dirty = true;
+}
+
+bool
+BloomFilterGenerations::containsSpan(const NgramSpan &ngram)
+{
+  // Newest first, since recent traffic is the most likely match
+  for(std::deque<Generation>::reverse_iterator it = m_generations.rbegin();
+      it != m_generations.rend();
+      it++)
+    {
+      if(it->filter->containsSpan(ngram))
+        {
+          return true;
+        }
+    }
+  return false;
+}
+
+void
+BloomFilterGenerations::containsBatch(const std::vector<NgramSpan> &ngrams,
+                                      std::vector<bool> &results)
+{
+  results.assign(ngrams.size(),false);
+
+  // Positions in ngrams of the ngrams not found so far
+  std::vector<size_t> pending(ngrams.size());
+  std::vector<NgramSpan> pending_ngrams(ngrams);
+  std::vector<bool> pending_results;
+
+  for(size_t i = 0 ; i < pending.size() ; i++)
+    {
+      pending[i] = i;
+    }
+
+  for(std::deque<Generation>::reverse_iterator it = m_generations.rbegin();
+      it != m_generations.rend() && !pending.empty();
+      it++)
+    {
+      it->filter->containsBatch(pending_ngrams,pending_results);
+
+      size_t kept = 0;
+
+      for(size_t i = 0 ; i < pending.size() ; i++)
+        {
+          if(pending_results[i])
+            {
+              results[pending[i]] = true;
+            }
+          else
+            {
+              pending[kept] = pending[i];
+              pending_ngrams[kept] = pending_ngrams[i];
+              kept++;
+            }
+        }
+      pending.resize(kept);
+      pending_ngrams.resize(kept);
+    }
+}
+
+bool
+BloomFilterGenerations::flush(std::string filename)
+{
+  std::string dir = dirName(filename);
+  std::string base = filename.substr(dir.size());
+
+  for(std::deque<Generation>::iterator it = m_generations.begin();
+      it != m_generations.end();
+      it++)
+    {
+      if(!it->dirty && !it->file.empty())
+        {
+          continue;
+        }
+
+      // A changed generation goes to a new file rather than overwriting the
+      // old one, which readers of the old manifest may still have open.
+      if(!it->file.empty())
+        {
+          m_dropped_files.push_back(it->file);
+        }
+      std::ostringstream name;
+
+      name << filename << "." << m_next_sequence++;
+      if(!it->filter->flush(name.str()))
+        {
+          return false;
+        }
+      it->file = name.str();
+      it->dirty = false;
+    }
+
+  std::string tmp_filename = filename + ".tmp";
+  std::ofstream manifest(tmp_filename.c_str(),std::ios::out);
+
+  if(!manifest)
+    {
+      BOOST_LOG_TRIVIAL(error) <<
+        "Unable to open: " << tmp_filename << std::endl;
+      return false;
+    }
+
+  manifest << ManifestFirstLine << std::endl;
+  manifest << "IP_PROTOCOL_NUMBER = " << m_ip_protocol_num << std::endl;
+  manifest << "TCP_IP_PORT_NUM = " << m_port_num << std::endl;
+  manifest << "MIN_NGRAM_SIZE = " << m_min_ngram_size << std::endl;
+  manifest << "MAX_NGRAM_SIZE = " << m_max_ngram_size << std::endl;
+  manifest << "MAX_GENERATIONS = " << m_max_generations << std::endl;
+  manifest << "NEXT_SEQUENCE = " << m_next_sequence << std::endl;
+  for(std::deque<Generation>::const_iterator it = m_generations.begin();
+      it != m_generations.end();
+      it++)
+    {
+      // Files next to the manifest are recorded without the directory, so
+      // the store can be moved as a whole
+      if(it->file.compare(0,dir.size(),dir) == 0 &&
+         it->file.find('/',dir.size()) == std::string::npos)
+        {
+          manifest << "GENERATION = " << it->file.substr(dir.size()) <<
+            std::endl;
+        }
+      else
+        {
+          manifest << "GENERATION = " << it->file << std::endl;
+        }
+    }
+  manifest.close();
+
+  if(!manifest || std::rename(tmp_filename.c_str(),filename.c_str()) != 0)
+    {
+      BOOST_LOG_TRIVIAL(error) <<
+        "Unable to write: " << filename << std::endl;
+      return false;
+    }
+
+  for(size_t i = 0 ; i < m_dropped_files.size() ; i++)
+    {
+      BOOST_LOG_TRIVIAL(debug) << "Removing generation " <<
+        m_dropped_files[i] << std::endl;
+      std::remove(m_dropped_files[i].c_str());
+    }
+  m_dropped_files.clear();
+  return true;
+}
+
+void
+BloomFilterGenerations::addGeneration(boost::shared_ptr<BenignNgramStorage>
+                                      generation)
+{
+  if(!Compare(*generation))
+    {
+      BOOST_LOG_TRIVIAL(error) << "Filter doesn't match the generations. "
+        "Aborting..." << std::endl;
+      exit(-1);
+    }
+
+  Generation gen;
+
+  gen.filter = generation;
+  gen.dirty = true;
+  m_generations.push_back(gen);
+  dropExcess();
+}
+
+void
+BloomFilterGenerations::setMaxGenerations(unsigned int max_generations)
+{
+  m_max_generations = (max_generations < 1) ? 1 : max_generations;
+  dropExcess();
+}
+
+void
+BloomFilterGenerations::dropExcess()
+{
+  while(m_generations.size() > m_max_generations)
+    {
+      if(!m_generations.front().file.empty())
+        {
+          m_dropped_files.push_back(m_generations.front().file);
+        }
+      m_generations.pop_front();
+    }
+}
+
+bool
+BloomFilterGenerations::isManifest(const std::string &filename)
+{
+  std::ifstream file(filename.c_str());
+  std::string line;
+
+  return file && std::getline(file,line) && line == ManifestFirstLine;
+}
@@ -0,0 +1,328 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+// Make sure to get enough out of inttypes.h
+#define __STDC_FORMAT_MACROS
+
+#include <cstdio>
+#include <cstring>
+#include <fasguardfilter/BloomFilterBase.hh>
+#include "BloomFilterHeader.hh"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define CRC32C_SSE42 1
+#include <nmmintrin.h>
+#endif
+
+const uint64_t BloomFilterHeader::MAGIC;
+const uint8_t BloomFilterHeader::FLAG_PAYLOAD_CRC;
+const uint8_t BloomFilterHeader::FLAG_ZERO_RUNS;
+const uint8_t BloomFilterHeader::FLAG_SET_BIT_GAPS;
+const uint8_t BloomFilterHeader::FLAG_SET_BITS;
+
+/**
+ * Reversed CRC-32C (Castagnoli) polynomial.
+ */
+static const uint32_t Crc32cPolynomial = 0x82f63b78;
+
+namespace
+{
+/**
+ * Tables for computing CRC-32C eight bytes at a time (slicing-by-8).
+ */
+class Crc32cTables
+{
+public:
+  Crc32cTables()
+  {
+    for(uint32_t i = 0 ; i < 256 ; i++)
+      {
+        uint32_t crc = i;
+
+        for(int bit = 0 ; bit < 8 ; bit++)
+          {
+            crc = (crc >> 1) ^ ((crc & 1) ? Crc32cPolynomial : 0);
+          }
+        table[0][i] = crc;
+      }
+    for(uint32_t i = 0 ; i < 256 ; i++)
+      {
+        for(int t = 1 ; t < 8 ; t++)
+          {
+            table[t][i] = (table[t - 1][i] >> 8) ^
+              table[0][table[t - 1][i] & 0xff];
+          }
+      }
+  }
+
+  uint32_t table[8][256];
+};
+}
+
+static uint32_t
+crc32cScalar(const uint8_t *data, size_t length, uint32_t crc)
+{
+  static const Crc32cTables tables;
+  const uint32_t (*table)[256] = tables.table;
+
+  while(length >= 8)
+    {
+      uint32_t low = crc ^ ((uint32_t)data[0] | ((uint32_t)data[1] << 8) |
+                            ((uint32_t)data[2] << 16) |
+                            ((uint32_t)data[3] << 24));
+
+      crc = table[7][low & 0xff] ^ table[6][(low >> 8) & 0xff] ^
+        table[5][(low >> 16) & 0xff] ^ table[4][low >> 24] ^
+        table[3][data[4]] ^ table[2][data[5]] ^
+        table[1][data[6]] ^ table[0][data[7]];
+      data += 8;
+      length -= 8;
+    }
+  while(length > 0)
+    {
+      crc = (crc >> 8) ^ table[0][(crc ^ *data) & 0xff];
+      data++;
+      length--;
+    }
+  return crc;
+}
+
+#ifdef CRC32C_SSE42
+__attribute__((target("sse4.2"))) static uint32_t
+crc32cSse42(const uint8_t *data, size_t length, uint32_t crc)
+{
+#ifdef __x86_64__
+  uint64_t crc64 = crc;
+
+  while(length >= 8)
+    {
+      uint64_t word;
+
+      memcpy(&word,data,8);
+      crc64 = _mm_crc32_u64(crc64,word);
+      data += 8;
+      length -= 8;
+    }
+  crc = (uint32_t)crc64;
+#endif
+  while(length > 0)
+    {
+      crc = _mm_crc32_u8(crc,*data);
+      data++;
+      length--;
+    }
+  return crc;
+}
+#endif
+
+uint32_t
+BloomFilterHeader::crc32c(void const * data, size_t length, uint32_t crc)
+{
+  crc = ~crc;
+#ifdef CRC32C_SSE42
+  static const bool have_sse42 = __builtin_cpu_supports("sse4.2");
+
+  if(have_sse42)
+    {
+      return ~crc32cSse42((const uint8_t *)data,length,crc);
+    }
+#endif
+  return ~crc32cScalar((const uint8_t *)data,length,crc);
+}
+
+BloomFilterHeader::BloomFilterHeader() :
+  flags(0),
+  ip_protocol_num(0),
+  port_num(0),
+  min_ngram_size(0),
+  max_ngram_size(0),
+  exact_max_ngram_size(0),
+  layout(LAYOUT_STANDARD),
+  index_mode(INDEX_PER_SEED),
+  hash_family(HASH_MURMUR3),
+  sizing(SIZING_POWER_OF_2),
+  num_hashes(0),
+  bitlength(0),
+  bytes_processed(0),
+  payload_length(0),
+  payload_crc(0),
+  set_bits(0)
+{}
+
+bool
+BloomFilterHeader::isBinaryHeader(void const * buffer, size_t length)
+{
+  uint8_t const * bytes = (uint8_t const *)buffer;
+  uint64_t magic = 0;
+
+  if(length < sizeof(magic))
+    {
+      return false;
+    }
+  for(size_t i = 0 ; i < sizeof(magic) ; i++)
+    {
+      magic = (magic << 8) | bytes[i];
+    }
+  return magic == MAGIC;
+}
+
+bool
+BloomFilterHeader::serialize(void * buffer, size_t & offset,
+                             size_t length) const
+{
+  static char const hdr[] = "BloomFilterHeader";
+  static uint8_t const ver = SERIALIZE_LATEST;
+
+  size_t start = offset;
+
+  if(!(serialize_datum<uint64_t>(hdr,ver,"magic",
+                                 buffer,offset,length,MAGIC) &&
+       serialize_datum(hdr,ver,"version",buffer,offset,length,ver) &&
+       serialize_datum(hdr,ver,"flags",buffer,offset,length,flags) &&
+       serialize_datum(hdr,ver,"ip_protocol_num",buffer,offset,length,
+                       ip_protocol_num) &&
+       serialize_datum(hdr,ver,"port_num",buffer,offset,length,port_num) &&
+       serialize_datum(hdr,ver,"min_ngram_size",buffer,offset,length,
+                       min_ngram_size) &&
+       serialize_datum(hdr,ver,"max_ngram_size",buffer,offset,length,
+                       max_ngram_size) &&
+       serialize_datum(hdr,ver,"exact_max_ngram_size",buffer,offset,length,
+                       exact_max_ngram_size) &&
+       serialize_datum(hdr,ver,"layout",buffer,offset,length,layout) &&
+       serialize_datum(hdr,ver,"index_mode",buffer,offset,length,
+                       index_mode) &&
+       serialize_datum(hdr,ver,"hash_family",buffer,offset,length,
+                       hash_family) &&
+       serialize_datum(hdr,ver,"sizing",buffer,offset,length,sizing) &&
+       serialize_datum(hdr,ver,"num_hashes",buffer,offset,length,
+                       num_hashes) &&
+       serialize_datum(hdr,ver,"bitlength",buffer,offset,length,bitlength) &&
+       serialize_datum(hdr,ver,"bytes_processed",buffer,offset,length,
+                       bytes_processed) &&
+       serialize_datum(hdr,ver,"payload_length",buffer,offset,length,
+                       payload_length) &&
+       serialize_datum(hdr,ver,"payload_crc",buffer,offset,length,
+                       payload_crc) &&
+       serialize_datum(hdr,ver,"set_bits",buffer,offset,length,set_bits)))
+    {
+      return false;
+    }
+
+  uint32_t header_crc =
+    crc32c((uint8_t const *)buffer + start,offset - start);
+
+  return serialize_datum(hdr,ver,"header_crc",buffer,offset,length,
+                         header_crc);
+}
+
+bool
+BloomFilterHeader::unserialize(void const * buffer, size_t & offset,
+                               size_t length)
+{
+  static char const hdr[] = "BloomFilterHeader";
+
+  size_t start = offset;
+  uint64_t magic;
+
+  if(!unserialize_datum(hdr,SERIALIZE_LATEST,"magic",buffer,offset,length,
+                        magic))
+    {
+      return false;
+    }
+  if(magic != MAGIC)
+    {
+      snprintf(serialize_error_string,sizeof(serialize_error_string),
+               "not a binary Bloom filter header at offset %zu",start);
+      return false;
+    }
+
+  // version
+  uint8_t ver;
+  if(!unserialize_datum(hdr,SERIALIZE_LATEST,"version",buffer,offset,length,
+                        ver))
+    {
+      return false;
+    }
+
+  if(ver != SERIALIZE_V0 && ver != SERIALIZE_V1)
+    {
+      error_version(offset,length,hdr,ver);
+      return false;
+    }
+
+  uint32_t header_crc;
+
+  if(!(unserialize_datum(hdr,ver,"flags",buffer,offset,length,flags) &&
+       unserialize_datum(hdr,ver,"ip_protocol_num",buffer,offset,length,
+                         ip_protocol_num) &&
+       unserialize_datum(hdr,ver,"port_num",buffer,offset,length,
+                         port_num) &&
+       unserialize_datum(hdr,ver,"min_ngram_size",buffer,offset,length,
+                         min_ngram_size) &&
+       unserialize_datum(hdr,ver,"max_ngram_size",buffer,offset,length,
+                         max_ngram_size) &&
+       unserialize_datum(hdr,ver,"exact_max_ngram_size",buffer,offset,
+                         length,exact_max_ngram_size) &&
+       unserialize_datum(hdr,ver,"layout",buffer,offset,length,layout) &&
+       unserialize_datum(hdr,ver,"index_mode",buffer,offset,length,
+                         index_mode) &&
+       unserialize_datum(hdr,ver,"hash_family",buffer,offset,length,
+                         hash_family) &&
+       unserialize_datum(hdr,ver,"sizing",buffer,offset,length,sizing) &&
+       unserialize_datum(hdr,ver,"num_hashes",buffer,offset,length,
+                         num_hashes) &&
+       unserialize_datum(hdr,ver,"bitlength",buffer,offset,length,
+                         bitlength) &&
+       unserialize_datum(hdr,ver,"bytes_processed",buffer,offset,length,
+                         bytes_processed) &&
+       unserialize_datum(hdr,ver,"payload_length",buffer,offset,length,
+                         payload_length) &&
+       unserialize_datum(hdr,ver,"payload_crc",buffer,offset,length,
+                         payload_crc)))
+    {
+      return false;
+    }
+  set_bits = 0;
+  if(ver >= SERIALIZE_V1 &&
+     !unserialize_datum(hdr,ver,"set_bits",buffer,offset,length,set_bits))
+    {
+      return false;
+    }
+
+  uint32_t computed_crc =
+    crc32c((uint8_t const *)buffer + start,offset - start);
+
+  if(!unserialize_datum(hdr,ver,"header_crc",buffer,offset,length,
+                        header_crc))
+    {
+      return false;
+    }
+  if(header_crc != computed_crc)
+    {
+      snprintf(serialize_error_string,sizeof(serialize_error_string),
+               "header CRC mismatch: stored %08" PRIx32 ", computed %08"
+               PRIx32,header_crc,computed_crc);
+      return false;
+    }
+
+  if(layout > LAYOUT_BLOCKED || index_mode > INDEX_DOUBLE_HASH ||
+     hash_family > HASH_INCREMENTAL || sizing > SIZING_EXACT ||
+     num_hashes < 1 || num_hashes > BloomFilterBase::MAX_HASHES ||
+     bitlength == 0 || bitlength % 8 != 0 ||
+     (layout == LAYOUT_BLOCKED &&
+      bitlength % CalcBitIndeces::BLOCK_SIZE_BITS != 0) ||
+     min_ngram_size < 1 || max_ngram_size < min_ngram_size ||
+     (flags & ~(FLAG_PAYLOAD_CRC | FLAG_ZERO_RUNS | FLAG_SET_BIT_GAPS |
+                FLAG_SET_BITS)) != 0 ||
+     (ver < SERIALIZE_V1 && (flags & FLAG_SET_BITS)) ||
+     ((flags & FLAG_SET_BITS) && set_bits > bitlength) ||
+     ((flags & FLAG_ZERO_RUNS) && (flags & FLAG_SET_BIT_GAPS)))
+    {
+      snprintf(serialize_error_string,sizeof(serialize_error_string),
+               "bad field value in header %s version %u",hdr,
+               (unsigned int)ver);
+      return false;
+    }
+  return true;
+}
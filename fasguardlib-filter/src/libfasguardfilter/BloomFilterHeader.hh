@@ -0,0 +1,112 @@
+#ifndef BLOOM_FILTER_HEADER_HH
+#define BLOOM_FILTER_HEADER_HH
+
+#include <inttypes.h>
+#include <cstddef>
+#include "fasguardfilter.hpp"
+
+/**
+ * @brief Binary header at the start of a .bloom file.
+ *
+ * The header starts with MAGIC, whose first byte is not ASCII, so it can
+ * not be mistaken for the KEY = VALUE text header of older files, and ends
+ * with a CRC-32C of the header bytes before it. It also records the length
+ * of the filter data that follows the BloomFilterBase::HeaderLengthInBytes
+ * header region and, when FLAG_PAYLOAD_CRC is set, a CRC-32C of that data.
+ * Both describe the data as loaded: with FLAG_ZERO_RUNS or
+ * FLAG_SET_BIT_GAPS the file holds it compressed, and is shorter. Since
+ * version 1, when FLAG_SET_BITS is set, the header also records how many
+ * bits of the Bloom filter proper are set, from which its fill ratio and
+ * false positive rate are estimated without reading the data. Integers
+ * are stored in network byte order.
+ */
+class BloomFilterHeader : public fasguard::serializable_filter_header
+{
+public:
+  BloomFilterHeader();
+
+  /**
+   * Serialize the header. On failure, serialize_error_string contains an
+   * error message.
+   * @param buffer Where to serialize the header to.
+   * @param offset On input, offset in buffer of where to start. On output,
+   *    offset of the end of the header.
+   * @param length Length of buffer.
+   */
+  bool serialize(void * buffer, size_t & offset, size_t length) const;
+
+  /**
+   * Unserialize and check a header: the magic number, the version, the
+   * header CRC and the range of every field. The filter data is not
+   * checked. On failure, serialize_error_string contains an error message.
+   */
+  virtual bool unserialize(void const * buffer, size_t & offset,
+                           size_t length);
+
+  /**
+   * Check whether a buffer starts with a binary header.
+   */
+  static bool isBinaryHeader(void const * buffer, size_t length);
+
+  /**
+   * CRC-32C (Castagnoli) of a buffer.
+   * @param data The buffer.
+   * @param length Number of bytes in data.
+   * @param crc The CRC of the preceding data, to continue a CRC over
+   *    several buffers, or 0.
+   */
+  static uint32_t crc32c(void const * data, size_t length, uint32_t crc = 0);
+
+  static const uint64_t MAGIC = 0x8946474242464c54ULL; // "\x89FGBBFLT"
+  /**
+   * payload_crc holds the CRC of the filter data.
+   */
+  static const uint8_t FLAG_PAYLOAD_CRC = 0x01;
+  /**
+   * The filter data is stored as runs of zero and literal 64-bit words.
+   */
+  static const uint8_t FLAG_ZERO_RUNS = 0x02;
+  /**
+   * The filter data is stored as the gaps between its set bits.
+   */
+  static const uint8_t FLAG_SET_BIT_GAPS = 0x04;
+  /**
+   * set_bits holds the number of set bits of the Bloom filter, not
+   * counting the exact bitmaps.
+   */
+  static const uint8_t FLAG_SET_BITS = 0x08;
+
+  uint8_t flags;
+  int32_t ip_protocol_num;
+  int32_t port_num;
+  uint16_t min_ngram_size;
+  uint16_t max_ngram_size;
+  uint8_t exact_max_ngram_size;
+  uint8_t layout;
+  uint8_t index_mode;
+  uint8_t hash_family;
+  uint8_t sizing;
+  uint32_t num_hashes;
+  uint64_t bitlength;
+  uint64_t bytes_processed;
+  uint64_t payload_length;
+  uint32_t payload_crc;
+  uint64_t set_bits;
+
+private:
+  /**
+     @brief Type to store the serialize version.
+  */
+  enum serialize_version_type
+    {
+      SERIALIZE_V0 = 0,
+      SERIALIZE_V1 = 1, // Adds set_bits
+      SERIALIZE_LATEST = SERIALIZE_V1,
+      SERIALIZE_RESERVED = 255,
+    };
+
+  BloomFilterHeader(BloomFilterHeader const & other);
+
+  BloomFilterHeader & operator=(BloomFilterHeader const & other);
+};
+#endif
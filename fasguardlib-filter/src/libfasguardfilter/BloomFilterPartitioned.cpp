@@ -0,0 +1,663 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <boost/log/trivial.hpp>
+#include <sys/mman.h>
+#include <fasguardfilter/BloomFilterPartitioned.hh>
+#include <fasguardfilter/MurmurHash3.h>
+#include "StorageFile.hh"
+
+const std::string BloomFilterPartitioned::FileFirstLine =
+  "PARTITIONED_BLOOM_FILTER";
+
+/**
+ * Seed for the ngram hash.
+ */
+static const uint32_t NgramKeySeed = 0x51b7449e;
+
+/**
+ * Bytes in a cache line. Every partition starts on one.
+ */
+static const size_t PartitionAlignment = 64;
+
+static std::string
+partitionKey(size_t length, const char *name)
+{
+  std::ostringstream key;
+
+  key << "PARTITION_" << length << "_" << name;
+  return key.str();
+}
+
+BloomFilterPartitioned::BloomFilterPartitioned(
+                                   double probability_false_positive,
+                                   int ip_protocol_num, int port_num,
+                                   int min_ngram_size, int max_ngram_size) :
+  BenignNgramStorage(ip_protocol_num,port_num,min_ngram_size,max_ngram_size),
+  m_probability_false_positive(probability_false_positive),
+  m_building(true),
+  m_bits(NULL),
+  m_bits_length(0),
+  m_load_mode(LOAD_MEMORY),
+  m_mmap_addr(NULL),
+  m_mmap_length(0)
+{
+  m_bytes_processed = 0;
+  if(m_min_ngram_size < 1 || m_max_ngram_size < m_min_ngram_size)
+    {
+      BOOST_LOG_TRIVIAL(error) << "Bad ngram sizes for a partitioned Bloom "
+        "filter: " << m_min_ngram_size << " to " << m_max_ngram_size <<
+        std::endl;
+      exit(-1);
+    }
+  m_partitions.resize(m_max_ngram_size - m_min_ngram_size + 1);
+  m_keys.resize(m_partitions.size());
+  m_compacted_size.resize(m_partitions.size(),0);
+}
+
+BloomFilterPartitioned::BloomFilterPartitioned(
+                              const std::vector<uint64_t> &estimated_items,
+                              double probability_false_positive,
+                              int ip_protocol_num, int port_num,
+                              int min_ngram_size, int max_ngram_size) :
+  BenignNgramStorage(ip_protocol_num,port_num,min_ngram_size,max_ngram_size),
+  m_probability_false_positive(probability_false_positive),
+  m_building(false),
+  m_bits(NULL),
+  m_bits_length(0),
+  m_load_mode(LOAD_MEMORY),
+  m_mmap_addr(NULL),
+  m_mmap_length(0)
+{
+  m_bytes_processed = 0;
+  if(m_min_ngram_size < 1 || m_max_ngram_size < m_min_ngram_size)
+    {
+      BOOST_LOG_TRIVIAL(error) << "Bad ngram sizes for a partitioned Bloom "
+        "filter: " << m_min_ngram_size << " to " << m_max_ngram_size <<
+        std::endl;
+      exit(-1);
+    }
+  m_partitions.resize(m_max_ngram_size - m_min_ngram_size + 1);
+  for(size_t i = 0 ; i < m_partitions.size() ; i++)
+    {
+      sizePartition(m_partitions[i],m_min_ngram_size + i,
+                    (i < estimated_items.size()) ? estimated_items[i] : 0);
+      BOOST_LOG_TRIVIAL(debug) << "Partition " << m_min_ngram_size + i <<
+        ": " << m_partitions[i].num_items << " estimated ngrams, " <<
+        m_partitions[i].bitlength << " bits, " <<
+        m_partitions[i].num_hashes << " hashes" << std::endl;
+    }
+  m_bits_length = layoutPartitions();
+  m_bit_array.assign(m_bits_length,0);
+  m_bits = m_bit_array.data();
+}
+
+BloomFilterPartitioned::BloomFilterPartitioned(const std::string &filename,
+                                               BloomLoadMode load_mode,
+                                               unsigned int mmap_hints) :
+  m_probability_false_positive(0),
+  m_building(false),
+  m_bits(NULL),
+  m_bits_length(0),
+  m_load_mode((load_mode == LOAD_MMAP) ? LOAD_MMAP : LOAD_MEMORY),
+  m_mmap_addr(NULL),
+  m_mmap_length(0)
+{
+  m_insertions = 0;
+  m_unique_insertions = 0;
+  m_bytes_processed = 0;
+
+  std::ifstream bf_stream(filename.c_str(),std::ios::in | std::ios::binary);
+
+  if(!bf_stream)
+    {
+      BOOST_LOG_TRIVIAL(error) << "Unable to open: " <<
+        filename << std::endl;
+      exit(-1);
+    }
+  std::map<std::string,std::string> properties;
+
+  if(!StorageFile::readTextHeader(bf_stream,FileFirstLine,properties))
+    {
+      BOOST_LOG_TRIVIAL(error) << "Not a partitioned Bloom filter: " <<
+        filename << std::endl;
+      exit(-1);
+    }
+
+  std::map<std::string,std::string> bf_properties;
+  std::map<std::string,uint64_t> partition_properties;
+
+  for(std::map<std::string,std::string>::const_iterator it =
+        properties.begin() ; it != properties.end() ; ++it)
+    {
+      const std::string &key = it->first;
+
+      if(key.compare(0,10,"PARTITION_") == 0)
+        {
+          std::istringstream(it->second) >> partition_properties[key];
+        }
+      else
+        {
+          bf_properties[key] = it->second;
+        }
+    }
+  loadParams(bf_properties); // Load params for BenignNgramStorage
+
+  if(m_min_ngram_size < 1 || m_max_ngram_size < m_min_ngram_size)
+    {
+      BOOST_LOG_TRIVIAL(error) << "Bad partitioned Bloom filter header: " <<
+        filename << std::endl;
+      exit(-1);
+    }
+  m_partitions.resize(m_max_ngram_size - m_min_ngram_size + 1);
+  for(size_t i = 0 ; i < m_partitions.size() ; i++)
+    {
+      size_t length = m_min_ngram_size + i;
+      Partition &part = m_partitions[i];
+
+      part.bitlength = partition_properties[partitionKey(length,"BITLENGTH")];
+      part.num_hashes =
+        partition_properties[partitionKey(length,"NUM_HASHES")];
+      part.num_items = partition_properties[partitionKey(length,"NUM_ITEMS")];
+      if(part.bitlength == 0 || part.bitlength % 8 != 0 ||
+         part.num_hashes > BloomFilterBase::MAX_HASHES ||
+         (part.num_hashes == 0 &&
+          (length > (size_t)CalcBitIndeces::MAX_EXACT_NGRAM_SIZE ||
+           part.bitlength < (1ULL << (8 * length)))))
+        {
+          BOOST_LOG_TRIVIAL(error) << "Bad partition for length " <<
+            length << " in " << filename << std::endl;
+          exit(-1);
+        }
+    }
+  m_bits_length = layoutPartitions();
+
+  if(m_load_mode == LOAD_MMAP)
+    {
+      bf_stream.close();
+      mapBits(filename,mmap_hints);
+      return;
+    }
+
+  m_bit_array.resize(m_bits_length,0);
+  m_bits = m_bit_array.data();
+  bf_stream.seekg(BloomFilterBase::HeaderLengthInBytes);
+  bf_stream.read((char *)m_bits,m_bits_length);
+  if(!bf_stream)
+    {
+      BOOST_LOG_TRIVIAL(error) << "Partitioned Bloom filter file too short: "
+                               << filename << std::endl;
+      exit(-1);
+    }
+}
+
+BloomFilterPartitioned::~BloomFilterPartitioned()
+{
+  if(m_mmap_addr != NULL)
+    {
+      munmap(m_mmap_addr,m_mmap_length);
+    }
+}
+
+void
+BloomFilterPartitioned::mapBits(const std::string &filename,
+                                unsigned int mmap_hints)
+{
+  m_mmap_length = BloomFilterBase::HeaderLengthInBytes + m_bits_length;
+  m_mmap_addr = StorageFile::mapFile(filename,m_mmap_length,mmap_hints);
+  m_bits = (uint8_t *)m_mmap_addr + BloomFilterBase::HeaderLengthInBytes;
+}
+
+uint64_t
+BloomFilterPartitioned::ngramKey(uint8_t const * data, size_t length)
+{
+  uint64_t hash_pair[2];
+
+  MurmurHash3_x86_128(data,length,NgramKeySeed,hash_pair);
+  return hash_pair[0];
+}
+
+uint64_t
+BloomFilterPartitioned::buildKey(uint8_t const * data, size_t length)
+{
+  if(length > (size_t)CalcBitIndeces::MAX_EXACT_NGRAM_SIZE)
+    {
+      return ngramKey(data,length);
+    }
+
+  // The partition may turn out to be an exact bitmap, which is indexed by
+  // the ngram itself
+  uint64_t value = 0;
+
+  for(size_t i = 0 ; i < length ; i++)
+    {
+      value = (value << 8) | data[i];
+    }
+  return value;
+}
+
+size_t
+BloomFilterPartitioned::keyIndeces(const Partition &part, uint64_t key,
+                                   uint64_t *bit_indeces) const
+{
+  // The second half of the pair is avalanched from the first, so that one
+  // 64-bit key per ngram is all a build has to keep.
+  uint64_t hash_pair[2] = { key, fmix64(key ^ 0x9e3779b97f4a7c15ULL) };
+
+  part.calc_bit_indeces.indecesFromHashPair(hash_pair,bit_indeces);
+  return part.num_hashes;
+}
+
+size_t
+BloomFilterPartitioned::bitIndeces(const Partition &part,
+                                   uint8_t const * data, size_t length,
+                                   uint64_t *bit_indeces) const
+{
+  if(part.num_hashes == 0)
+    {
+      bit_indeces[0] = part.calc_bit_indeces.exactIndex(data,length);
+      return 1;
+    }
+  return keyIndeces(part,ngramKey(data,length),bit_indeces);
+}
+
+bool
+BloomFilterPartitioned::testBits(const Partition &part,
+                                 const uint64_t *bit_indeces,
+                                 size_t num_indeces) const
+{
+  const uint8_t *bits = m_bits + part.offset;
+
+  for(size_t i = 0 ; i < num_indeces ; i++)
+    {
+      uint64_t bit = bit_indeces[i] % BloomFilterBase::CHAR_SIZE_BITS;
+
+      if((bits[bit_indeces[i] / BloomFilterBase::CHAR_SIZE_BITS] &
+          BloomFilterBase::BIT_MASK[bit]) == 0)
+        {
+          return false;
+        }
+    }
+  return true;
+}
+
+void
+BloomFilterPartitioned::setBits(const Partition &part,
+                                const uint64_t *bit_indeces,
+                                size_t num_indeces)
+{
+  if(m_load_mode == LOAD_MMAP)
+    {
+      BOOST_LOG_TRIVIAL(error) << "Cannot insert into a memory mapped "
+        "Bloom filter" << std::endl;
+      exit(-1);
+    }
+
+  uint8_t *bits = m_bits + part.offset;
+
+  for(size_t i = 0 ; i < num_indeces ; i++)
+    {
+      bits[bit_indeces[i] / BloomFilterBase::CHAR_SIZE_BITS] |=
+        BloomFilterBase::BIT_MASK[bit_indeces[i] %
+                                  BloomFilterBase::CHAR_SIZE_BITS];
+    }
+}
+
+void
+BloomFilterPartitioned::insert(uint8_t const * data, size_t length)
+{
+  insertSpan(NgramSpan(data,length));
+}
+
+bool
+BloomFilterPartitioned::contains(uint8_t const * data, size_t length)
+{
+  return containsSpan(NgramSpan(data,length));
+}
+
+void
+BloomFilterPartitioned::insertSpan(const NgramSpan &ngram)
+{
+  const Partition *part = partition(ngram.length);
+
+  if(part == NULL)
+    {
+      BOOST_LOG_TRIVIAL(error) << "Ngram of length " << ngram.length <<
+        " outside of the partitioned Bloom filter" << std::endl;
+      exit(-1);
+    }
+
+  if(m_building)
+    {
+      size_t i = ngram.length - m_min_ngram_size;
+
+      m_keys[i].push_back(buildKey(ngram.data,ngram.length));
+      if(m_keys[i].size() >= std::max(2 * m_compacted_size[i],
+                                      MIN_COMPACT_KEYS))
+        {
+          compactKeys(i);
+        }
+      return;
+    }
+
+  uint64_t bit_indeces[BloomFilterBase::MAX_HASHES];
+  size_t num_indeces = bitIndeces(*part,ngram.data,ngram.length,bit_indeces);
+
+  setBits(*part,bit_indeces,num_indeces);
+}
+
+bool
+BloomFilterPartitioned::containsSpan(const NgramSpan &ngram)
+{
+  if(m_building)
+    {
+      BOOST_LOG_TRIVIAL(error) << "A partitioned Bloom filter can only be "
+        "queried once it is built" << std::endl;
+      exit(-1);
+    }
+
+  const Partition *part = partition(ngram.length);
+
+  if(part == NULL)
+    {
+      return false;
+    }
+
+  uint64_t bit_indeces[BloomFilterBase::MAX_HASHES];
+  size_t num_indeces = bitIndeces(*part,ngram.data,ngram.length,bit_indeces);
+
+  return testBits(*part,bit_indeces,num_indeces);
+}
+
+void
+BloomFilterPartitioned::containsBatch(const std::vector<NgramSpan> &ngrams,
+                                      std::vector<bool> &results)
+{
+  if(m_building)
+    {
+      BOOST_LOG_TRIVIAL(error) << "A partitioned Bloom filter can only be "
+        "queried once it is built" << std::endl;
+      exit(-1);
+    }
+  results.resize(ngrams.size());
+
+  // Visit the ngrams ordered by length so that consecutive lookups use the
+  // same partition. A counting sort, with the lengths that are not stored
+  // last.
+  std::vector<size_t> first_of_length(m_partitions.size() + 2,0);
+  for(size_t i = 0 ; i < ngrams.size() ; i++)
+    {
+      first_of_length[lengthSlot(ngrams[i].length) + 1]++;
+    }
+  for(size_t p = 1 ; p < first_of_length.size() ; p++)
+    {
+      first_of_length[p] += first_of_length[p - 1];
+    }
+  std::vector<size_t> order(ngrams.size());
+  for(size_t i = 0 ; i < ngrams.size() ; i++)
+    {
+      order[first_of_length[lengthSlot(ngrams[i].length)]++] = i;
+    }
+
+  size_t max_hashes = 1;
+  for(size_t p = 0 ; p < m_partitions.size() ; p++)
+    {
+      max_hashes = std::max(max_hashes,(size_t)m_partitions[p].num_hashes);
+    }
+
+  // Two groups of indeces: one being prefetched while the other is resolved
+  std::vector<uint64_t> indeces(2 * BATCH_GROUP_SIZE * max_hashes);
+  size_t num_indeces[2][BATCH_GROUP_SIZE];
+  size_t num_groups =
+    (ngrams.size() + BATCH_GROUP_SIZE - 1) / BATCH_GROUP_SIZE;
+
+  for(size_t group = 0 ; group <= num_groups ; group++)
+    {
+      if(group < num_groups)
+        {
+          size_t first = group * BATCH_GROUP_SIZE;
+          size_t last = std::min(first + BATCH_GROUP_SIZE,ngrams.size());
+
+          for(size_t i = first ; i < last ; i++)
+            {
+              const NgramSpan &ngram = ngrams[order[i]];
+              const Partition *part = partition(ngram.length);
+              uint64_t *bit_indeces =
+                &indeces[((group % 2) * BATCH_GROUP_SIZE + (i - first)) *
+                         max_hashes];
+              size_t &num = num_indeces[group % 2][i - first];
+
+              if(part == NULL)
+                {
+                  num = 0;
+                  continue;
+                }
+              num = bitIndeces(*part,ngram.data,ngram.length,bit_indeces);
+
+              // Most lookups of novel ngrams stop at one of the first few
+              // bits
+              size_t num_prefetch =
+                std::min(num,(size_t)BATCH_PREFETCH_HASHES);
+              for(size_t j = 0 ; j < num_prefetch ; j++)
+                {
+                  __builtin_prefetch(&m_bits[part->offset + bit_indeces[j] /
+                                             BloomFilterBase::CHAR_SIZE_BITS]);
+                }
+            }
+        }
+      if(group > 0)
+        {
+          size_t first = (group - 1) * BATCH_GROUP_SIZE;
+          size_t last = std::min(first + BATCH_GROUP_SIZE,ngrams.size());
+
+          for(size_t i = first ; i < last ; i++)
+            {
+              const NgramSpan &ngram = ngrams[order[i]];
+              size_t num = num_indeces[(group - 1) % 2][i - first];
+
+              results[order[i]] = (num > 0) &&
+                testBits(*partition(ngram.length),
+                         &indeces[(((group - 1) % 2) * BATCH_GROUP_SIZE +
+                                   (i - first)) * max_hashes],
+                         num);
+            }
+        }
+    }
+}
+
+void
+BloomFilterPartitioned::compactKeys(size_t partition)
+{
+  std::vector<uint64_t> &keys = m_keys[partition];
+
+  std::sort(keys.begin(),keys.end());
+  keys.erase(std::unique(keys.begin(),keys.end()),keys.end());
+  m_compacted_size[partition] = keys.size();
+}
+
+void
+BloomFilterPartitioned::sizePartition(Partition &part, size_t length,
+                                      uint64_t num_items)
+{
+  const uint64_t block_bits = CalcBitIndeces::BLOCK_SIZE_BITS;
+
+  part.num_items = num_items;
+  if(num_items == 0)
+    {
+      // Nothing is contained, so a single hash into a single block will do
+      part.bitlength = block_bits;
+      part.num_hashes = 1;
+      return;
+    }
+
+  // Optimal number of bits, rounded up to whole cache lines
+  uint64_t bitlength =
+    (uint64_t)ceil((-1.0 * (double)num_items *
+                    log(m_probability_false_positive)) / (M_LN2 * M_LN2));
+  bitlength = ((bitlength + block_bits - 1) / block_bits) * block_bits;
+
+  if(length <= (size_t)CalcBitIndeces::MAX_EXACT_NGRAM_SIZE &&
+     (1ULL << (8 * length)) <= bitlength)
+    {
+      // An exact bitmap is no larger, and has no false positives
+      part.bitlength = std::max(1ULL << (8 * length),(unsigned long long)
+                                block_bits);
+      part.num_hashes = 0;
+      return;
+    }
+
+  uint64_t num_hashes = llround(M_LN2 * (double)bitlength /
+                                (double)num_items);
+  if(num_hashes < 1)
+    {
+      num_hashes = 1;
+    }
+  else if(num_hashes > BloomFilterBase::MAX_HASHES)
+    {
+      num_hashes = BloomFilterBase::MAX_HASHES;
+    }
+  part.bitlength = bitlength;
+  part.num_hashes = num_hashes;
+}
+
+size_t
+BloomFilterPartitioned::layoutPartitions()
+{
+  size_t offset = 0;
+
+  for(size_t i = 0 ; i < m_partitions.size() ; i++)
+    {
+      Partition &part = m_partitions[i];
+      int length = m_min_ngram_size + i;
+
+      part.offset = offset;
+      if(part.num_hashes == 0)
+        {
+          part.calc_bit_indeces =
+            CalcBitIndeces(1,0,LAYOUT_STANDARD,INDEX_DOUBLE_HASH,
+                           HASH_MURMUR3,SIZING_EXACT,length,length);
+        }
+      else
+        {
+          part.calc_bit_indeces =
+            CalcBitIndeces(part.num_hashes,part.bitlength,LAYOUT_STANDARD,
+                           INDEX_DOUBLE_HASH,HASH_MURMUR3,SIZING_EXACT);
+        }
+      offset += part.bitlength / BloomFilterBase::CHAR_SIZE_BITS;
+      offset = ((offset + PartitionAlignment - 1) / PartitionAlignment) *
+        PartitionAlignment;
+    }
+  return offset;
+}
+
+void
+BloomFilterPartitioned::build()
+{
+  for(size_t i = 0 ; i < m_partitions.size() ; i++)
+    {
+      compactKeys(i);
+      sizePartition(m_partitions[i],m_min_ngram_size + i,m_keys[i].size());
+      BOOST_LOG_TRIVIAL(debug) << "Partition " << m_min_ngram_size + i <<
+        ": " << m_partitions[i].num_items << " ngrams, " <<
+        m_partitions[i].bitlength << " bits, " <<
+        m_partitions[i].num_hashes << " hashes" << std::endl;
+    }
+  m_bits_length = layoutPartitions();
+  m_bit_array.assign(m_bits_length,0);
+  m_bits = m_bit_array.data();
+  m_building = false;
+
+  uint64_t bit_indeces[BloomFilterBase::MAX_HASHES];
+
+  for(size_t i = 0 ; i < m_partitions.size() ; i++)
+    {
+      const Partition &part = m_partitions[i];
+      size_t length = m_min_ngram_size + i;
+
+      for(size_t k = 0 ; k < m_keys[i].size() ; k++)
+        {
+          uint64_t key = m_keys[i][k];
+
+          if(length <= (size_t)CalcBitIndeces::MAX_EXACT_NGRAM_SIZE)
+            {
+              // The key is the ngram itself
+              uint8_t ngram[CalcBitIndeces::MAX_EXACT_NGRAM_SIZE];
+
+              for(size_t j = length ; j > 0 ; j--)
+                {
+                  ngram[j - 1] = (uint8_t)key;
+                  key >>= 8;
+                }
+              setBits(part,bit_indeces,bitIndeces(part,ngram,length,
+                                                  bit_indeces));
+              continue;
+            }
+          setBits(part,bit_indeces,keyIndeces(part,key,bit_indeces));
+        }
+      std::vector<uint64_t>().swap(m_keys[i]);
+    }
+}
+
+bool
+BloomFilterPartitioned::flush(std::string filename)
+{
+  if(m_building)
+    {
+      build();
+    }
+
+  std::ostringstream out;
+
+  out << FileFirstLine << std::endl;
+  out << "IP_PROTOCOL_NUMBER = " << m_ip_protocol_num << std::endl;
+  out << "TCP_IP_PORT_NUM = " << m_port_num << std::endl;
+  out << "MIN_NGRAM_SIZE = " << m_min_ngram_size << std::endl;
+  out << "MAX_NGRAM_SIZE = " << m_max_ngram_size << std::endl;
+  out << "NUM_PAYLOAD_BYTES_PROCESSED = " << m_bytes_processed << std::endl;
+  for(size_t i = 0 ; i < m_partitions.size() ; i++)
+    {
+      size_t length = m_min_ngram_size + i;
+
+      out << partitionKey(length,"BITLENGTH") << " = " <<
+        m_partitions[i].bitlength << std::endl;
+      out << partitionKey(length,"NUM_HASHES") << " = " <<
+        m_partitions[i].num_hashes << std::endl;
+      out << partitionKey(length,"NUM_ITEMS") << " = " <<
+        m_partitions[i].num_items << std::endl;
+    }
+
+  std::string serialized_header = out.str();
+
+  if(serialized_header.size() >= BloomFilterBase::HeaderLengthInBytes)
+    {
+      BOOST_LOG_TRIVIAL(error) << "Too many partitions for the header" <<
+        std::endl;
+      return false;
+    }
+
+  std::ofstream bfStream(filename.c_str(),std::ios::out | std::ios::binary);
+
+  if(!bfStream)
+    {
+      BOOST_LOG_TRIVIAL(error) <<
+        "Unable to open: " << filename << std::endl;
+      return false;
+    }
+
+  StorageFile::writeTextHeader(bfStream,serialized_header);
+  bfStream.write((const char *)m_bits,m_bits_length);
+  bfStream.close();
+  return true;
+}
+
+bool
+BloomFilterPartitioned::isPartitionedFile(const std::string &filename)
+{
+  return StorageFile::isTextHeaderFile(filename,FileFirstLine);
+}
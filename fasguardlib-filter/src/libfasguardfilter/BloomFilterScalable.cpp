@@ -0,0 +1,480 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <boost/log/trivial.hpp>
+#include <sys/mman.h>
+#include <fasguardfilter/BloomFilterScalable.hh>
+#include <fasguardfilter/MurmurHash3.h>
+#include "StorageFile.hh"
+
+const std::string BloomFilterScalable::FileFirstLine =
+  "SCALABLE_BLOOM_FILTER";
+const double BloomFilterScalable::DEFAULT_GROWTH = 2.0;
+const double BloomFilterScalable::DEFAULT_TIGHTENING = 0.5;
+
+/**
+ * Seed for the ngram hash.
+ */
+static const uint32_t NgramKeySeed = 0x3213868e;
+
+/**
+ * Bytes in a cache line. Every stage starts on one.
+ */
+static const size_t StageAlignment = 64;
+
+static std::string
+stageKey(size_t stage, const char *name)
+{
+  std::ostringstream key;
+
+  key << "STAGE_" << stage << "_" << name;
+  return key.str();
+}
+
+BloomFilterScalable::BloomFilterScalable(size_t initial_items,
+                                         double probability_false_positive,
+                                         int ip_protocol_num, int port_num,
+                                         int min_ngram_size,
+                                         int max_ngram_size,
+                                         double growth,
+                                         double tightening) :
+  BenignNgramStorage(ip_protocol_num,port_num,min_ngram_size,max_ngram_size),
+  m_initial_items(std::max(initial_items,(size_t)1)),
+  m_probability_false_positive(probability_false_positive),
+  m_growth(growth),
+  m_tightening(tightening),
+  m_load_mode(LOAD_MEMORY),
+  m_mmap_addr(NULL),
+  m_mmap_length(0)
+{
+  m_bytes_processed = 0;
+  if(!(m_probability_false_positive > 0 &&
+       m_probability_false_positive < 1) ||
+     !(m_growth >= 1) || !(m_tightening > 0 && m_tightening < 1))
+    {
+      BOOST_LOG_TRIVIAL(error) << "Bad scalable Bloom filter parameters: "
+        "false positive rate " << m_probability_false_positive <<
+        ", growth " << m_growth << ", tightening " << m_tightening <<
+        std::endl;
+      exit(-1);
+    }
+  addStage();
+}
+
+BloomFilterScalable::BloomFilterScalable(const std::string &filename,
+                                         BloomLoadMode load_mode,
+                                         unsigned int mmap_hints) :
+  m_initial_items(0),
+  m_probability_false_positive(0),
+  m_growth(0),
+  m_tightening(0),
+  m_load_mode((load_mode == LOAD_MMAP) ? LOAD_MMAP : LOAD_MEMORY),
+  m_mmap_addr(NULL),
+  m_mmap_length(0)
+{
+  m_insertions = 0;
+  m_unique_insertions = 0;
+  m_bytes_processed = 0;
+
+  std::ifstream bf_stream(filename.c_str(),std::ios::in | std::ios::binary);
+
+  if(!bf_stream)
+    {
+      BOOST_LOG_TRIVIAL(error) << "Unable to open: " <<
+        filename << std::endl;
+      exit(-1);
+    }
+  std::map<std::string,std::string> properties;
+
+  if(!StorageFile::readTextHeader(bf_stream,FileFirstLine,properties))
+    {
+      BOOST_LOG_TRIVIAL(error) << "Not a scalable Bloom filter: " <<
+        filename << std::endl;
+      exit(-1);
+    }
+
+  std::map<std::string,std::string> bf_properties;
+  std::map<std::string,std::string> base_properties;
+
+  for(std::map<std::string,std::string>::const_iterator cit =
+        properties.begin() ; cit != properties.end() ; cit++)
+    {
+      if(cit->first.compare(0,6,"STAGE_") == 0 ||
+         cit->first == "INITIAL_ITEMS" ||
+         cit->first == "PROBABILITY_FALSE_POSITIVE" ||
+         cit->first == "GROWTH" || cit->first == "TIGHTENING" ||
+         cit->first == "NUM_STAGES")
+        {
+          bf_properties.insert(*cit);
+        }
+      else
+        {
+          base_properties.insert(*cit);
+        }
+    }
+  loadParams(base_properties); // Load params for BenignNgramStorage
+
+  size_t num_stages = 0;
+
+  std::istringstream(bf_properties["INITIAL_ITEMS"]) >> m_initial_items;
+  std::istringstream(bf_properties["PROBABILITY_FALSE_POSITIVE"]) >>
+    m_probability_false_positive;
+  std::istringstream(bf_properties["GROWTH"]) >> m_growth;
+  std::istringstream(bf_properties["TIGHTENING"]) >> m_tightening;
+  std::istringstream(bf_properties["NUM_STAGES"]) >> num_stages;
+  if(m_min_ngram_size < 1 || m_max_ngram_size < m_min_ngram_size ||
+     m_initial_items == 0 || num_stages == 0 ||
+     !(m_probability_false_positive > 0 &&
+       m_probability_false_positive < 1) ||
+     !(m_growth >= 1) || !(m_tightening > 0 && m_tightening < 1))
+    {
+      BOOST_LOG_TRIVIAL(error) << "Bad scalable Bloom filter header: " <<
+        filename << std::endl;
+      exit(-1);
+    }
+
+  m_stages.resize(num_stages);
+  for(size_t i = 0 ; i < num_stages ; i++)
+    {
+      Stage &stage = m_stages[i];
+
+      stage.bitlength = 0;
+      stage.num_hashes = 0;
+      stage.capacity = 0;
+      stage.num_items = 0;
+      stage.bits = NULL;
+      std::istringstream(bf_properties[stageKey(i,"BITLENGTH")]) >>
+        stage.bitlength;
+      std::istringstream(bf_properties[stageKey(i,"NUM_HASHES")]) >>
+        stage.num_hashes;
+      std::istringstream(bf_properties[stageKey(i,"CAPACITY")]) >>
+        stage.capacity;
+      std::istringstream(bf_properties[stageKey(i,"NUM_ITEMS")]) >>
+        stage.num_items;
+      if(stage.bitlength == 0 || stage.bitlength % 8 != 0 ||
+         stage.num_hashes < 1 ||
+         stage.num_hashes > BloomFilterBase::MAX_HASHES ||
+         stage.capacity == 0)
+        {
+          BOOST_LOG_TRIVIAL(error) << "Bad stage " << i << " in " <<
+            filename << std::endl;
+          exit(-1);
+        }
+      stage.calc_bit_indeces =
+        CalcBitIndeces(stage.num_hashes,stage.bitlength,LAYOUT_STANDARD,
+                       INDEX_DOUBLE_HASH,HASH_MURMUR3,SIZING_EXACT);
+    }
+
+  std::vector<size_t> offsets;
+  size_t bits_length = layoutStages(offsets);
+
+  if(m_load_mode == LOAD_MMAP)
+    {
+      bf_stream.close();
+      mapBits(filename,mmap_hints,bits_length);
+      for(size_t i = 0 ; i < m_stages.size() ; i++)
+        {
+          m_stages[i].bits = (uint8_t *)m_mmap_addr +
+            BloomFilterBase::HeaderLengthInBytes + offsets[i];
+        }
+      return;
+    }
+
+  for(size_t i = 0 ; i < m_stages.size() ; i++)
+    {
+      Stage &stage = m_stages[i];
+
+      m_bit_arrays.push_back(BloomFilterBase::bit_array_type(
+                               stage.bitlength /
+                               BloomFilterBase::CHAR_SIZE_BITS));
+      stage.bits = m_bit_arrays.back().data();
+      bf_stream.seekg(BloomFilterBase::HeaderLengthInBytes + offsets[i]);
+      bf_stream.read((char *)stage.bits,m_bit_arrays.back().size());
+      if(!bf_stream)
+        {
+          BOOST_LOG_TRIVIAL(error) << "Scalable Bloom filter file too "
+            "short: " << filename << std::endl;
+          exit(-1);
+        }
+    }
+}
+
+BloomFilterScalable::~BloomFilterScalable()
+{
+  if(m_mmap_addr != NULL)
+    {
+      munmap(m_mmap_addr,m_mmap_length);
+    }
+}
+
+void
+BloomFilterScalable::mapBits(const std::string &filename,
+                             unsigned int mmap_hints, size_t bits_length)
+{
+  m_mmap_length = BloomFilterBase::HeaderLengthInBytes + bits_length;
+  m_mmap_addr = StorageFile::mapFile(filename,m_mmap_length,mmap_hints);
+}
+
+uint64_t
+BloomFilterScalable::ngramKey(uint8_t const * data, size_t length)
+{
+  uint64_t hash_pair[2];
+
+  MurmurHash3_x86_128(data,length,NgramKeySeed,hash_pair);
+  return hash_pair[0];
+}
+
+size_t
+BloomFilterScalable::keyIndeces(size_t stage, uint64_t key,
+                                uint64_t *bit_indeces) const
+{
+  // Every stage derives its own hash pair from the key, so that an ngram
+  // that is a false positive in one stage is not likelier to be one in the
+  // next.
+  uint64_t stage_key = key + (uint64_t)stage * 0x9e3779b97f4a7c15ULL;
+  uint64_t hash_pair[2] = { fmix64(stage_key),
+                            fmix64(stage_key ^ 0xc2b2ae3d27d4eb4fULL) };
+
+  m_stages[stage].calc_bit_indeces.indecesFromHashPair(hash_pair,
+                                                       bit_indeces);
+  return m_stages[stage].num_hashes;
+}
+
+bool
+BloomFilterScalable::containsKey(uint64_t key) const
+{
+  uint64_t bit_indeces[BloomFilterBase::MAX_HASHES];
+
+  for(size_t s = m_stages.size() ; s > 0 ; s--)
+    {
+      const uint8_t *bits = m_stages[s - 1].bits;
+      size_t num_indeces = keyIndeces(s - 1,key,bit_indeces);
+      size_t i = 0;
+
+      while(i < num_indeces &&
+            (bits[bit_indeces[i] / BloomFilterBase::CHAR_SIZE_BITS] &
+             BloomFilterBase::BIT_MASK[bit_indeces[i] %
+                                       BloomFilterBase::CHAR_SIZE_BITS]))
+        {
+          i++;
+        }
+      if(i == num_indeces)
+        {
+          return true;
+        }
+    }
+  return false;
+}
+
+void
+BloomFilterScalable::insert(uint8_t const * data, size_t length)
+{
+  insertSpan(NgramSpan(data,length));
+}
+
+bool
+BloomFilterScalable::contains(uint8_t const * data, size_t length)
+{
+  return containsSpan(NgramSpan(data,length));
+}
+
+void
+BloomFilterScalable::insertSpan(const NgramSpan &ngram)
+{
+  if(m_load_mode == LOAD_MMAP)
+    {
+      BOOST_LOG_TRIVIAL(error) << "Cannot insert into a memory mapped "
+        "Bloom filter" << std::endl;
+      exit(-1);
+    }
+
+  uint64_t key = ngramKey(ngram.data,ngram.length);
+
+  if(containsKey(key))
+    {
+      return;
+    }
+  if(m_stages.back().num_items >= m_stages.back().capacity)
+    {
+      addStage();
+      BOOST_LOG_TRIVIAL(debug) << "Scalable Bloom filter stage " <<
+        m_stages.size() - 1 << ": capacity " << m_stages.back().capacity <<
+        ", " << m_stages.back().bitlength << " bits, " <<
+        m_stages.back().num_hashes << " hashes" << std::endl;
+    }
+
+  Stage &stage = m_stages.back();
+  uint64_t bit_indeces[BloomFilterBase::MAX_HASHES];
+  size_t num_indeces = keyIndeces(m_stages.size() - 1,key,bit_indeces);
+
+  for(size_t i = 0 ; i < num_indeces ; i++)
+    {
+      stage.bits[bit_indeces[i] / BloomFilterBase::CHAR_SIZE_BITS] |=
+        BloomFilterBase::BIT_MASK[bit_indeces[i] %
+                                  BloomFilterBase::CHAR_SIZE_BITS];
+    }
+  stage.num_items++;
+}
+
+bool
+BloomFilterScalable::containsSpan(const NgramSpan &ngram)
+{
+  return containsKey(ngramKey(ngram.data,ngram.length));
+}
+
+uint64_t
+BloomFilterScalable::nextCapacity() const
+{
+  return (uint64_t)llround((double)m_initial_items *
+                           pow(m_growth,(double)m_stages.size()));
+}
+
+double
+BloomFilterScalable::nextProbability() const
+{
+  // The rates of all the stages add up to at most
+  // m_probability_false_positive
+  return m_probability_false_positive * (1 - m_tightening) *
+    pow(m_tightening,(double)m_stages.size());
+}
+
+void
+BloomFilterScalable::sizeStage(Stage &stage,
+                               double probability_false_positive) const
+{
+  // Optimal number of bits, rounded up to whole cache lines
+  const uint64_t line_bits = StageAlignment * BloomFilterBase::CHAR_SIZE_BITS;
+  uint64_t bitlength =
+    (uint64_t)ceil((-1.0 * (double)stage.capacity *
+                    log(probability_false_positive)) / (M_LN2 * M_LN2));
+
+  bitlength = std::max((bitlength + line_bits - 1) / line_bits * line_bits,
+                       line_bits);
+
+  uint64_t num_hashes = llround(M_LN2 * (double)bitlength /
+                                (double)stage.capacity);
+  if(num_hashes < 1)
+    {
+      num_hashes = 1;
+    }
+  else if(num_hashes > BloomFilterBase::MAX_HASHES)
+    {
+      num_hashes = BloomFilterBase::MAX_HASHES;
+    }
+  stage.bitlength = bitlength;
+  stage.num_hashes = num_hashes;
+}
+
+void
+BloomFilterScalable::addStage()
+{
+  Stage stage;
+
+  stage.capacity = std::max(nextCapacity(),(uint64_t)1);
+  stage.num_items = 0;
+  sizeStage(stage,nextProbability());
+  stage.calc_bit_indeces =
+    CalcBitIndeces(stage.num_hashes,stage.bitlength,LAYOUT_STANDARD,
+                   INDEX_DOUBLE_HASH,HASH_MURMUR3,SIZING_EXACT);
+  m_bit_arrays.push_back(BloomFilterBase::bit_array_type(
+                           stage.bitlength / BloomFilterBase::CHAR_SIZE_BITS,
+                           0));
+  stage.bits = m_bit_arrays.back().data();
+  m_stages.push_back(stage);
+}
+
+size_t
+BloomFilterScalable::layoutStages(std::vector<size_t> &offsets) const
+{
+  size_t offset = 0;
+
+  offsets.resize(m_stages.size());
+  for(size_t i = 0 ; i < m_stages.size() ; i++)
+    {
+      offsets[i] = offset;
+      offset += m_stages[i].bitlength / BloomFilterBase::CHAR_SIZE_BITS;
+      offset = ((offset + StageAlignment - 1) / StageAlignment) *
+        StageAlignment;
+    }
+  return offset;
+}
+
+bool
+BloomFilterScalable::flush(std::string filename)
+{
+  std::ostringstream out;
+
+  out.precision(17);
+  out << FileFirstLine << std::endl;
+  out << "IP_PROTOCOL_NUMBER = " << m_ip_protocol_num << std::endl;
+  out << "TCP_IP_PORT_NUM = " << m_port_num << std::endl;
+  out << "MIN_NGRAM_SIZE = " << m_min_ngram_size << std::endl;
+  out << "MAX_NGRAM_SIZE = " << m_max_ngram_size << std::endl;
+  out << "NUM_PAYLOAD_BYTES_PROCESSED = " << m_bytes_processed << std::endl;
+  out << "INITIAL_ITEMS = " << m_initial_items << std::endl;
+  out << "PROBABILITY_FALSE_POSITIVE = " << m_probability_false_positive <<
+    std::endl;
+  out << "GROWTH = " << m_growth << std::endl;
+  out << "TIGHTENING = " << m_tightening << std::endl;
+  out << "NUM_STAGES = " << m_stages.size() << std::endl;
+  for(size_t i = 0 ; i < m_stages.size() ; i++)
+    {
+      out << stageKey(i,"BITLENGTH") << " = " << m_stages[i].bitlength <<
+        std::endl;
+      out << stageKey(i,"NUM_HASHES") << " = " << m_stages[i].num_hashes <<
+        std::endl;
+      out << stageKey(i,"CAPACITY") << " = " << m_stages[i].capacity <<
+        std::endl;
+      out << stageKey(i,"NUM_ITEMS") << " = " << m_stages[i].num_items <<
+        std::endl;
+    }
+
+  std::string serialized_header = out.str();
+
+  if(serialized_header.size() >= BloomFilterBase::HeaderLengthInBytes)
+    {
+      BOOST_LOG_TRIVIAL(error) << "Too many stages for the header" <<
+        std::endl;
+      return false;
+    }
+
+  std::ofstream bfStream(filename.c_str(),std::ios::out | std::ios::binary);
+
+  if(!bfStream)
+    {
+      BOOST_LOG_TRIVIAL(error) <<
+        "Unable to open: " << filename << std::endl;
+      return false;
+    }
+
+  StorageFile::writeTextHeader(bfStream,serialized_header);
+
+  std::vector<size_t> offsets;
+  size_t bits_length = layoutStages(offsets);
+
+  for(size_t i = 0 ; i < m_stages.size() ; i++)
+    {
+      size_t stage_bytes =
+        m_stages[i].bitlength / BloomFilterBase::CHAR_SIZE_BITS;
+      size_t end = (i + 1 < m_stages.size()) ? offsets[i + 1] : bits_length;
+
+      bfStream.write((const char *)m_stages[i].bits,stage_bytes);
+      StorageFile::writePadding(bfStream,end - offsets[i] - stage_bytes);
+    }
+  BOOST_LOG_TRIVIAL(debug) << "Scalable Bloom filter: " << m_stages.size() <<
+    " stages" << std::endl;
+  bfStream.close();
+  return (bool)bfStream;
+}
+
+bool
+BloomFilterScalable::isScalableFile(const std::string &filename)
+{
+  return StorageFile::isTextHeaderFile(filename,FileFirstLine);
+}
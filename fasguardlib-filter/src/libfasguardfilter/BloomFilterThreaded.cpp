@@ -2,16 +2,16 @@
 #include <config.h>
 #endif
 
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 #include <sstream>
 #include <fstream>
 #include <boost/log/trivial.hpp>
-#include <boost/regex.hpp>
 #include <boost/unordered_map.hpp>
 #include <boost/thread/thread.hpp>
 #include <fasguardfilter/BloomFilterThreaded.hh>
-#include "BloomInsertThread.hh"
-#include "MurmurHash3.h"
+#include <fasguardfilter/MurmurHash3.h>
 
 /**
     @brief Seeds for #MAX_HASHES different hash functions.
@@ -162,26 +162,23 @@ static const unsigned char BIT_MASK[] = { 0x01,   //00000001
                                           0x40,   //01000000
                                           0x80 }; //10000000
 
-static char Filler[BloomFilterThreaded::HeaderLengthInBytes];
-static char HeaderBuffer[BloomFilterThreaded::HeaderLengthInBytes];
 
-static boost::lockfree::queue<TrivString, boost::lockfree::fixed_sized<true> >
-ngram_q(BloomFilterThreaded::NgramQueueLength);
-
-  // Queue of vectors of Bloom filter offsets
-
-//static boost::lockfree::queue<uint64_t, boost::lockfree::fixed_sized<true> >
-static boost::lockfree::queue<BloomOffsetBlock,
-                              boost::lockfree::fixed_sized<true> >
-bfilt_offset_q(BloomFilterThreaded::BloomFilterThreadedOffsetQueueLength);
 
 BloomFilterThreaded::BloomFilterThreaded(size_t inserted_items,
                          double probability_false_positive,
                          int ip_protocol_num, int port_num, int min_ngram_size,
-                                         int max_ngram_size, int thread_num) :
+                                         int max_ngram_size, int thread_num,
+                                         BloomLayout layout,
+                                         BloomIndexMode index_mode,
+                                         BloomHashFamily hash_family,
+                                         BloomSizing sizing,
+                                         BloomBuildStrategy build_strategy,
+                                         BloomShortNgrams short_ngrams) :
   BloomFilterBase(inserted_items,probability_false_positive,ip_protocol_num,
-                  port_num,min_ngram_size,max_ngram_size),
-  m_thread_num(thread_num)
+                  port_num,min_ngram_size,max_ngram_size,layout,index_mode,
+                  hash_family,sizing,short_ngrams),
+  m_thread_num(thread_num),
+  m_build_strategy(build_strategy)
 {
   // BOOST_LOG_TRIVIAL(debug) << "Expected number of insertions: " <<
   //   inserted_items << std::endl;
@@ -252,19 +249,37 @@ BloomFilterThreaded::BloomFilterThreaded(size_t inserted_items,
       std::endl;
 
     m_ngram_done = false;
-    m_shutdown_thread_count = 0;
+    m_threads_joined = false;
+
+    m_next_ring = 0;
+    m_chunk.reset(new PayloadChunk());
+    m_chunk->bytes.reserve(ChunkBytes);
 
     for(unsigned int i=0;i < m_thread_num;i++)
       {
-        HashThread ht(ngram_q,bfilt_offset_q,m_calc_bit_indeces,
-                      m_ngram_done,m_shutdown_thread_count,i);
+        m_chunk_rings.push_back(boost::shared_ptr<SpscRing<PayloadChunkPtr> >(
+                                  new SpscRing<PayloadChunkPtr>(
+                                    ChunkQueueLength)));
+        m_chunk_ready.push_back(boost::shared_ptr<EventCount>(
+                                  new EventCount()));
+        bit_array_type *partial = NULL;
+        if(m_build_strategy == BUILD_PARTIAL_IN_PLACE && i == 0)
+          {
+            partial = &mBloomFilter;
+          }
+        else if(m_build_strategy != BUILD_SHARED)
+          {
+            m_partials.push_back(boost::shared_ptr<bit_array_type>(
+                                   new bit_array_type()));
+            partial = m_partials.back().get();
+          }
+        HashThread ht(*m_chunk_rings.back(),mBloomFilter.data(),
+                      m_bitlength + m_exact_bitlength,
+                      partial,m_calc_bit_indeces,m_ngram_done,
+                      *m_chunk_ready.back(),m_ring_space,i);
         m_ngram_hashers.create_thread(ht);
       }
 
-    BloomInsertThread bit(bfilt_offset_q,m_shutdown_thread_count,
-                          m_thread_num,mBloomFilter,m_bitlength,
-                          m_bloom_insertion_done);
-    m_bloom_insert.create_thread(bit);
     // m_cache = boost::shared_ptr<lru_cache_using_std<
     //                            CalcBitIndeces,
     //                            std::string,
@@ -279,55 +294,156 @@ BloomFilterThreaded::BloomFilterThreaded(size_t inserted_items,
     //                                                  NUM_CACHE_ENTRIES));
     // BOOST_LOG_TRIVIAL(debug) << "Before Hash Construction" <<
     //   std::endl;
-    m_bloom_insertion_done = false;
 
 }
 
 
 
 BloomFilterThreaded::BloomFilterThreaded(const std::string &filename, bool from_mem_p) :
-  BloomFilterBase(filename,from_mem_p)
+  BloomFilterBase(filename,from_mem_p),
+  m_ngram_done(true),
+  m_thread_num(0),
+  m_next_ring(0),
+  m_threads_joined(true),
+  m_build_strategy(BUILD_SHARED)
+{}
+
+BloomFilterThreaded::BloomFilterThreaded(const std::string &filename,
+                                         BloomLoadMode load_mode,
+                                         unsigned int mmap_hints) :
+  BloomFilterBase(filename,load_mode,mmap_hints),
+  m_ngram_done(true),
+  m_thread_num(0),
+  m_next_ring(0),
+  m_threads_joined(true),
+  m_build_strategy(BUILD_SHARED)
 {}
   /**
    * Destructor.
    */
 BloomFilterThreaded::~BloomFilterThreaded()
 {
+  // The HashThreads use this filter's rings and bits
+  signalDone();
+  threadsCompleted();
+
   if(!m_blm_frm_mem)
     {
       m_bf_stream.close();
     }
 }
-/**
- * Enqueues ngrams for later insertion into memory structure.
- * @param data The content from the packet.
- * @param length The length of data.
- */
 void
-BloomFilterThreaded::insert(uint8_t const * data, size_t length)
+BloomFilterThreaded::signalDone()
 {
-  if(length > MaxNgramLength)
+  if(m_ngram_done)
     {
-      BOOST_LOG_TRIVIAL(error) << "Bad ngram length " <<
-        length << " which is greater than " <<
-                             MaxNgramLength  << std::endl;
-      exit(-1);
+      return;
     }
+  if(!m_chunk->segments.empty())
+    {
+      pushChunk();
+    }
+  m_ngram_done = true;
+  for(size_t i = 0 ; i < m_chunk_ready.size() ; i++)
+    {
+      m_chunk_ready[i]->notify();
+    }
+}
 
-  // Place ngram data in TrivString struct which can be enqueue on a lockfree
-  // queue
+void
+BloomFilterThreaded::threadsCompleted()
+{
+  if(!m_threads_joined)
+    {
+      m_ngram_hashers.join_all();
+      mergePartials();
+      m_threads_joined = true;
+    }
+}
 
-  TrivString ts;
-  ts.length = length;
-  for(int i=0;i<length;i++)
+void
+BloomFilterThreaded::mergePartials()
+{
+  // The partials are the same size as the filter. Or them in a word at a
+  // time, then the bytes past the last whole word.
+  size_t num_bytes = mBloomFilter.size();
+  size_t num_words = num_bytes / sizeof(uint64_t);
+
+  for(size_t p = 0 ; p < m_partials.size() ; p++)
     {
-      ts.string[i] = data[i];
+      const uint8_t *src = m_partials[p]->data();
+      uint8_t *dst = mBloomFilter.data();
+
+      if(m_partials[p]->size() != num_bytes)
+        {
+          BOOST_LOG_TRIVIAL(error) << "Partial filter of " <<
+            m_partials[p]->size() << " bytes, expected " << num_bytes <<
+            std::endl;
+          exit(-1);
+        }
+      for(size_t i = 0 ; i < num_words ; i++)
+        {
+          uint64_t dst_word;
+          uint64_t src_word;
 
+          memcpy(&dst_word,dst + i * sizeof(uint64_t),sizeof(uint64_t));
+          memcpy(&src_word,src + i * sizeof(uint64_t),sizeof(uint64_t));
+          dst_word |= src_word;
+          memcpy(dst + i * sizeof(uint64_t),&dst_word,sizeof(uint64_t));
+        }
+      for(size_t i = num_words * sizeof(uint64_t) ; i < num_bytes ; i++)
+        {
+          dst[i] |= src[i];
+        }
+      // Give the memory back as soon as the partial is merged
+      m_partials[p].reset();
     }
-  while(!ngram_q.push(ts))
+  m_partials.clear();
+}
+
+void
+BloomFilterThreaded::pushChunk()
+{
+  // Deal the chunks out to the HashThreads in turn, passing over rings that
+  // are full
+  size_t num_full = 0;
+  while(!m_chunk_rings[m_next_ring]->push(m_chunk))
     {
-      boost::this_thread::sleep_for(boost::chrono::milliseconds(HashThread::SleepTimeMilS));
+      m_next_ring = (m_next_ring + 1) % m_chunk_rings.size();
+      if(++num_full == m_chunk_rings.size())
+        {
+          const std::vector<boost::shared_ptr<SpscRing<PayloadChunkPtr> > >
+            &rings = m_chunk_rings;
+          m_ring_space.wait([&rings]()
+                            {
+                              for(size_t i = 0 ; i < rings.size() ; i++)
+                                {
+                                  if(!rings[i]->full())
+                                    {
+                                      return true;
+                                    }
+                                }
+                              return false;
+                            });
+          num_full = 0;
+        }
     }
+  m_chunk_ready[m_next_ring]->notify();
+  m_next_ring = (m_next_ring + 1) % m_chunk_rings.size();
+
+  m_chunk.reset(new PayloadChunk());
+  m_chunk->bytes.reserve(ChunkBytes);
+}
+
+/**
+ * Enqueues ngrams for later insertion into memory structure.
+ * @param data The content from the packet.
+ * @param length The length of data.
+ */
+void
+BloomFilterThreaded::insert(uint8_t const * data, size_t length)
+{
+  insertNgrams(data,length,length,length);
   // size_t num_hash_func = m_num_hashes;
 
   // std::string ngram((char *)data,length);
@@ -392,6 +508,44 @@ BloomFilterThreaded::insert(uint8_t const * data, size_t length)
   //   }
 }
 
+void
+BloomFilterThreaded::insertSpan(const NgramSpan &ngram)
+{
+  insert(ngram.data,ngram.length);
+}
+
+/**
+ * Insert every ngram of a payload. The payload is copied into the current
+ * chunk, and a HashThread enumerates and hashes its ngrams once the chunk
+ * is full or signalDone() is called.
+ */
+void
+BloomFilterThreaded::insertNgrams(uint8_t const * data, size_t length,
+                                  int min_ngram_size, int max_ngram_size)
+{
+  // Only a filter built by this process has HashThreads to set its bits
+  if(!m_chunk)
+    {
+      BOOST_LOG_TRIVIAL(error) << "Cannot insert into a loaded threaded "
+        "Bloom filter" << std::endl;
+      exit(-1);
+    }
+
+  PayloadSegment seg;
+
+  seg.offset = m_chunk->bytes.size();
+  seg.length = length;
+  seg.min_ngram_size = min_ngram_size;
+  seg.max_ngram_size = max_ngram_size;
+  m_chunk->bytes.insert(m_chunk->bytes.end(),data,data + length);
+  m_chunk->segments.push_back(seg);
+
+  if(m_chunk->bytes.size() >= ChunkBytes)
+    {
+      pushChunk();
+    }
+}
+
 /**
  * Check to see if a string is stored in the data structure. Typically, the
  * string is an ngram.
@@ -401,86 +555,18 @@ BloomFilterThreaded::insert(uint8_t const * data, size_t length)
 bool
 BloomFilterThreaded::contains(uint8_t const * data, size_t length)
 {
-  // number of Ngram hash functions in our list
-  //bloom_filter *this_bloom = const_cast<bloom_filter *>(this);
-  const size_t num_hash_func = m_num_hashes;
+  // Concurrent lookups bypass the cache, which every lookup updates
+  if(m_concurrent_reads || m_calc_bit_indeces.isExact(length))
+    {
+      return containsSpan(NgramSpan(data,length));
+    }
 
   std::string ngram((char *)data,length);
 
-  //std::cout << "Before retrieving cache" << std::endl;
-
-  //std::cout.flush();
-
   const std::vector<uint64_t> &indeces =
     (*m_cache)(ngram);
 
-  //std::cout << "After retrieving cache" << std::endl;
-
-  //std::cout.flush();
-
-  // std::cout << "In contains, number hashes is " << num_hash_func <<
-  //   std::endl;
-  uint64_t filterSizeInBits =
-    m_bitlength;
-  // std::cout << "filterSizeInBits = " << filterSizeInBits << std::endl;
-
-  //mHashFuncList.size();
-
-  // Process the Ngram with each hash function and see if it exists in
-  // the Bloom filter. Notice that the Ngram is only declared to be
-  // contained by the Bloom filter if *all* the hash functions report
-  // its existence.
-  //  for(size_t i = 0 ; i < num_hash_func ; i++)
-  for(std::vector<uint64_t>::const_iterator it = indeces.begin();
-      it != indeces.end();
-      it++)
-   {
-      // bit index into the Bloom filter where this Ngram would have been marked
-      // by the i'th hash function
-      // uint64_t hash_pair[2];
-      // MurmurHash3_x86_128(data,length,hash_seeds[i],hash_pair);
-      // uint64_t bit_index
-      //        = hash_pair[1] %
-      //        filterSizeInBits;
-
-      // the bit index relative to the start of that byte
-      //uint64_t bit = bit_index % CHAR_SIZE_BITS;
-     uint64_t bit = *it % CHAR_SIZE_BITS;
-
-      // if the given bit index in the Bloom filter hasn't been marked, we
-      // definitely have never seen this Ngram before
-      if(m_blm_frm_mem)
-        {
-          //if((mBloomFilterThreaded[bit_index / CHAR_SIZE_BITS] & BIT_MASK[bit]) !=
-          if((mBloomFilter[*it / CHAR_SIZE_BITS] & BIT_MASK[bit]) !=
-             BIT_MASK[bit])
-            {
-              return(false);
-            }
-        }
-      else
-        {
-          //m_bf_stream.seekg(HeaderLengthInBytes+(bit_index / CHAR_SIZE_BITS));
-          m_bf_stream.seekg(HeaderLengthInBytes+(*it / CHAR_SIZE_BITS));
-          unsigned char val;
-          m_bf_stream.read((char *)&val,1);
-          if((val &  BIT_MASK[bit]) != BIT_MASK[bit])
-            {
-              return false;
-            }
-
-        }
-    }
-
-  // It appears that the Ngram has been seen before
-  // NOTE: This answer is not 100% reliable. See the class comments for details
-  // on false drop probability
-
-  // BOOST_LOG_TRIVIAL(debug) <<
-  //   "BloomFilterThreaded Matched String!!! " << std::endl;
-
-  return(true);
-
+  return testBitIndeces(indeces);
 }
 
 /**
@@ -835,56 +921,5 @@ BloomFilterThreaded::contains(uint8_t const * data, size_t length)
 void
 BloomFilterThreaded::WriteCombined(BloomFilterThreaded &other,std::string output_file)
 {
-  if(!Compare(other) || (m_bitlength != other.m_bitlength) ||
-     (m_num_hashes != other.m_num_hashes))
-    {
-      BOOST_LOG_TRIVIAL(error) << "Bloom filters don't match. Aborting..."
-                               << std::endl;
-      exit(-1);
-    }
-
-  std::string serialized_header;
-
-  std::ostringstream out;
-
-  out << "IP_PROTOCOL_NUMBER = " << m_ip_protocol_num << std::endl;
-  out << "TCP_IP_PORT_NUM = " << m_port_num << std::endl;
-  out << "BITLENGTH = " << m_bitlength << std::endl;
-  out << "NUM_HASHES = " << m_num_hashes << std::endl;
-  out << "MIN_NGRAM_SIZE = " << m_min_ngram_size << std::endl;
-  out << "MAX_NGRAM_SIZE = " << m_max_ngram_size << std::endl;
-  out << "NUM_PAYLOAD_BYTES_PROCESSED = " << m_bytes_processed +
-      other.m_bytes_processed<< std::endl;
-  serialized_header = out.str();
-
-  const char *persist_filename = output_file.c_str();
-  std::ofstream bfStream(persist_filename,std::ios::out | std::ios::binary);
-
-  if(!bfStream)
-    {
-      BOOST_LOG_TRIVIAL(error) <<
-        "Unable to open: " << persist_filename << std::endl;
-      exit(-1);
-    }
-
-  const char *raw_bytes =
-    reinterpret_cast<const char *>(serialized_header.c_str());
-  unsigned int raw_size = serialized_header.size();
-
-  bfStream.write(raw_bytes,raw_size);
-  bfStream.write(Filler,HeaderLengthInBytes-raw_size);
-  //bfStream.close();
-  //exit(-1);
-  m_bf_stream.seekg(HeaderLengthInBytes);
-  other.m_bf_stream.seekg(HeaderLengthInBytes);
-
-  for(uint_fast64_t i=0;i<(m_bitlength>>3);i++)
-    {
-      uint_fast8_t val1,val2,rval;
-      m_bf_stream.read((char *)&val1,sizeof(val1));
-      other.m_bf_stream.read((char *)&val2,sizeof(val2));
-      rval = (val1 | val2);
-      bfStream.write((char *)&rval,sizeof(rval));
-    }
-  bfStream.close();
+  BloomFilterBase::WriteCombined(other,output_file);
 }
@@ -6,10 +6,9 @@
 #include <sstream>
 #include <fstream>
 #include <boost/log/trivial.hpp>
-#include <boost/regex.hpp>
 #include <boost/unordered_map.hpp>
 #include <fasguardfilter/BloomFilterUnthreaded.hh>
-#include "MurmurHash3.h"
+#include <fasguardfilter/MurmurHash3.h>
 
 /**
     @brief Seeds for #MAX_HASHES different hash functions.
@@ -160,19 +159,21 @@ static const unsigned char BIT_MASK[] = { 0x01,   //00000001
                                           0x40,   //01000000
                                           0x80 }; //10000000
 
-static char Filler[BloomFilterBase::HeaderLengthInBytes];
-static char HeaderBuffer[BloomFilterBase::HeaderLengthInBytes];
-
 BloomFilterUnthreaded::BloomFilterUnthreaded(size_t inserted_items,
                          double probability_false_positive,
                          int ip_protocol_num, int port_num, int min_ngram_size,
-                         int max_ngram_size) :
+                         int max_ngram_size, BloomLayout layout,
+                         BloomIndexMode index_mode,
+                         BloomHashFamily hash_family,
+                         BloomSizing sizing,
+                         BloomShortNgrams short_ngrams) :
   BloomFilterBase(inserted_items,probability_false_positive,ip_protocol_num,
-                  port_num,min_ngram_size,max_ngram_size)
+                  port_num,min_ngram_size,max_ngram_size,layout,index_mode,
+                  hash_family,sizing,short_ngrams)
 {
     // Initialize cache
 
-    m_calc_bit_indeces = CalcBitIndeces(m_num_hashes,m_bitlength);
+    m_calc_bit_indeces = makeCalcBitIndeces();
 
     BOOST_LOG_TRIVIAL(debug) << "Before Hash Construction" <<
       std::endl;
@@ -197,7 +198,17 @@ BloomFilterUnthreaded::BloomFilterUnthreaded(size_t inserted_items,
 BloomFilterUnthreaded::BloomFilterUnthreaded(const std::string &filename,
                                              bool from_mem_p) :
   BloomFilterBase(filename,from_mem_p)
-{}
+{
+  m_calc_bit_indeces = makeCalcBitIndeces();
+}
+
+BloomFilterUnthreaded::BloomFilterUnthreaded(const std::string &filename,
+                                             BloomLoadMode load_mode,
+                                             unsigned int mmap_hints) :
+  BloomFilterBase(filename,load_mode,mmap_hints)
+{
+  m_calc_bit_indeces = makeCalcBitIndeces();
+}
   /**
    * Destructor.
    */
@@ -211,68 +222,20 @@ BloomFilterUnthreaded::~BloomFilterUnthreaded()
 void
 BloomFilterUnthreaded::insert(uint8_t const * data, size_t length)
 {
-  size_t num_hash_func = m_num_hashes;
+  if(m_calc_bit_indeces.isExact(length))
+    {
+      insertSpan(NgramSpan(data,length));
+      return;
+    }
 
   std::string ngram((char *)data,length);
 
   const std::vector<uint64_t> &indeces =
     (*m_cache)(ngram);
 
-  // Process the Ngram with each hash function in our list.
-  //for(size_t i = 0 ; i < num_hash_func ; i++)
-  for(std::vector<uint64_t>::const_iterator it = indeces.begin();
-      it != indeces.end();
-      it++)
-    {
-      // compute the bit index into the Bloom filter where this Ngram will
-      // be marked
-      // unsigned long int bit_index = mHashFuncList[i](str,lgth) %
-      // (mFilterSizeBytes * CHAR_SIZE_BITS);
-      // uint64_t filterSizeInBits = m_bitlength;
-
-      // uint64_t hash_pair[2];
-      // MurmurHash3_x86_128(data,length,hash_seeds[i],hash_pair);
-      // uint64_t bit_index
-      //        = hash_pair[1] %
-      //        filterSizeInBits;
-
-      uint64_t bit_index = *it;
-      // mark the appropriate bit in the Bloom filter to indicate that this
-      // Ngram has been seen
-      if(m_blm_frm_mem)
-        {
-
-          if((bit_index / CHAR_SIZE_BITS) >= mBloomFilter.size())
-            {
-              BOOST_LOG_TRIVIAL(error) << "Bad index " <<
-                bit_index << (bit_index / CHAR_SIZE_BITS) <<
-                " greater than size " << mBloomFilter.size() << std::endl;
-              exit(-1);
-            }
-          mBloomFilter[bit_index / CHAR_SIZE_BITS] |=
-            BIT_MASK[bit_index % CHAR_SIZE_BITS];
-
-          // BOOST_LOG_TRIVIAL(debug) << "Turning bit " << std::dec <<
-          //   bit_index << " on" << " with mask " << std::hex <<
-          //   (unsigned int)BIT_MASK[bit_index % CHAR_SIZE_BITS] << std::endl;
-          // BOOST_LOG_TRIVIAL(debug) << "Entry: " << std::hex <<
-          //   (unsigned int)mBloomFilter[bit_index / CHAR_SIZE_BITS]
-          //                       << std::endl;
-
-
-        }
-      else
-        {
-          m_bf_stream.seekg(HeaderLengthInBytes+(bit_index / CHAR_SIZE_BITS));
-          unsigned char val;
-          m_bf_stream.read((char *)&val,1);
-          val |= BIT_MASK[bit_index % CHAR_SIZE_BITS];
-          m_bf_stream.seekp(HeaderLengthInBytes+(bit_index / CHAR_SIZE_BITS));
-          m_bf_stream.write((char *)&val,1);
-        }
-
-      //cout << "Hash: " << i << ",bit_index = " << bit_index << endl;
-    }
+  // mark the appropriate bits in the Bloom filter to indicate that this
+  // Ngram has been seen
+  setBitIndeces(indeces);
 }
 
 /**
@@ -284,84 +247,16 @@ BloomFilterUnthreaded::insert(uint8_t const * data, size_t length)
 bool
 BloomFilterUnthreaded::contains(uint8_t const * data, size_t length)
 {
-  // number of Ngram hash functions in our list
-  //bloom_filter *this_bloom = const_cast<bloom_filter *>(this);
-  const size_t num_hash_func = m_num_hashes;
+  // Concurrent lookups bypass the cache, which every lookup updates
+  if(m_concurrent_reads || m_calc_bit_indeces.isExact(length))
+    {
+      return containsSpan(NgramSpan(data,length));
+    }
 
   std::string ngram((char *)data,length);
 
-  //std::cout << "Before retrieving cache" << std::endl;
-
-  //std::cout.flush();
-
   const std::vector<uint64_t> &indeces =
     (*m_cache)(ngram);
 
-  //std::cout << "After retrieving cache" << std::endl;
-
-  //std::cout.flush();
-
-  // std::cout << "In contains, number hashes is " << num_hash_func <<
-  //   std::endl;
-  uint64_t filterSizeInBits =
-    m_bitlength;
-  // std::cout << "filterSizeInBits = " << filterSizeInBits << std::endl;
-
-  //mHashFuncList.size();
-
-  // Process the Ngram with each hash function and see if it exists in
-  // the Bloom filter. Notice that the Ngram is only declared to be
-  // contained by the Bloom filter if *all* the hash functions report
-  // its existence.
-  //  for(size_t i = 0 ; i < num_hash_func ; i++)
-  for(std::vector<uint64_t>::const_iterator it = indeces.begin();
-      it != indeces.end();
-      it++)
-   {
-      // bit index into the Bloom filter where this Ngram would have been marked
-      // by the i'th hash function
-      // uint64_t hash_pair[2];
-      // MurmurHash3_x86_128(data,length,hash_seeds[i],hash_pair);
-      // uint64_t bit_index
-      //        = hash_pair[1] %
-      //        filterSizeInBits;
-
-      // the bit index relative to the start of that byte
-      //uint64_t bit = bit_index % CHAR_SIZE_BITS;
-     uint64_t bit = *it % CHAR_SIZE_BITS;
-
-      // if the given bit index in the Bloom filter hasn't been marked, we
-      // definitely have never seen this Ngram before
-      if(m_blm_frm_mem)
-        {
-          //if((mBloomFilter[bit_index / CHAR_SIZE_BITS] & BIT_MASK[bit]) !=
-          if((mBloomFilter[*it / CHAR_SIZE_BITS] & BIT_MASK[bit]) !=
-             BIT_MASK[bit])
-            {
-              return(false);
-            }
-        }
-      else
-        {
-          //m_bf_stream.seekg(HeaderLengthInBytes+(bit_index / CHAR_SIZE_BITS));
-          m_bf_stream.seekg(HeaderLengthInBytes+(*it / CHAR_SIZE_BITS));
-          unsigned char val;
-          m_bf_stream.read((char *)&val,1);
-          if((val &  BIT_MASK[bit]) != BIT_MASK[bit])
-            {
-              return false;
-            }
-
-        }
-    }
-
-  // It appears that the Ngram has been seen before
-  // NOTE: This answer is not 100% reliable. See the class comments for details
-  // on false drop probability
-
-  // BOOST_LOG_TRIVIAL(debug) <<
-  //   "BloomFilter Matched String!!! " << std::endl;
-
-  return(true);
-
+  return testBitIndeces(indeces);
 }
@@ -0,0 +1,478 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <boost/log/trivial.hpp>
+#include <sys/mman.h>
+#include <fasguardfilter/CuckooNgramStorage.hh>
+#include <fasguardfilter/MurmurHash3.h>
+#include "StorageFile.hh"
+
+const std::string CuckooNgramStorage::FileFirstLine = "CUCKOO_FILTER";
+const double CuckooNgramStorage::MAX_LOAD_FACTOR = 0.95;
+
+/**
+ * Seed for the ngram hash. Any constant works, it only has to stay the same
+ * for the life of a file.
+ */
+static const uint32_t CuckooSeed = 0x62aaa4ef;
+
+/**
+ * Map a 64-bit hash to [0, range) with Lemire's multiply-shift.
+ */
+static inline uint64_t
+reduce(uint64_t hash, uint64_t range)
+{
+  return (uint64_t)(((unsigned __int128)hash * range) >> 64);
+}
+
+CuckooNgramStorage::CuckooNgramStorage(size_t projected_items,
+                                       double probability_false_positive,
+                                       int ip_protocol_num, int port_num,
+                                       int min_ngram_size,
+                                       int max_ngram_size) :
+  BenignNgramStorage(ip_protocol_num,port_num,min_ngram_size,max_ngram_size),
+  m_num_items(0),
+  m_victim_fingerprint(0),
+  m_victim_index(0),
+  m_kick_state(0x9e3779b97f4a7c15ULL),
+  m_slots(NULL),
+  m_load_mode(LOAD_MEMORY),
+  m_mmap_addr(NULL),
+  m_mmap_length(0)
+{
+  m_bytes_processed = 0;
+
+  // A lookup compares 2 * BUCKET_SIZE fingerprints, each of which matches a
+  // novel ngram with probability 2^-f.
+  m_fingerprint_bits =
+    (unsigned int)ceil(log2(2.0 * BUCKET_SIZE / probability_false_positive));
+  if(m_fingerprint_bits < MIN_FINGERPRINT_BITS)
+    {
+      m_fingerprint_bits = MIN_FINGERPRINT_BITS;
+    }
+  else if(m_fingerprint_bits > MAX_FINGERPRINT_BITS)
+    {
+      m_fingerprint_bits = MAX_FINGERPRINT_BITS;
+    }
+
+  m_num_buckets = (uint64_t)ceil((double)projected_items /
+                                 (BUCKET_SIZE * MAX_LOAD_FACTOR));
+  if(m_num_buckets < 1)
+    {
+      m_num_buckets = 1;
+    }
+  BOOST_LOG_TRIVIAL(debug) << "Cuckoo buckets: " << m_num_buckets <<
+    " fingerprint bits: " << m_fingerprint_bits << std::endl;
+
+  m_slot_array.resize(slotBytes(),0);
+  m_slots = m_slot_array.data();
+}
+
+CuckooNgramStorage::CuckooNgramStorage(const std::string &filename,
+                                       BloomLoadMode load_mode,
+                                       unsigned int mmap_hints) :
+  m_num_buckets(0),
+  m_fingerprint_bits(0),
+  m_num_items(0),
+  m_victim_fingerprint(0),
+  m_victim_index(0),
+  m_kick_state(0x9e3779b97f4a7c15ULL),
+  m_slots(NULL),
+  m_load_mode((load_mode == LOAD_MMAP) ? LOAD_MMAP : LOAD_MEMORY),
+  m_mmap_addr(NULL),
+  m_mmap_length(0)
+{
+  m_insertions = 0;
+  m_unique_insertions = 0;
+  m_bytes_processed = 0;
+
+  std::ifstream cf_stream(filename.c_str(),std::ios::in | std::ios::binary);
+
+  if(!cf_stream)
+    {
+      BOOST_LOG_TRIVIAL(error) << "Unable to open: " <<
+        filename << std::endl;
+      exit(-1);
+    }
+
+  std::map<std::string,std::string> properties;
+
+  if(!StorageFile::readTextHeader(cf_stream,FileFirstLine,properties))
+    {
+      BOOST_LOG_TRIVIAL(error) << "Not a cuckoo filter: " <<
+        filename << std::endl;
+      exit(-1);
+    }
+
+  std::map<std::string,std::string> cf_properties;
+
+  for(std::map<std::string,std::string>::const_iterator cit =
+        properties.begin() ; cit != properties.end() ; cit++)
+    {
+      const std::string &key = cit->first;
+      const std::string &value = cit->second;
+
+      if(key.compare("NUM_BUCKETS") == 0)
+        {
+          std::istringstream(value) >> m_num_buckets;
+        }
+      else if(key.compare("FINGERPRINT_BITS") == 0)
+        {
+          std::istringstream(value) >> m_fingerprint_bits;
+        }
+      else if(key.compare("NUM_ITEMS") == 0)
+        {
+          std::istringstream(value) >> m_num_items;
+        }
+      else if(key.compare("VICTIM_FINGERPRINT") == 0)
+        {
+          std::istringstream(value) >> m_victim_fingerprint;
+        }
+      else if(key.compare("VICTIM_INDEX") == 0)
+        {
+          std::istringstream(value) >> m_victim_index;
+        }
+      else if(key.compare("BUCKET_SIZE") == 0)
+        {
+          unsigned int bucket_size = 0;
+
+          std::istringstream(value) >> bucket_size;
+          if(bucket_size != BUCKET_SIZE)
+            {
+              BOOST_LOG_TRIVIAL(error) << "Unsupported BUCKET_SIZE: " <<
+                bucket_size << std::endl;
+              exit(-1);
+            }
+        }
+      else
+        {
+          cf_properties[key] = value;
+        }
+    }
+  loadParams(cf_properties); // Load params for BenignNgramStorage
+
+  if(m_num_buckets < 1 || m_fingerprint_bits < MIN_FINGERPRINT_BITS ||
+     m_fingerprint_bits > MAX_FINGERPRINT_BITS)
+    {
+      BOOST_LOG_TRIVIAL(error) << "Bad cuckoo filter header: " <<
+        filename << std::endl;
+      exit(-1);
+    }
+
+  if(m_load_mode == LOAD_MMAP)
+    {
+      cf_stream.close();
+      mapSlots(filename,mmap_hints);
+      return;
+    }
+
+  m_slot_array.resize(slotBytes(),0);
+  m_slots = m_slot_array.data();
+  cf_stream.seekg(BloomFilterBase::HeaderLengthInBytes);
+  cf_stream.read((char *)m_slots,m_slot_array.size());
+  if(!cf_stream)
+    {
+      BOOST_LOG_TRIVIAL(error) << "Cuckoo filter file too short: " <<
+        filename << std::endl;
+      exit(-1);
+    }
+}
+
+CuckooNgramStorage::~CuckooNgramStorage()
+{
+  if(m_mmap_addr != NULL)
+    {
+      munmap(m_mmap_addr,m_mmap_length);
+    }
+}
+
+void
+CuckooNgramStorage::mapSlots(const std::string &filename,
+                             unsigned int mmap_hints)
+{
+  m_mmap_length = BloomFilterBase::HeaderLengthInBytes + slotBytes();
+  m_mmap_addr = StorageFile::mapFile(filename,m_mmap_length,mmap_hints);
+  m_slots = (uint8_t *)m_mmap_addr + BloomFilterBase::HeaderLengthInBytes;
+}
+
+size_t
+CuckooNgramStorage::slotBytes() const
+{
+  uint64_t bits = m_num_buckets * BUCKET_SIZE * m_fingerprint_bits;
+
+  return (bits + 7) / 8 + sizeof(uint64_t);
+}
+
+void
+CuckooNgramStorage::locate(uint8_t const * data, size_t length,
+                           uint64_t &index, uint32_t &fingerprint) const
+{
+  uint64_t hash_pair[2];
+
+  MurmurHash3_x86_128(data,length,CuckooSeed,hash_pair);
+  index = reduce(hash_pair[0],m_num_buckets);
+
+  // Zero marks an empty slot
+  fingerprint = (uint32_t)(hash_pair[1] >> (64 - m_fingerprint_bits));
+  if(fingerprint == 0)
+    {
+      fingerprint = 1;
+    }
+}
+
+uint64_t
+CuckooNgramStorage::altIndex(uint64_t index, uint32_t fingerprint) const
+{
+  // (h - index) mod n is its own inverse, so either bucket of a fingerprint
+  // leads to the other.
+  uint64_t h = reduce(fmix64(fingerprint),m_num_buckets);
+
+  return (h >= index) ? h - index : h + m_num_buckets - index;
+}
+
+uint32_t
+CuckooNgramStorage::getSlot(uint64_t index, unsigned int slot) const
+{
+  uint64_t bit = (index * BUCKET_SIZE + slot) * m_fingerprint_bits;
+  uint64_t word;
+
+  memcpy(&word,m_slots + bit / 8,sizeof(word));
+  return (uint32_t)((word >> (bit % 8)) &
+                    ((1ULL << m_fingerprint_bits) - 1));
+}
+
+void
+CuckooNgramStorage::setSlot(uint64_t index, unsigned int slot,
+                            uint32_t fingerprint)
+{
+  uint64_t bit = (index * BUCKET_SIZE + slot) * m_fingerprint_bits;
+  uint64_t mask = ((1ULL << m_fingerprint_bits) - 1) << (bit % 8);
+  uint64_t word;
+
+  memcpy(&word,m_slots + bit / 8,sizeof(word));
+  word = (word & ~mask) | (((uint64_t)fingerprint << (bit % 8)) & mask);
+  memcpy(m_slots + bit / 8,&word,sizeof(word));
+}
+
+bool
+CuckooNgramStorage::bucketContains(uint64_t index,
+                                   uint32_t fingerprint) const
+{
+  for(unsigned int slot = 0 ; slot < BUCKET_SIZE ; slot++)
+    {
+      if(getSlot(index,slot) == fingerprint)
+        {
+          return true;
+        }
+    }
+  return false;
+}
+
+bool
+CuckooNgramStorage::bucketInsert(uint64_t index, uint32_t fingerprint)
+{
+  for(unsigned int slot = 0 ; slot < BUCKET_SIZE ; slot++)
+    {
+      if(getSlot(index,slot) == 0)
+        {
+          setSlot(index,slot,fingerprint);
+          return true;
+        }
+    }
+  return false;
+}
+
+void
+CuckooNgramStorage::insert(uint8_t const * data, size_t length)
+{
+  insertSpan(NgramSpan(data,length));
+}
+
+bool
+CuckooNgramStorage::contains(uint8_t const * data, size_t length)
+{
+  return containsSpan(NgramSpan(data,length));
+}
+
+void
+CuckooNgramStorage::insertSpan(const NgramSpan &ngram)
+{
+  if(m_load_mode == LOAD_MMAP)
+    {
+      BOOST_LOG_TRIVIAL(error) << "Cannot insert into a memory mapped "
+        "cuckoo filter" << std::endl;
+      exit(-1);
+    }
+
+  uint64_t index;
+  uint32_t fingerprint;
+
+  locate(ngram.data,ngram.length,index,fingerprint);
+
+  uint64_t alt_index = altIndex(index,fingerprint);
+
+  if(bucketContains(index,fingerprint) ||
+     bucketContains(alt_index,fingerprint) ||
+     (m_victim_fingerprint == fingerprint &&
+      (m_victim_index == index || m_victim_index == alt_index)))
+    {
+      return;
+    }
+
+  if(m_victim_fingerprint != 0)
+    {
+      BOOST_LOG_TRIVIAL(error) << "Cuckoo filter is full after " <<
+        m_num_items << " items. Increase the number of insertions." <<
+        std::endl;
+      exit(-1);
+    }
+
+  m_num_items++;
+  if(bucketInsert(index,fingerprint) || bucketInsert(alt_index,fingerprint))
+    {
+      return;
+    }
+
+  // Both buckets are full: evict fingerprints to their other bucket until
+  // one finds room.
+  for(unsigned int kick = 0 ; kick < MAX_KICKS ; kick++)
+    {
+      m_kick_state ^= m_kick_state << 13;
+      m_kick_state ^= m_kick_state >> 7;
+      m_kick_state ^= m_kick_state << 17;
+
+      unsigned int slot = m_kick_state % BUCKET_SIZE;
+      uint32_t evicted = getSlot(alt_index,slot);
+
+      setSlot(alt_index,slot,fingerprint);
+      fingerprint = evicted;
+      alt_index = altIndex(alt_index,fingerprint);
+      if(bucketInsert(alt_index,fingerprint))
+        {
+          return;
+        }
+    }
+
+  m_victim_fingerprint = fingerprint;
+  m_victim_index = alt_index;
+}
+
+bool
+CuckooNgramStorage::containsSpan(const NgramSpan &ngram)
+{
+  uint64_t index;
+  uint32_t fingerprint;
+
+  locate(ngram.data,ngram.length,index,fingerprint);
+
+  uint64_t alt_index = altIndex(index,fingerprint);
+
+  return bucketContains(index,fingerprint) ||
+    bucketContains(alt_index,fingerprint) ||
+    (m_victim_fingerprint == fingerprint &&
+     (m_victim_index == index || m_victim_index == alt_index));
+}
+
+void
+CuckooNgramStorage::containsBatch(const std::vector<NgramSpan> &ngrams,
+                                  std::vector<bool> &results)
+{
+  results.resize(ngrams.size());
+
+  // Two groups: one being prefetched while the other is resolved
+  uint64_t indeces[2][BATCH_GROUP_SIZE][2];
+  uint32_t fingerprints[2][BATCH_GROUP_SIZE];
+  size_t num_groups =
+    (ngrams.size() + BATCH_GROUP_SIZE - 1) / BATCH_GROUP_SIZE;
+
+  for(size_t group = 0 ; group <= num_groups ; group++)
+    {
+      if(group < num_groups)
+        {
+          size_t first = group * BATCH_GROUP_SIZE;
+          size_t last = std::min(first + BATCH_GROUP_SIZE,ngrams.size());
+
+          for(size_t i = first ; i < last ; i++)
+            {
+              uint64_t (&bucket)[2] = indeces[group % 2][i - first];
+              uint32_t &fingerprint = fingerprints[group % 2][i - first];
+
+              locate(ngrams[i].data,ngrams[i].length,bucket[0],fingerprint);
+              bucket[1] = altIndex(bucket[0],fingerprint);
+              for(size_t j = 0 ; j < 2 ; j++)
+                {
+                  __builtin_prefetch(m_slots + (bucket[j] * BUCKET_SIZE *
+                                                m_fingerprint_bits) / 8);
+                }
+            }
+        }
+      if(group > 0)
+        {
+          size_t first = (group - 1) * BATCH_GROUP_SIZE;
+          size_t last = std::min(first + BATCH_GROUP_SIZE,ngrams.size());
+
+          for(size_t i = first ; i < last ; i++)
+            {
+              const uint64_t (&bucket)[2] =
+                indeces[(group - 1) % 2][i - first];
+              uint32_t fingerprint = fingerprints[(group - 1) % 2][i - first];
+
+              results[i] = bucketContains(bucket[0],fingerprint) ||
+                bucketContains(bucket[1],fingerprint) ||
+                (m_victim_fingerprint == fingerprint &&
+                 (m_victim_index == bucket[0] ||
+                  m_victim_index == bucket[1]));
+            }
+        }
+    }
+}
+
+bool
+CuckooNgramStorage::flush(std::string filename)
+{
+  std::ostringstream out;
+
+  out << FileFirstLine << std::endl;
+  out << "IP_PROTOCOL_NUMBER = " << m_ip_protocol_num << std::endl;
+  out << "TCP_IP_PORT_NUM = " << m_port_num << std::endl;
+  out << "MIN_NGRAM_SIZE = " << m_min_ngram_size << std::endl;
+  out << "MAX_NGRAM_SIZE = " << m_max_ngram_size << std::endl;
+  out << "NUM_PAYLOAD_BYTES_PROCESSED = " << m_bytes_processed << std::endl;
+  out << "NUM_BUCKETS = " << m_num_buckets << std::endl;
+  out << "BUCKET_SIZE = " << BUCKET_SIZE << std::endl;
+  out << "FINGERPRINT_BITS = " << m_fingerprint_bits << std::endl;
+  out << "NUM_ITEMS = " << m_num_items << std::endl;
+  out << "VICTIM_FINGERPRINT = " << m_victim_fingerprint << std::endl;
+  out << "VICTIM_INDEX = " << m_victim_index << std::endl;
+
+  std::string serialized_header = out.str();
+  std::ofstream cfStream(filename.c_str(),std::ios::out | std::ios::binary);
+
+  if(!cfStream)
+    {
+      BOOST_LOG_TRIVIAL(error) <<
+        "Unable to open: " << filename << std::endl;
+      return false;
+    }
+
+  BOOST_LOG_TRIVIAL(debug) << "Cuckoo filter load: " <<
+    (double)m_num_items / (m_num_buckets * BUCKET_SIZE) << std::endl;
+
+  StorageFile::writeTextHeader(cfStream,serialized_header);
+  cfStream.write((const char *)m_slots,slotBytes());
+  cfStream.close();
+  return true;
+}
+
+bool
+CuckooNgramStorage::isCuckooFile(const std::string &filename)
+{
+  return StorageFile::isTextHeaderFile(filename,FileFirstLine);
+}
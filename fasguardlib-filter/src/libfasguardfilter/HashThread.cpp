@@ -9,145 +9,123 @@
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <fasguardfilter/HashThread.hh>
 
-
-static boost::atomic<unsigned int> ngram_total;
-
-HashThread::HashThread(boost::lockfree::queue<TrivString,
-                       boost::lockfree::fixed_sized<true> > &ngram_q,
-                       boost::lockfree::queue<BloomOffsetBlock,
-                       boost::lockfree::fixed_sized<true> > &bit_index_q,
+HashThread::HashThread(SpscRing<PayloadChunkPtr> &chunk_q,
+                       uint8_t *bits,
+                       uint_fast64_t bitlength,
+                       BloomFilterBase::bit_array_type *partial,
                        const CalcBitIndeces &c_bit_i,
                        boost::atomic<bool> &done,
-                       boost::atomic<unsigned int> &shutdown_thread_count,
+                       EventCount &chunk_ready,
+                       EventCount &ring_space,
                        unsigned int thread_index) :
-  m_ngram_q(ngram_q), m_bit_index_q(bit_index_q), m_calc_bit_indeces(c_bit_i),
-  m_done(done),m_shutdown_thread_count(shutdown_thread_count),
+  m_chunk_q(chunk_q), m_bits(bits), m_bitlength(bitlength),
+  m_partial(partial),
+  m_calc_bit_indeces(c_bit_i),
+  m_done(done),m_chunk_ready(chunk_ready),m_ring_space(ring_space),
   m_thread_index(thread_index)
-{
-  ngram_total = 0;
-    m_cache = boost::shared_ptr<lru_cache_using_std<
-                                  CalcBitIndeces,
-                                  std::string,
-                                  std::vector<uint64_t>,
-                                  boost::unordered_map> >(new
-                                              lru_cache_using_std<
-                                              CalcBitIndeces,
-                                              std::string,
-                                              std::vector<uint64_t>,
-                                              boost::unordered_map>(m_calc_bit_indeces,
-                                                                    BloomFilterBase::NUM_CACHE_ENTRIES));
-    (*m_cache).setEmptyReturnFlag();
-}
+{}
+
 void
-HashThread::operator()()
+HashThread::setBits(const uint64_t *bit_indeces, size_t num_indeces)
 {
-  // Get ngram off of queue
-
-  TrivString ngram;
-  while(!m_done)
+  for(size_t i = 0 ; i < num_indeces ; i++)
     {
-      while(m_ngram_q.pop(ngram))
+      uint64_t bit_index = bit_indeces[i];
+      if(bit_index >= m_bitlength)
         {
-          if((ngram_total % 10000000) == 0)
-            {
-              BOOST_LOG_TRIVIAL(debug) << "HashThread Ngram TOTAL: " <<
-                ngram_total <<
-                std::endl;
-              BOOST_LOG_TRIVIAL(debug) << "HashThread #" <<
-                m_thread_index << " misses: " <<
-                (*m_cache).getNumMisses() <<
-                " hits: " <<
-                (*m_cache).getNumHits() <<
-                std::endl;
-            }
-          ngram_total++;
-          std::string ngram_str(ngram.string,ngram.length);
-          const std::vector<uint64_t> &results =
-            (*m_cache)(ngram_str);
-
-          // If we've seen the string before, it's already in the Bloom filter
-          if((*m_cache).getHitFlag())
-            {
-              continue;
-            }
+          BOOST_LOG_TRIVIAL(error) << "Bad index " <<
+            bit_index << " greater than size " << m_bitlength << std::endl;
+          exit(-1);
+        }
+      uint8_t *byte = m_bits + bit_index / BloomFilterBase::CHAR_SIZE_BITS;
+      uint8_t mask =
+        BloomFilterBase::BIT_MASK[bit_index % BloomFilterBase::CHAR_SIZE_BITS];
 
-          std::vector<uint64_t>::const_iterator citer = results.begin();
-          BloomOffsetBlock bob;
-          unsigned int block_cnt = 0;
-          while(citer != results.end())
-            {
-              bob.offsets[block_cnt++] = *citer;
-              if(block_cnt == BloomOffsetBlockSize)
-                {
-                  bob.num_elems = BloomOffsetBlockSize;
-                  while(!m_bit_index_q.push(bob))
-                    {
-                      boost::this_thread::
-                        sleep_for(boost::chrono::microseconds(SleepTimeMicroS));
-                    }
+      if(m_partial != NULL)
+        {
+          // Only this thread writes to its partial filter
+          *byte |= mask;
+          continue;
+        }
 
-                  block_cnt = 0;
-                }
-              citer++;
-            }
-          if(block_cnt > 0)
-            {
-              bob.num_elems = block_cnt;
-              while(!m_bit_index_q.push(bob))
-                {
-                  boost::this_thread::
-                    sleep_for(boost::chrono::microseconds(SleepTimeMicroS));
-                }
-            }
+      // Most bits are already on once the filter fills up. Checking first
+      // avoids taking the cache line away from the other threads.
+      if((__atomic_load_n(byte,__ATOMIC_RELAXED) & mask) == 0)
+        {
+          __atomic_fetch_or(byte,mask,__ATOMIC_RELAXED);
         }
-      boost::this_thread::sleep_for(boost::chrono::milliseconds(SleepTimeMilS));
     }
+}
 
-BOOST_LOG_TRIVIAL(debug) << "m_done is " <<
-  m_done <<
-  std::endl;
+void
+HashThread::processChunk(const PayloadChunk &chunk)
+{
+  size_t num_hashes = m_calc_bit_indeces.getNumHashFunc();
 
-  // After we're done, finish cleaning things out
-  while(m_ngram_q.pop(ngram))
+  for(size_t i = 0 ; i < chunk.segments.size() ; i++)
     {
-      std::string ngram_str(ngram.string,ngram.length);
-      const std::vector<uint64_t> &results =
-        (*m_cache)(ngram_str);
+      const PayloadSegment &seg = chunk.segments[i];
 
-      std::vector<uint64_t>::const_iterator iter = results.begin();
-      BloomOffsetBlock bob;
-      unsigned int block_cnt = 0;
+      m_calc_bit_indeces.payloadIndeces(&chunk.bytes[seg.offset],seg.length,
+                                        seg.min_ngram_size,
+                                        seg.max_ngram_size,
+                                        [this,num_hashes]
+                                        (const uint64_t *bit_indeces)
+                                        {
+                                          setBits(bit_indeces,num_hashes);
+                                        });
+    }
+}
+
+void
+HashThread::operator()()
+{
+  // Get chunk off of queue
 
-      while(iter != results.end())
+  if(m_partial != NULL)
+    {
+      // Allocated here so that the pages are first touched, and so placed,
+      // by the thread that fills them
+      if(m_partial->empty())
         {
-          bob.offsets[block_cnt++] = *iter;
-          if(block_cnt == BloomOffsetBlockSize)
-            {
-              while(!m_bit_index_q.push(bob))
-                {
-                  boost::this_thread::
-                    sleep_for(boost::chrono::microseconds(SleepTimeMicroS));
-                }
-              bob.num_elems = BloomOffsetBlockSize;
-              block_cnt = 0;
-            }
+          m_partial->resize(m_bitlength / BloomFilterBase::CHAR_SIZE_BITS,0);
+        }
+      m_bits = m_partial->data();
+    }
+
+  PayloadChunkPtr chunk;
+  SpscRing<PayloadChunkPtr> &chunk_q = m_chunk_q;
+  boost::atomic<bool> &done = m_done;
 
-          iter++;
+  for(;;)
+    {
+      while(m_chunk_q.pop(chunk))
+        {
+          m_ring_space.notify();
+          processChunk(*chunk);
+          chunk.reset();
         }
-      if(block_cnt > 0)
+
+      // The producer sets m_done after its last chunk, so once it is seen
+      // one more pass empties the ring for good.
+      if(m_done)
         {
-          bob.num_elems = block_cnt;
-          while(!m_bit_index_q.push(bob))
-            {
-              boost::this_thread::
-                sleep_for(boost::chrono::microseconds(SleepTimeMicroS));
-            }
+          break;
         }
+      m_chunk_ready.wait([&chunk_q,&done]()
+                         {
+                           return !chunk_q.empty() || done;
+                         });
+    }
 
+  // After we're done, finish cleaning things out
+  while(m_chunk_q.pop(chunk))
+    {
+      processChunk(*chunk);
+      chunk.reset();
     }
 
-  m_shutdown_thread_count++;
   BOOST_LOG_TRIVIAL(debug) << "Shutting down thread " <<
-    m_shutdown_thread_count <<
+    m_thread_index <<
     std::endl;
 }
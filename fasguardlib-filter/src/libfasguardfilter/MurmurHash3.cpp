@@ -11,7 +11,7 @@
 // compile and run any of them on any platform, but your performance with the
 // non-native version will be less than optimal.
 
-#include "MurmurHash3.h"
+#include <fasguardfilter/MurmurHash3.h>
 
 //-----------------------------------------------------------------------------
 // Platform-specific functions and macros
@@ -80,19 +80,6 @@ FORCE_INLINE uint32_t fmix32 ( uint32_t h )
   return h;
 }
 
-//----------
-
-FORCE_INLINE uint64_t fmix64 ( uint64_t k )
-{
-  k ^= k >> 33;
-  k *= BIG_CONSTANT(0xff51afd7ed558ccd);
-  k ^= k >> 33;
-  k *= BIG_CONSTANT(0xc4ceb9fe1a85ec53);
-  k ^= k >> 33;
-
-  return k;
-}
-
 //-----------------------------------------------------------------------------
 
 void MurmurHash3_x86_32 ( const void * key, int len,
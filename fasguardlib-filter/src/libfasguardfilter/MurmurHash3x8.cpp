@@ -0,0 +1,225 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+//-----------------------------------------------------------------------------
+// Eight-lane MurmurHash3_x86_128 for keys that all have the same length.
+//
+// Each 32-bit state word of MurmurHash3_x86_128 is held for eight keys in
+// one AVX2 register, so eight keys are hashed in about the time of one. The
+// result for every key is bit-for-bit what MurmurHash3_x86_128 produces.
+// CPUs without AVX2, and other architectures, hash the keys one at a time.
+
+#include <string.h>
+#include <fasguardfilter/MurmurHash3.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define MURMUR3_X8_AVX2 1
+#include <immintrin.h>
+#endif
+
+//-----------------------------------------------------------------------------
+
+static void MurmurHash3_x86_128_x8_scalar ( const void * const keys[8],
+                                            int len, uint32_t seed,
+                                            void * out )
+{
+  for(int lane = 0; lane < 8; lane++)
+  {
+    MurmurHash3_x86_128(keys[lane],len,seed,(uint8_t *)out + 16*lane);
+  }
+}
+
+#ifdef MURMUR3_X8_AVX2
+
+#define X8_TARGET __attribute__((target("avx2")))
+
+X8_TARGET static inline __m256i rotl32x8 ( __m256i x, int r )
+{
+  return _mm256_or_si256(_mm256_slli_epi32(x,r),_mm256_srli_epi32(x,32 - r));
+}
+
+X8_TARGET static inline __m256i mul32x8 ( __m256i x, uint32_t c )
+{
+  return _mm256_mullo_epi32(x,_mm256_set1_epi32((int)c));
+}
+
+X8_TARGET static inline __m256i fmix32x8 ( __m256i h )
+{
+  h = _mm256_xor_si256(h,_mm256_srli_epi32(h,16));
+  h = mul32x8(h,0x85ebca6b);
+  h = _mm256_xor_si256(h,_mm256_srli_epi32(h,13));
+  h = mul32x8(h,0xc2b2ae35);
+  h = _mm256_xor_si256(h,_mm256_srli_epi32(h,16));
+
+  return h;
+}
+
+// Word w of every key, starting at byte offset off
+X8_TARGET static inline __m256i load32x8 ( const uint8_t * const p[8],
+                                           int off )
+{
+  uint32_t w[8];
+
+  for(int lane = 0; lane < 8; lane++)
+  {
+    memcpy(&w[lane],p[lane] + off,4);
+  }
+  return _mm256_loadu_si256((const __m256i *)w);
+}
+
+X8_TARGET static inline __m256i mix_k ( __m256i k, uint32_t ca, int r,
+                                        uint32_t cb )
+{
+  k = mul32x8(k,ca);
+  k = rotl32x8(k,r);
+  k = mul32x8(k,cb);
+
+  return k;
+}
+
+X8_TARGET static void MurmurHash3_x86_128_x8_avx2 ( const void * const keys[8],
+                                                    int len, uint32_t seed,
+                                                    void * out )
+{
+  const uint8_t * data[8];
+  const int nblocks = len / 16;
+
+  for(int lane = 0; lane < 8; lane++)
+  {
+    data[lane] = (const uint8_t *)keys[lane];
+  }
+
+  __m256i h1 = _mm256_set1_epi32((int)seed);
+  __m256i h2 = h1;
+  __m256i h3 = h1;
+  __m256i h4 = h1;
+
+  const uint32_t c1 = 0x239b961b;
+  const uint32_t c2 = 0xab0e9789;
+  const uint32_t c3 = 0x38b34ae5;
+  const uint32_t c4 = 0xa1e38b93;
+
+  //----------
+  // body
+
+  for(int i = 0; i < nblocks; i++)
+  {
+    __m256i k1 = load32x8(data,i*16 + 0);
+    __m256i k2 = load32x8(data,i*16 + 4);
+    __m256i k3 = load32x8(data,i*16 + 8);
+    __m256i k4 = load32x8(data,i*16 + 12);
+
+    h1 = _mm256_xor_si256(h1,mix_k(k1,c1,15,c2));
+    h1 = rotl32x8(h1,19); h1 = _mm256_add_epi32(h1,h2);
+    h1 = _mm256_add_epi32(mul32x8(h1,5),_mm256_set1_epi32(0x561ccd1b));
+
+    h2 = _mm256_xor_si256(h2,mix_k(k2,c2,16,c3));
+    h2 = rotl32x8(h2,17); h2 = _mm256_add_epi32(h2,h3);
+    h2 = _mm256_add_epi32(mul32x8(h2,5),_mm256_set1_epi32(0x0bcaa747));
+
+    h3 = _mm256_xor_si256(h3,mix_k(k3,c3,17,c4));
+    h3 = rotl32x8(h3,15); h3 = _mm256_add_epi32(h3,h4);
+    h3 = _mm256_add_epi32(mul32x8(h3,5),_mm256_set1_epi32(0x96cd1c35));
+
+    h4 = _mm256_xor_si256(h4,mix_k(k4,c4,18,c1));
+    h4 = rotl32x8(h4,13); h4 = _mm256_add_epi32(h4,h1);
+    h4 = _mm256_add_epi32(mul32x8(h4,5),_mm256_set1_epi32(0x32ac3b17));
+  }
+
+  //----------
+  // tail
+
+  // The tail words are the remaining bytes read little-endian with zero
+  // padding, which is what the byte-wise switch of the scalar version builds.
+  const int tail_len = len & 15;
+
+  if(tail_len)
+  {
+    uint8_t padded[8][16];
+    const uint8_t * tail[8];
+
+    for(int lane = 0; lane < 8; lane++)
+    {
+      memset(padded[lane],0,16);
+      memcpy(padded[lane],data[lane] + nblocks*16,tail_len);
+      tail[lane] = padded[lane];
+    }
+
+    if(tail_len > 12)
+    {
+      h4 = _mm256_xor_si256(h4,mix_k(load32x8(tail,12),c4,18,c1));
+    }
+    if(tail_len > 8)
+    {
+      h3 = _mm256_xor_si256(h3,mix_k(load32x8(tail,8),c3,17,c4));
+    }
+    if(tail_len > 4)
+    {
+      h2 = _mm256_xor_si256(h2,mix_k(load32x8(tail,4),c2,16,c3));
+    }
+    h1 = _mm256_xor_si256(h1,mix_k(load32x8(tail,0),c1,15,c2));
+  }
+
+  //----------
+  // finalization
+
+  const __m256i vlen = _mm256_set1_epi32(len);
+
+  h1 = _mm256_xor_si256(h1,vlen); h2 = _mm256_xor_si256(h2,vlen);
+  h3 = _mm256_xor_si256(h3,vlen); h4 = _mm256_xor_si256(h4,vlen);
+
+  h1 = _mm256_add_epi32(h1,h2); h1 = _mm256_add_epi32(h1,h3);
+  h1 = _mm256_add_epi32(h1,h4);
+  h2 = _mm256_add_epi32(h2,h1); h3 = _mm256_add_epi32(h3,h1);
+  h4 = _mm256_add_epi32(h4,h1);
+
+  h1 = fmix32x8(h1);
+  h2 = fmix32x8(h2);
+  h3 = fmix32x8(h3);
+  h4 = fmix32x8(h4);
+
+  h1 = _mm256_add_epi32(h1,h2); h1 = _mm256_add_epi32(h1,h3);
+  h1 = _mm256_add_epi32(h1,h4);
+  h2 = _mm256_add_epi32(h2,h1); h3 = _mm256_add_epi32(h3,h1);
+  h4 = _mm256_add_epi32(h4,h1);
+
+  // Transpose back to four words per key
+  uint32_t r1[8], r2[8], r3[8], r4[8];
+
+  _mm256_storeu_si256((__m256i *)r1,h1);
+  _mm256_storeu_si256((__m256i *)r2,h2);
+  _mm256_storeu_si256((__m256i *)r3,h3);
+  _mm256_storeu_si256((__m256i *)r4,h4);
+
+  for(int lane = 0; lane < 8; lane++)
+  {
+    uint32_t * o = (uint32_t *)((uint8_t *)out + 16*lane);
+
+    o[0] = r1[lane];
+    o[1] = r2[lane];
+    o[2] = r3[lane];
+    o[3] = r4[lane];
+  }
+}
+
+#endif // MURMUR3_X8_AVX2
+
+//-----------------------------------------------------------------------------
+
+void MurmurHash3_x86_128_x8 ( const void * const keys[8], int len,
+                              uint32_t seed, void * out )
+{
+#ifdef MURMUR3_X8_AVX2
+  static const bool have_avx2 = __builtin_cpu_supports("avx2");
+
+  if(have_avx2)
+  {
+    MurmurHash3_x86_128_x8_avx2(keys,len,seed,out);
+    return;
+  }
+#endif
+  MurmurHash3_x86_128_x8_scalar(keys,len,seed,out);
+}
+
+//-----------------------------------------------------------------------------
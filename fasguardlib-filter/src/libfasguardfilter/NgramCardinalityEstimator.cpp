@@ -0,0 +1,225 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <boost/log/trivial.hpp>
+#include <fasguardfilter/NgramCardinalityEstimator.hh>
+#include <fasguardfilter/MurmurHash3.h>
+
+const unsigned int NgramCardinalityEstimator::DEFAULT_PRECISION;
+const unsigned int NgramCardinalityEstimator::MIN_PRECISION;
+const unsigned int NgramCardinalityEstimator::MAX_PRECISION;
+
+/**
+ * Seed for the ngram hash.
+ */
+static const uint32_t NgramKeySeed = 0x6a09e667;
+
+/**
+ * Bytes allocated at a time for the reservoir. Whole chunks are allocated
+ * up front so that the reservoir never has to be copied to grow it.
+ */
+static const size_t ReservoirChunkBytes = 1 << 20;
+
+NgramCardinalityEstimator::NgramCardinalityEstimator(int ip_protocol_num,
+                                                     int port_num,
+                                                     int min_ngram_size,
+                                                     int max_ngram_size,
+                                                     unsigned int precision,
+                                                     size_t reservoir_bytes) :
+  BenignNgramStorage(ip_protocol_num,port_num,min_ngram_size,max_ngram_size),
+  m_precision(precision),
+  m_reservoir_used(0),
+  m_reservoir_bytes(reservoir_bytes),
+  m_reservoir_overflowed(false)
+{
+  m_bytes_processed = 0;
+  if(m_min_ngram_size < 1 || m_max_ngram_size < m_min_ngram_size ||
+     m_precision < MIN_PRECISION || m_precision > MAX_PRECISION)
+    {
+      BOOST_LOG_TRIVIAL(error) << "Bad ngram cardinality estimator "
+        "parameters: ngram sizes " << m_min_ngram_size << " to " <<
+        m_max_ngram_size << ", precision " << m_precision << std::endl;
+      exit(-1);
+    }
+  m_registers.resize(m_max_ngram_size - m_min_ngram_size + 1,
+                     std::vector<uint8_t>((size_t)1 << m_precision,0));
+}
+
+NgramCardinalityEstimator::~NgramCardinalityEstimator()
+{}
+
+void
+NgramCardinalityEstimator::insert(uint8_t const * data, size_t length)
+{
+  insertSpan(NgramSpan(data,length));
+}
+
+bool
+NgramCardinalityEstimator::contains(uint8_t const *, size_t)
+{
+  return false;
+}
+
+void
+NgramCardinalityEstimator::insertSpan(const NgramSpan &ngram)
+{
+  if(ngram.length < (size_t)m_min_ngram_size ||
+     ngram.length > (size_t)m_max_ngram_size)
+    {
+      return;
+    }
+
+  uint64_t hash_pair[2];
+
+  MurmurHash3_x86_128(ngram.data,ngram.length,NgramKeySeed,hash_pair);
+
+  // The top bits pick the register, which keeps the longest run of leading
+  // zeros seen in the rest. The sentinel bit caps the run.
+  uint64_t hash = hash_pair[0];
+  size_t index = hash >> (64 - m_precision);
+  uint64_t rest = (hash << m_precision) | (1ULL << (m_precision - 1));
+  uint8_t rank = __builtin_clzll(rest) + 1;
+  uint8_t &reg = registers(ngram.length)[index];
+
+  if(rank > reg)
+    {
+      reg = rank;
+    }
+}
+
+void
+NgramCardinalityEstimator::insertNgrams(uint8_t const * data, size_t length,
+                                        int min_ngram_size,
+                                        int max_ngram_size)
+{
+  if(!m_reservoir_overflowed)
+    {
+      uint32_t payload_length = length;
+      size_t record_length = sizeof(payload_length) + length;
+
+      if(m_reservoir_used + record_length > m_reservoir_bytes)
+        {
+          BOOST_LOG_TRIVIAL(debug) << "Payloads exceed the " <<
+            m_reservoir_bytes << " byte reservoir" << std::endl;
+          std::vector<std::vector<uint8_t> >().swap(m_reservoir);
+          m_reservoir_used = 0;
+          m_reservoir_overflowed = true;
+        }
+      else
+        {
+          if(m_reservoir.empty() ||
+             m_reservoir.back().capacity() - m_reservoir.back().size() <
+             record_length)
+            {
+              m_reservoir.push_back(std::vector<uint8_t>());
+              m_reservoir.back().reserve(std::max(ReservoirChunkBytes,
+                                                  record_length));
+            }
+
+          std::vector<uint8_t> &chunk = m_reservoir.back();
+          size_t end = chunk.size();
+
+          chunk.resize(end + record_length);
+          memcpy(&chunk[end],&payload_length,sizeof(payload_length));
+          memcpy(&chunk[end + sizeof(payload_length)],data,length);
+          m_reservoir_used += record_length;
+        }
+    }
+  BenignNgramStorage::insertNgrams(data,length,min_ngram_size,
+                                   max_ngram_size);
+}
+
+bool
+NgramCardinalityEstimator::flush(std::string filename)
+{
+  BOOST_LOG_TRIVIAL(error) << "An ngram cardinality estimator can not be "
+    "written to " << filename << std::endl;
+  return false;
+}
+
+uint64_t
+NgramCardinalityEstimator::estimate(size_t length) const
+{
+  if(length < (size_t)m_min_ngram_size ||
+     length > (size_t)m_max_ngram_size)
+    {
+      return 0;
+    }
+
+  const std::vector<uint8_t> &regs = m_registers[length - m_min_ngram_size];
+  double m = (double)regs.size();
+  double sum = 0;
+  size_t zeros = 0;
+
+  for(size_t i = 0 ; i < regs.size() ; i++)
+    {
+      sum += ldexp(1.0,-(int)regs[i]);
+      if(regs[i] == 0)
+        {
+          zeros++;
+        }
+    }
+
+  double alpha = 0.7213 / (1 + 1.079 / m);
+  double raw = alpha * m * m / sum;
+
+  // Linear counting is more accurate while many registers are still empty.
+  // With 64-bit hashes there are no collisions to correct for at the top.
+  if(raw <= 2.5 * m && zeros > 0)
+    {
+      return (uint64_t)llround(m * log(m / (double)zeros));
+    }
+  return (uint64_t)llround(raw);
+}
+
+uint64_t
+NgramCardinalityEstimator::totalEstimate() const
+{
+  uint64_t total = 0;
+
+  for(int length = m_min_ngram_size ; length <= m_max_ngram_size ; length++)
+    {
+      total += estimate(length);
+    }
+  return total;
+}
+
+double
+NgramCardinalityEstimator::relativeError() const
+{
+  return 1.04 / sqrt(ldexp(1.0,m_precision));
+}
+
+void
+NgramCardinalityEstimator::replay(BenignNgramStorage &storage)
+{
+  if(m_reservoir_overflowed)
+    {
+      BOOST_LOG_TRIVIAL(error) << "The payloads did not fit in the "
+        "reservoir" << std::endl;
+      exit(-1);
+    }
+
+  for(size_t i = 0 ; i < m_reservoir.size() ; i++)
+    {
+      const std::vector<uint8_t> &chunk = m_reservoir[i];
+      size_t offset = 0;
+
+      while(offset < chunk.size())
+        {
+          uint32_t payload_length;
+
+          memcpy(&payload_length,&chunk[offset],sizeof(payload_length));
+          offset += sizeof(payload_length);
+          storage.insertNgrams(&chunk[offset],payload_length,
+                               m_min_ngram_size,m_max_ngram_size);
+          offset += payload_length;
+        }
+    }
+  std::vector<std::vector<uint8_t> >().swap(m_reservoir);
+  m_reservoir_used = 0;
+}
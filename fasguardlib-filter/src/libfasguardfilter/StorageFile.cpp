@@ -0,0 +1,188 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <fstream>
+#include <vector>
+#include <boost/log/trivial.hpp>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fasguardfilter/BloomFilterBase.hh>
+#include "StorageFile.hh"
+
+static bool
+isPropertyChar(char c)
+{
+  return isalnum((unsigned char)c) || c == '_';
+}
+
+bool
+StorageFile::parsePropertyLine(const std::string &line, std::string &key,
+                               std::string &value)
+{
+  std::string::size_type equals = line.find('=');
+
+  if(equals == std::string::npos)
+    {
+      return false;
+    }
+
+  std::string::size_type key_end = equals;
+  while(key_end > 0 && isspace((unsigned char)line[key_end - 1]))
+    {
+      key_end--;
+    }
+  std::string::size_type key_start = key_end;
+  while(key_start > 0 && isPropertyChar(line[key_start - 1]))
+    {
+      key_start--;
+    }
+  std::string::size_type value_start = equals + 1;
+  while(value_start < line.size() && isspace((unsigned char)line[value_start]))
+    {
+      value_start++;
+    }
+  std::string::size_type value_end = line.size();
+  while(value_end > value_start && isspace((unsigned char)line[value_end - 1]))
+    {
+      value_end--;
+    }
+  if(key_start == key_end || value_start == value_end)
+    {
+      return false;
+    }
+  key = line.substr(key_start,key_end - key_start);
+  value = line.substr(value_start,value_end - value_start);
+  return true;
+}
+
+void
+StorageFile::parseTextHeader(const char *header, size_t length,
+                             std::map<std::string,std::string> &properties)
+{
+  const char *end = header + strnlen(header,length);
+  const char *line = header;
+
+  while(line < end)
+    {
+      const char *line_end = std::find(line,end,'\n');
+      std::string key;
+      std::string value;
+
+      if(parsePropertyLine(std::string(line,line_end),key,value))
+        {
+          properties[key] = value;
+        }
+      line = line_end + 1;
+    }
+}
+
+bool
+StorageFile::readTextHeader(std::istream &in, const std::string &first_line,
+                            std::map<std::string,std::string> &properties)
+{
+  std::vector<char> header(BloomFilterBase::HeaderLengthInBytes,0);
+
+  in.read(header.data(),header.size());
+
+  size_t length = in.gcount();
+
+  if(length <= first_line.size() ||
+     first_line.compare(0,first_line.size(),header.data(),
+                        first_line.size()) != 0 ||
+     header[first_line.size()] != '\n')
+    {
+      return false;
+    }
+  parseTextHeader(header.data(),length,properties);
+  return true;
+}
+
+bool
+StorageFile::writeTextHeader(std::ostream &out, const std::string &header)
+{
+  if(header.size() >= BloomFilterBase::HeaderLengthInBytes)
+    {
+      return false;
+    }
+  out.write(header.data(),header.size());
+  writePadding(out,BloomFilterBase::HeaderLengthInBytes - header.size());
+  return true;
+}
+
+void
+StorageFile::writePadding(std::ostream &out, size_t length)
+{
+  static const char Filler[BloomFilterBase::HeaderLengthInBytes] = {};
+
+  while(length > 0)
+    {
+      size_t chunk = std::min(length,sizeof(Filler));
+
+      out.write(Filler,chunk);
+      length -= chunk;
+    }
+}
+
+bool
+StorageFile::isTextHeaderFile(const std::string &filename,
+                              const std::string &first_line)
+{
+  std::ifstream file(filename.c_str());
+  std::string line;
+
+  return file && std::getline(file,line) && line == first_line;
+}
+
+void *
+StorageFile::mapFile(const std::string &filename, size_t length,
+                     unsigned int mmap_hints)
+{
+  int fd = open(filename.c_str(),O_RDONLY);
+  if(fd < 0)
+    {
+      BOOST_LOG_TRIVIAL(error) << "Unable to open: " <<
+        filename << std::endl;
+      exit(-1);
+    }
+
+  struct stat st;
+  if(fstat(fd,&st) != 0 || (size_t)st.st_size < length)
+    {
+      BOOST_LOG_TRIVIAL(error) << "File too short: " <<
+        filename << std::endl;
+      exit(-1);
+    }
+
+  // Map from the start of the file so the offset is page aligned
+  int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+  if(mmap_hints & MMAP_HINT_POPULATE)
+    {
+      flags |= MAP_POPULATE;
+    }
+#endif
+  void *addr = mmap(NULL,length,PROT_READ,flags,fd,0);
+  close(fd);
+  if(addr == MAP_FAILED)
+    {
+      BOOST_LOG_TRIVIAL(error) << "Unable to mmap: " <<
+        filename << std::endl;
+      exit(-1);
+    }
+
+  if(mmap_hints & MMAP_HINT_RANDOM)
+    {
+      madvise(addr,length,MADV_RANDOM);
+    }
+  if(mmap_hints & MMAP_HINT_WILLNEED)
+    {
+      madvise(addr,length,MADV_WILLNEED);
+    }
+  return addr;
+}
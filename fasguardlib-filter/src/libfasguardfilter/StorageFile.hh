@@ -0,0 +1,78 @@
+#ifndef STORAGE_FILE_HH
+#define STORAGE_FILE_HH
+
+#include <inttypes.h>
+#include <cstddef>
+#include <iosfwd>
+#include <map>
+#include <string>
+
+/**
+ * @brief Reading and writing of the files of the ngram storages.
+ *
+ * Every file starts with a BloomFilterBase::HeaderLengthInBytes header
+ * region. Apart from the binary header of a .bloom file, the header is
+ * text: a first line naming the kind of storage, then KEY = VALUE lines,
+ * padded with NULs. The data that follows can be mapped read-only.
+ */
+class StorageFile
+{
+public:
+  /**
+   * Split a KEY = VALUE line. The key is the run of letters, digits and '_'
+   * before the '=', the value the rest of the line, both without the
+   * surrounding white space.
+   * @return False if the line has no key or no value.
+   */
+  static bool parsePropertyLine(const std::string &line, std::string &key,
+                                std::string &value);
+
+  /**
+   * Parse the KEY = VALUE lines of a text header. Other lines are skipped.
+   * @param header The header. Parsing stops at the first NUL.
+   * @param length Number of bytes in header.
+   * @param properties Receives the properties.
+   */
+  static void parseTextHeader(const char *header, size_t length,
+                              std::map<std::string,std::string> &properties);
+
+  /**
+   * Read the text header region at the start of a stream and parse it.
+   * @param in The stream, positioned at the start of the file.
+   * @param first_line Expected first line of the header.
+   * @param properties Receives the properties.
+   * @return False if the header does not start with first_line.
+   */
+  static bool readTextHeader(std::istream &in, const std::string &first_line,
+                             std::map<std::string,std::string> &properties);
+
+  /**
+   * Write a text header, padded with NULs to the whole header region.
+   * @return False if the header does not fit.
+   */
+  static bool writeTextHeader(std::ostream &out, const std::string &header);
+
+  /**
+   * Write length NULs.
+   */
+  static void writePadding(std::ostream &out, size_t length);
+
+  /**
+   * Check whether a file starts with a text header whose first line is
+   * first_line.
+   */
+  static bool isTextHeaderFile(const std::string &filename,
+                               const std::string &first_line);
+
+  /**
+   * Map the start of a file read-only. Exits if the file is shorter than
+   * length or can not be mapped.
+   * @param filename Name of the file.
+   * @param length Number of bytes to map, from the start of the file.
+   * @param mmap_hints BloomMmapHint values or'ed together.
+   * @return The address of the mapping, to be unmapped with munmap().
+   */
+  static void *mapFile(const std::string &filename, size_t length,
+                       unsigned int mmap_hints);
+};
+#endif
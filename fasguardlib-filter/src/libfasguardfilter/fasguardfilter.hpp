@@ -486,6 +486,64 @@ private:
     };
 };
 
+/**
+    @brief Statistics for a bloom filter, derived from the number of
+        bits that are set.
+
+    The estimates assume the bits of each item are independent and
+    uniformly distributed, as in a standard bloom filter. A filter
+    sized for its items has about half of its bits set; a fuller
+    filter holds more items than it was sized for and has a higher
+    false positive rate than it was built for.
+*/
+class bloom_filter_statistics
+:
+    public filter_statistics
+{
+public:
+    /**
+        @brief Constructor.
+
+        @param[in] bitlength_ Number of bits in the filter.
+        @param[in] num_hashes_ Number of bits set for each item.
+        @param[in] set_bits_ Number of bits that are set.
+    */
+    bloom_filter_statistics(
+        uint64_t bitlength_,
+        uint64_t num_hashes_,
+        uint64_t set_bits_);
+
+    virtual std::string to_string() const;
+
+    /**
+        @brief Fraction of the bits that are set.
+    */
+    double fill_ratio() const;
+
+    /**
+        @brief Estimated number of distinct items inserted into the
+            filter, or infinity if every bit is set.
+    */
+    double estimated_items() const;
+
+    /**
+        @brief Estimated probability that an item that was not
+            inserted tests as present.
+    */
+    double false_positive_rate() const;
+
+    uint64_t bitlength;
+    uint64_t num_hashes;
+    uint64_t set_bits;
+
+private:
+    bloom_filter_statistics(
+        bloom_filter_statistics const & other);
+
+    bloom_filter_statistics & operator=(
+        bloom_filter_statistics const & other);
+};
+
 /**
     @brief Base class for a filter.
 */
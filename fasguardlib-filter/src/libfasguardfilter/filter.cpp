@@ -6,6 +6,7 @@
 #define __STDC_FORMAT_MACROS
 #define __STDC_LIMIT_MACROS
 
+#include <cmath>
 #include <cstdio>
 #include <cstring>
 #include <iostream>
@@ -308,6 +309,75 @@ void filter_statistics::on_contains(
 }
 
 
+bloom_filter_statistics::bloom_filter_statistics(
+    uint64_t bitlength_,
+    uint64_t num_hashes_,
+    uint64_t set_bits_)
+:
+    bitlength(bitlength_),
+    num_hashes(num_hashes_),
+    set_bits(set_bits_)
+{
+}
+
+std::string bloom_filter_statistics::to_string() const
+{
+    static char const format[] =
+        "bloom_filter_statistics["
+        "bitlength = %" PRIu64 ", "
+        "num_hashes = %" PRIu64 ", "
+        "set_bits = %" PRIu64 ", "
+        "fill_ratio = %.6f, "
+        "estimated_items = %.0f, "
+        "false_positive_rate = %.3g]";
+    static size_t const buflen =
+        sizeof(format) +
+        32 /* > digits in PRIu64 or %g */ * 6 /* count of conversions */;
+
+    char * buf = new char[buflen];
+
+    snprintf(buf, buflen, format, bitlength, num_hashes, set_bits,
+        fill_ratio(), estimated_items(), false_positive_rate());
+
+    std::string ret(buf);
+
+    delete[] buf;
+
+    return ret;
+}
+
+double bloom_filter_statistics::fill_ratio() const
+{
+    if (bitlength == 0)
+    {
+        return 0.0;
+    }
+
+    return (double)set_bits / (double)bitlength;
+}
+
+double bloom_filter_statistics::estimated_items() const
+{
+    if (num_hashes == 0)
+    {
+        return 0.0;
+    }
+
+    if (set_bits >= bitlength)
+    {
+        return std::numeric_limits<double>::infinity();
+    }
+
+    // Swamidass and Baldi: n = -(m / k) ln(1 - X / m)
+    return -((double)bitlength / (double)num_hashes) *
+        log1p(-fill_ratio());
+}
+
+double bloom_filter_statistics::false_positive_rate() const
+{
+    return pow(fill_ratio(), (double)num_hashes);
+}
+
 serializable_filter_statistics::~serializable_filter_statistics()
 {
 }
@@ -10,7 +10,7 @@ using namespace std;
 
 namespace fasguard
 {
-BloomPacketEngine::BloomPacketEngine(BloomFilterBase &b_filter,
+BloomPacketEngine::BloomPacketEngine(BenignNgramStorage &b_filter,
                                      int min_hor,int max_hor,bool stat_flag) :
   m_bf(b_filter),m_min_hor(min_hor),
   m_max_hor(max_hor),m_stat_flag(stat_flag)
@@ -41,6 +41,13 @@ BloomPacketEngine::insertPacket(const unsigned char *str,int lgth)
     }
   cout << endl;
 #endif
+  if(!m_stat_flag)
+    {
+      // Hash every ngram straight from the payload
+      m_bf.insertNgrams(str,lgth,m_min_hor,m_max_hor);
+      return;
+    }
+
   const unsigned char *end_str = str + lgth;
 
   register const unsigned char *cur = str;
@@ -95,15 +102,6 @@ BloomPacketEngine::insertPacket(const unsigned char *str,int lgth)
 {
   m_bf.signalDone();
   m_bf.threadsCompleted();
-  unsigned int e_above = m_bf.entryAbove(1);
-  if(e_above > 1)
-    {
-      cout << "Entry above 1 is " << e_above << endl;
-    }
-  else
-    {
-      cout << "FAILED ENTRY ABOVE TEST" << endl;
-    }
   return m_bf.flush(filename);
 }
 }
@@ -2,20 +2,20 @@
 #define BLOOM_PACKET_ENGINE_HH
 
 #include <string>
-#include <fasguardfilter/BloomFilterBase.hh>
+#include <fasguardfilter/BenignNgramStorage.hh>
 
 namespace fasguard
 {
   class BloomPacketEngine
   {
   public:
-    BloomPacketEngine(BloomFilterBase &b_filter,
+    BloomPacketEngine(BenignNgramStorage &b_filter,
                       int min_hor,int max_hor,bool stat_flag=true);
     ~BloomPacketEngine();
     void insertPacket(const unsigned char *str,int lgth);
     bool flush(const std::string &filename);
   private:
-    BloomFilterBase &m_bf;
+    BenignNgramStorage &m_bf;
     int m_min_hor;
     int m_max_hor;
     bool m_stat_flag;
@@ -12,7 +12,7 @@
 namespace fasguard
 {
   PcapFileEngine::PcapFileEngine(const std::vector<std::string> pcap_filenames,
-                                 BloomFilterBase &b_filter,int min_depth,
+                                 BenignNgramStorage &b_filter,int min_depth,
                                  int max_depth) :
     m_b_filter(b_filter),m_b_pkt_eng(b_filter,min_depth,max_depth,false),
     m_bytes_processed(0)
@@ -28,11 +28,7 @@ namespace fasguard
 
     // Wait for bloom insertion to complete
 
-    while(!b_filter.bloomInsertionDone())
-      {
-        boost::this_thread::sleep_for(boost::chrono::milliseconds(SleepTimeMilS));
-
-      }
+    m_b_filter.threadsCompleted();
 
     // Record number of bytes inserted into Bloom Filter
 
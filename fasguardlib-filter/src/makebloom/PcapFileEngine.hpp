@@ -6,7 +6,7 @@
 #include <net/ethernet.h>
 #include <netinet/in.h>
 
-#include <fasguardfilter/BloomFilterBase.hh>
+#include <fasguardfilter/BenignNgramStorage.hh>
 #include "BloomPacketEngine.hpp"
 
 namespace fasguard
@@ -24,14 +24,13 @@ namespace fasguard
      *
      * @param[in] pcap_filenames A vector of strings containing the names of
      *          the pcap files.
-     * @param[in] bloom_filter Bloom filter into which the ngrams from the
+     * @param[in] bloom_filter Storage into which the ngrams from the
      *          packets are placed.
      */
     PcapFileEngine(const std::vector<std::string> pcap_filenames,
-                   BloomFilterBase &b_filter,int min_depth,
+                   BenignNgramStorage &b_filter,int min_depth,
                    int max_depth);
     static const int BytesProcessedDelta = 100000;
-    static const unsigned int SleepTimeMilS = 10;
 
   protected:
     void fillBloom(std::string pcap_filename);
@@ -42,7 +41,7 @@ namespace fasguard
     void closePcap(pcap_t*& p);
     bool extractPayload(const u_char*  pkt, size_t   caplen,
                         const u_char*& payload, size_t&  payload_len);
-    BloomFilterBase &m_b_filter;
+    BenignNgramStorage &m_b_filter;
     BloomPacketEngine m_b_pkt_eng;
     unsigned long long int m_bytes_processed;
   };
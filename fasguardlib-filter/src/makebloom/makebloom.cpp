@@ -10,9 +10,16 @@
 #include <iostream>
 #include <algorithm>
 #include <iterator>
+#include <cmath>
 #include <pcap.h>
 #include <fasguardfilter/BloomFilterUnthreaded.hh>
 #include <fasguardfilter/BloomFilterThreaded.hh>
+#include <fasguardfilter/BloomFilterGenerations.hh>
+#include <fasguardfilter/BloomFilterPartitioned.hh>
+#include <fasguardfilter/BloomFilterScalable.hh>
+#include <fasguardfilter/BinaryFuseNgramStorage.hh>
+#include <fasguardfilter/CuckooNgramStorage.hh>
+#include <fasguardfilter/NgramCardinalityEstimator.hh>
 #include "PcapFileEngine.hpp"
 //#include "MurmurHash3.h"
 
@@ -49,8 +56,24 @@ main(int argc, char *argv[])
   int min_depth;
   int max_depth;
   int thread_num;
+  unsigned int generations;
   bool merge_flag;
+  bool stats_flag;
   bool thread_flag;
+  bool blocked_flag;
+  bool double_hash_flag;
+  bool incremental_hash_flag;
+  bool power_of_2_flag;
+  bool partial_flag;
+  bool partial_in_place_flag;
+  bool cuckoo_flag;
+  bool binary_fuse_flag;
+  bool partitioned_flag;
+  bool scalable_flag;
+  bool exact_short_flag;
+  bool compress_flag;
+  bool auto_size_flag;
+  size_t reservoir_mb;
   std::string out_file;
 
   po::variables_map vm;
@@ -61,9 +84,73 @@ main(int argc, char *argv[])
       desc.add_options()
         ("help,h", "produce help message")
         ("merge,m", po::bool_switch(&merge_flag)->default_value(false),
-         "Mode for merging two Bloom filters into one")
+         "Mode for merging Bloom filters into one, using -T threads")
+        ("stats", po::bool_switch(&stats_flag)->default_value(false),
+         "Mode for printing the fill ratio, estimated number of ngrams and "
+         "estimated false positive rate of Bloom filters")
         ("thread,t", po::bool_switch(&thread_flag)->default_value(false),
          "Run the multithreaded version")
+        ("blocked,b", po::bool_switch(&blocked_flag)->default_value(false),
+         "Set all the bits for an ngram within one 64-byte block")
+        ("double-hash,d",
+         po::bool_switch(&double_hash_flag)->default_value(false),
+         "Derive all bit indeces from a single hash")
+        ("incremental-hash,i",
+         po::bool_switch(&incremental_hash_flag)->default_value(false),
+         "Hash all ngram lengths at an offset in one pass (implies -d)")
+        ("power-of-2,p",
+         po::bool_switch(&power_of_2_flag)->default_value(false),
+         "Round the filter size up to a power of 2 so it can be folded")
+        ("partial",
+         po::bool_switch(&partial_flag)->default_value(false),
+         "With -t, fill a private partial filter per thread and merge them "
+         "at the end")
+        ("partial-in-place",
+         po::bool_switch(&partial_in_place_flag)->default_value(false),
+         "Like --partial, but the first thread fills the filter itself to "
+         "save memory")
+        ("exact-short-ngrams",
+         po::bool_switch(&exact_short_flag)->default_value(false),
+         "Store ngrams of up to 3 bytes in exact bitmaps instead of hashing "
+         "them into the Bloom filter")
+        ("compress",
+         po::bool_switch(&compress_flag)->default_value(false),
+         "Compress the Bloom filter bits when that makes them smaller, for "
+         "sparsely filled filters")
+        ("generations,g",
+         po::value<unsigned int>(&generations)->default_value(0),
+         "Add the filter as the newest generation of the generations store "
+         "in the output file, keeping this many generations")
+        ("cuckoo,c",
+         po::bool_switch(&cuckoo_flag)->default_value(false),
+         "Build a cuckoo filter instead of a Bloom filter. It can not hold "
+         "more ngrams than it is sized for, so it needs --num-insertions or "
+         "--auto-size")
+        ("binary-fuse",
+         po::bool_switch(&binary_fuse_flag)->default_value(false),
+         "Build a static binary fuse filter instead of a Bloom filter. "
+         "Ngram hashes are spilled to files next to the output file until "
+         "the filter is built")
+        ("partitioned",
+         po::bool_switch(&partitioned_flag)->default_value(false),
+         "Build a Bloom filter with one partition per ngram length, each "
+         "sized for the ngrams of its length. Without --auto-size, a 64-bit "
+         "hash of every distinct ngram is kept in memory until the filter "
+         "is written, several times the size of the filter itself")
+        ("scalable",
+         po::bool_switch(&scalable_flag)->default_value(false),
+         "Build a Bloom filter that adds larger stages as it fills up, "
+         "starting with one sized for --num-insertions ngrams")
+        ("auto-size",
+         po::bool_switch(&auto_size_flag)->default_value(false),
+         "Estimate the number of distinct ngrams of each length with a "
+         "HyperLogLog pass over the pcap files and size the filter for "
+         "them instead of --num-insertions")
+        ("reservoir-mb",
+         po::value<size_t>(&reservoir_mb)->default_value(256),
+         "With --auto-size, megabytes of payloads kept from the estimation "
+         "pass to build the filter from, so that the pcap files are only "
+         "read once if they fit")
         ("prob-fa", po::value<double>(&pfa)->default_value(0.00001),
          "desired probability of false alarm")
         ("num-insertions,n",
@@ -164,30 +251,172 @@ main(int argc, char *argv[])
   // fasguard::bloom_filter_statistics
   //   *bfs_ptr = new fasguard::bloom_filter_statistics();
 
+  if(stats_flag)
+    {
+      vector<string> in_files = vm["pcap-file"].as< vector<string> >();
+
+      for(size_t i = 0 ; i < in_files.size() ; i++)
+        {
+          if(BloomFilterGenerations::isManifest(in_files[i]) ||
+             BloomFilterPartitioned::isPartitionedFile(in_files[i]) ||
+             BloomFilterScalable::isScalableFile(in_files[i]) ||
+             BinaryFuseNgramStorage::isBinaryFuseFile(in_files[i]) ||
+             CuckooNgramStorage::isCuckooFile(in_files[i]))
+            {
+              BOOST_LOG_TRIVIAL(error) << "--stats only applies to Bloom "
+                "filters: " << in_files[i] << std::endl;
+              return 1;
+            }
+
+          BloomFilterUnthreaded bf(in_files[i],LOAD_MMAP,MMAP_HINT_NONE);
+
+          cout << in_files[i] << ": " << bf.statisticsString() << endl;
+        }
+      return 0;
+    }
+
   if(merge_flag)
     {
-      BloomFilterUnthreaded bf1((vm["pcap-file"].as< vector<string> >())[0],
-                                false);
-      BloomFilterUnthreaded bf2(vm["pcap-file"].as< vector<string> >()[1],
-                                false);
-      bf1.WriteCombined(bf2,out_file);
+      // The inputs are read sequentially, a chunk at a time
+      vector<string> in_files = vm["pcap-file"].as< vector<string> >();
+      vector<boost::shared_ptr<BloomFilterUnthreaded> > inputs;
+      vector<BloomFilterBase *> filters;
+
+      for(size_t i = 0 ; i < in_files.size() ; i++)
+        {
+          inputs.push_back(boost::shared_ptr<BloomFilterUnthreaded>(
+                             new BloomFilterUnthreaded(in_files[i],LOAD_MMAP,
+                                                       MMAP_HINT_NONE)));
+          filters.push_back(inputs.back().get());
+        }
+      BloomFilterBase::WriteCombined(filters,out_file,thread_num);
       return 0;
     }
 
-  BloomFilterBase *bf;
+  BenignNgramStorage *bf;
+  BloomLayout layout = blocked_flag ? LAYOUT_BLOCKED : LAYOUT_STANDARD;
+  BloomIndexMode index_mode =
+    double_hash_flag ? INDEX_DOUBLE_HASH : INDEX_PER_SEED;
+  BloomHashFamily hash_family =
+    incremental_hash_flag ? HASH_INCREMENTAL : HASH_MURMUR3;
+  BloomSizing sizing = power_of_2_flag ? SIZING_POWER_OF_2 : SIZING_EXACT;
+  BloomBuildStrategy build_strategy = BUILD_SHARED;
+  BloomShortNgrams short_ngrams =
+    exact_short_flag ? SHORT_NGRAMS_EXACT : SHORT_NGRAMS_HASHED;
+  if(partial_in_place_flag)
+    {
+      build_strategy = BUILD_PARTIAL_IN_PLACE;
+    }
+  else if(partial_flag)
+    {
+      build_strategy = BUILD_PARTIAL;
+    }
 
-  if (thread_flag)
+  // A full cuckoo filter exits, so do not build one for the default 10
+  if(cuckoo_flag && !auto_size_flag && vm["num-insertions"].defaulted())
+    {
+      BOOST_LOG_TRIVIAL(error) << "--cuckoo needs --num-insertions or "
+        "--auto-size" << std::endl;
+      return 1;
+    }
+
+  vector<string> pcap_files = vm["pcap-file"].as< vector<string> >();
+  vector<uint64_t> estimated_items;
+  boost::shared_ptr<NgramCardinalityEstimator> estimator;
+
+  if(auto_size_flag && binary_fuse_flag)
+    {
+      BOOST_LOG_TRIVIAL(warning) << "--auto-size does not apply to binary "
+        "fuse filters, which are sized from the ngrams themselves" <<
+        std::endl;
+    }
+  else if(auto_size_flag)
+    {
+      estimator.reset(new NgramCardinalityEstimator(
+                        ip_proto,port_num,min_depth,max_depth,
+                        NgramCardinalityEstimator::DEFAULT_PRECISION,
+                        reservoir_mb << 20));
+
+      fasguard::PcapFileEngine estimate_pfe(pcap_files,*estimator,min_depth,
+                                            max_depth);
+
+      // Leave room for an estimate that is two standard errors low
+      double margin = 1 + 2 * estimator->relativeError();
+
+      num_insertions = 0;
+      for(int length = min_depth ; length <= max_depth ; length++)
+        {
+          estimated_items.push_back((uint64_t)ceil(
+                                      estimator->estimate(length) * margin));
+          num_insertions += estimated_items.back();
+          BOOST_LOG_TRIVIAL(debug) << "Estimated distinct ngrams of length "
+            << length << ": " << estimator->estimate(length) << std::endl;
+        }
+      num_insertions = std::max(num_insertions,1UL);
+      BOOST_LOG_TRIVIAL(info) << "Estimated distinct ngrams: " <<
+        estimator->totalEstimate() << ", sizing for " << num_insertions <<
+        std::endl;
+    }
+
+  if (binary_fuse_flag)
+    {
+      bf = new BinaryFuseNgramStorage(pfa,ip_proto,port_num,min_depth,
+                                      max_depth,out_file);
+    }
+  else if (partitioned_flag && estimator)
+    {
+      bf = new BloomFilterPartitioned(estimated_items,pfa,ip_proto,port_num,
+                                      min_depth,max_depth);
+    }
+  else if (partitioned_flag)
+    {
+      bf = new BloomFilterPartitioned(pfa,ip_proto,port_num,min_depth,
+                                      max_depth);
+    }
+  else if (scalable_flag)
+    {
+      bf = new BloomFilterScalable(num_insertions,pfa,ip_proto,port_num,
+                                   min_depth,max_depth);
+    }
+  else if (cuckoo_flag)
+    {
+      bf = new CuckooNgramStorage(num_insertions,pfa,ip_proto,port_num,
+                                  min_depth,max_depth);
+    }
+  else if (thread_flag)
     {
       bf = new BloomFilterThreaded(num_insertions,pfa,ip_proto,port_num,
                                    min_depth,
                                    max_depth,
-                                   thread_num);
+                                   thread_num,
+                                   layout,
+                                   index_mode,
+                                   hash_family,
+                                   sizing,
+                                   build_strategy,
+                                   short_ngrams);
     }
   else
     {
       bf = new BloomFilterUnthreaded(num_insertions,pfa,ip_proto,port_num,
                                      min_depth,
-                                     max_depth);
+                                     max_depth,
+                                     layout,
+                                     index_mode,
+                                     hash_family,
+                                     sizing,
+                                     short_ngrams);
+    }
+
+  BloomFilterBase *bloom = dynamic_cast<BloomFilterBase *>(bf);
+  if(bloom != NULL)
+    {
+      bloom->setCompressOutput(compress_flag);
+    }
+  else if(compress_flag)
+    {
+      BOOST_LOG_TRIVIAL(warning) << "--compress only applies to Bloom "
+        "filters" << std::endl;
     }
 
   // BloomFilter bf(num_insertions,pfa,ip_proto,port_num,min_depth,
@@ -199,12 +428,42 @@ main(int argc, char *argv[])
   //bf.initialize(out_file);
 
 
-  fasguard::PcapFileEngine pfe(vm["pcap-file"].as< vector<string> >(),
-                           *bf,min_depth,max_depth);
+  if(estimator && estimator->reservoirComplete())
+    {
+      BOOST_LOG_TRIVIAL(info) << "Building from the payloads kept in "
+        "memory" << std::endl;
+      estimator->replay(*bf);
+      bf->signalDone();
+      bf->threadsCompleted();
+      bf->setNumBytesProcessed(estimator->getNumBytesProcessed());
+    }
+  else
+    {
+      fasguard::PcapFileEngine pfe(pcap_files,*bf,min_depth,max_depth);
+    }
+  estimator.reset();
 
   BOOST_LOG_TRIVIAL(debug)  << "Before makebloom flush " <<
     std::endl;
-  bf->flush(out_file);
+  if(generations > 0)
+    {
+      boost::shared_ptr<BloomFilterGenerations> store;
+
+      if(BloomFilterGenerations::isManifest(out_file))
+        {
+          store.reset(new BloomFilterGenerations(out_file,LOAD_MMAP));
+          store->setMaxGenerations(generations);
+        }
+      else
+        {
+          store.reset(new BloomFilterGenerations(generations,ip_proto,
+                                                 port_num,min_depth,
+                                                 max_depth));
+        }
+      store->addGeneration(boost::shared_ptr<BenignNgramStorage>(bf));
+      return store->flush(out_file) ? 0 : 1;
+    }
+  bool flushed = bf->flush(out_file);
   delete bf;
-  return 0;
+  return flushed ? 0 : 1;
 }
@@ -0,0 +1,230 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <cstdio>
+#include <sstream>
+#include <fasguardfilter/BloomFilterUnthreaded.hh>
+#include "BloomFilterHeader.hh"
+#include "TestUtil.hh"
+
+// A .bloom file must load back to the filter that was flushed in every load
+// mode, and a file whose header or data is corrupt or truncated must be
+// rejected.
+
+namespace
+{
+const int MinNgramSize = 2;
+const int MaxNgramSize = 6;
+
+/**
+ * Loads a filter, for exitsWithError().
+ */
+class Load
+{
+public:
+  Load(const std::string &filename, BloomLoadMode load_mode) :
+    m_filename(filename), m_load_mode(load_mode)
+  {}
+  void operator()() const
+  {
+    BloomFilterUnthreaded bf(m_filename,m_load_mode);
+  }
+private:
+  std::string m_filename;
+  BloomLoadMode m_load_mode;
+};
+
+/**
+ * The ngrams of the payloads of lengths MinNgramSize to MaxNgramSize.
+ */
+std::vector<NgramSpan>
+ngramsOf(const std::vector<std::string> &payloads)
+{
+  std::vector<NgramSpan> ngrams;
+
+  for(size_t p = 0 ; p < payloads.size() ; p++)
+    {
+      const uint8_t *data = (const uint8_t *)payloads[p].data();
+
+      for(size_t offset = 0 ; offset < payloads[p].size() ; offset++)
+        {
+          for(size_t length = MinNgramSize ;
+              length <= (size_t)MaxNgramSize &&
+                offset + length <= payloads[p].size() ; length++)
+            {
+              ngrams.push_back(NgramSpan(data + offset,length));
+            }
+        }
+    }
+  return ngrams;
+}
+
+void
+checkRoundTrip(BloomShortNgrams short_ngrams, const std::string &filename)
+{
+  std::vector<std::string> payloads = makePayloads(4,30,80);
+  std::vector<NgramSpan> probes = ngramsOf(makePayloads(5,30,80));
+  BloomFilterUnthreaded built(10000,0.01,17,53,MinNgramSize,MaxNgramSize,
+                              LAYOUT_BLOCKED,INDEX_DOUBLE_HASH,
+                              HASH_INCREMENTAL,SIZING_EXACT,short_ngrams);
+
+  for(size_t p = 0 ; p < payloads.size() ; p++)
+    {
+      built.insertNgrams((const uint8_t *)payloads[p].data(),
+                         payloads[p].size(),MinNgramSize,MaxNgramSize);
+    }
+  built.setNumBytesProcessed(30 * 80);
+  check(built.flush(filename),"flush");
+
+  std::string flushed = fileBytes(filename);
+  std::vector<NgramSpan> inserted = ngramsOf(payloads);
+  const BloomLoadMode modes[] = { LOAD_STREAM, LOAD_MEMORY, LOAD_MMAP };
+
+  for(size_t m = 0 ; m < sizeof(modes) / sizeof(modes[0]) ; m++)
+    {
+      std::ostringstream name;
+      name << "short ngrams " << short_ngrams << ", load mode " << modes[m];
+
+      BloomFilterUnthreaded loaded(filename,modes[m]);
+      size_t missing = 0;
+      size_t mismatches = 0;
+
+      check(loaded.getLayout() == LAYOUT_BLOCKED &&
+            loaded.getIndexMode() == INDEX_DOUBLE_HASH &&
+            loaded.getHashFamily() == HASH_INCREMENTAL &&
+            loaded.getSizing() == SIZING_EXACT &&
+            loaded.getExactMaxNgramSize() == built.getExactMaxNgramSize(),
+            name.str() + ": hashing of the filter");
+      check(loaded.Compare(built),name.str() + ": parameters of the filter");
+      for(size_t i = 0 ; i < inserted.size() ; i++)
+        {
+          missing += loaded.containsSpan(inserted[i]) ? 0 : 1;
+        }
+      for(size_t i = 0 ; i < probes.size() ; i++)
+        {
+          mismatches +=
+            (loaded.containsSpan(probes[i]) != built.containsSpan(probes[i])) ?
+            1 : 0;
+        }
+      check(missing == 0,name.str() + ": inserted ngrams missing");
+      check(mismatches == 0,name.str() + ": lookups differ from the built "
+            "filter");
+
+      // A streamed filter has no bits in memory to write
+      if(modes[m] != LOAD_STREAM)
+        {
+          std::string copy = filename + ".copy";
+
+          check(loaded.flush(copy) && fileBytes(copy) == flushed,
+                name.str() + ": flushing the loaded filter changes the file");
+          std::remove(copy.c_str());
+        }
+    }
+}
+
+void
+checkRejected(const std::string &filename, const std::string &bytes,
+              const std::vector<BloomLoadMode> &modes,
+              const std::string &what)
+{
+  writeFileBytes(filename,bytes);
+  for(size_t m = 0 ; m < modes.size() ; m++)
+    {
+      std::ostringstream name;
+      name << what << " accepted in load mode " << modes[m];
+      check(exitsWithError(Load(filename,modes[m])),name.str());
+    }
+}
+}
+
+int
+main()
+{
+  quietLogging();
+
+  const std::string filename = "BloomFilterFileTest.bloom";
+  const std::string corrupt_filename = "BloomFilterFileTest.corrupt.bloom";
+
+  // The check value of CRC-32C
+  check(BloomFilterHeader::crc32c("123456789",9) == 0xe3069283,
+        "CRC-32C of \"123456789\"");
+  check(BloomFilterHeader::crc32c("6789",4,
+                                  BloomFilterHeader::crc32c("12345",5)) ==
+        0xe3069283,"CRC-32C continued over two buffers");
+
+  checkRoundTrip(SHORT_NGRAMS_HASHED,filename);
+  checkRoundTrip(SHORT_NGRAMS_EXACT,filename);
+
+  std::string good = fileBytes(filename);
+  std::vector<BloomLoadMode> all_modes;
+  all_modes.push_back(LOAD_STREAM);
+  all_modes.push_back(LOAD_MEMORY);
+  all_modes.push_back(LOAD_MMAP);
+
+  check(!exitsWithError(Load(filename,LOAD_MEMORY)),
+        "intact file rejected");
+
+  // Every bit of the header is covered by its CRC
+  {
+    BloomFilterHeader header;
+    size_t length = 0;
+
+    check(header.unserialize(good.data(),length,good.size()),
+          "unserialize of the intact header");
+
+    size_t accepted = 0;
+
+    for(size_t i = 0 ; i < length * 8 ; i++)
+      {
+        std::string bad_header = good;
+        BloomFilterHeader corrupt;
+        size_t offset = 0;
+
+        bad_header[i / 8] ^= (char)(1 << (i % 8));
+        accepted += corrupt.unserialize(bad_header.data(),offset,
+                                        bad_header.size()) ? 1 : 0;
+      }
+    check(accepted == 0,"header with a flipped bit accepted");
+
+    std::string bad_header = good;
+    bad_header[length / 2] ^= 0x01;
+    checkRejected(corrupt_filename,bad_header,all_modes,"corrupt header");
+  }
+
+  // The data is checked against the payload CRC when it is read in full
+  {
+    std::string bad_data = good;
+    bad_data[BloomFilterBase::HeaderLengthInBytes + 10] ^= 0x10;
+
+    checkRejected(corrupt_filename,bad_data,
+                  std::vector<BloomLoadMode>(1,LOAD_MEMORY),"corrupt data");
+  }
+
+  checkRejected(corrupt_filename,good.substr(0,good.size() - 1),all_modes,
+                "truncated data");
+  checkRejected(corrupt_filename,good.substr(0,100),all_modes,
+                "truncated header");
+
+  // A blocked filter is a whole number of blocks
+  {
+    BloomFilterHeader header;
+    size_t offset = 0;
+    char buffer[BloomFilterBase::HeaderLengthInBytes];
+
+    header.unserialize(good.data(),offset,good.size());
+    header.bitlength += 8;
+    offset = 0;
+    check(header.serialize(buffer,offset,sizeof(buffer)),
+          "serialize of a blocked header");
+
+    BloomFilterHeader partial_block;
+    offset = 0;
+    check(!partial_block.unserialize(buffer,offset,sizeof(buffer)),
+          "blocked header with a partial block accepted");
+  }
+
+  std::remove(filename.c_str());
+  std::remove(corrupt_filename.c_str());
+  return testResult();
+}
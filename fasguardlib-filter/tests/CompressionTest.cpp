@@ -0,0 +1,158 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <cstdio>
+#include <sstream>
+#include <fasguardfilter/BloomFilterUnthreaded.hh>
+#include "BloomFilterHeader.hh"
+#include "TestUtil.hh"
+
+// A filter flushed with setCompressOutput() must load back to the same bits
+// as the uncompressed file, whichever encoding flush() chose and in every
+// load mode, and a damaged compressed file must be rejected.
+
+namespace
+{
+/**
+ * Loads a filter, for exitsWithError().
+ */
+class Load
+{
+public:
+  Load(const std::string &filename, BloomLoadMode load_mode) :
+    m_filename(filename), m_load_mode(load_mode)
+  {}
+  void operator()() const
+  {
+    BloomFilterUnthreaded bf(m_filename,m_load_mode);
+  }
+private:
+  std::string m_filename;
+  BloomLoadMode m_load_mode;
+};
+
+/**
+ * The encoding flag of a flushed file, or 0xff if its header is unreadable.
+ */
+uint8_t
+encodingOf(const std::string &bytes)
+{
+  BloomFilterHeader header;
+  size_t offset = 0;
+
+  if(!header.unserialize(bytes.data(),offset,bytes.size()))
+    {
+      return 0xff;
+    }
+  return header.flags & (BloomFilterHeader::FLAG_ZERO_RUNS |
+                         BloomFilterHeader::FLAG_SET_BIT_GAPS);
+}
+
+void
+checkEncoding(BloomFilterBase &built, uint8_t encoding,
+              const std::string &what)
+{
+  const std::string plain_file = "CompressionTest.bloom";
+  const std::string compressed_file = "CompressionTest.compressed.bloom";
+  const std::string copy_file = "CompressionTest.copy.bloom";
+
+  check(built.flush(plain_file),what + ": flush");
+  built.setCompressOutput(true);
+  check(built.flush(compressed_file),what + ": compressed flush");
+
+  std::string plain = fileBytes(plain_file);
+  std::string compressed = fileBytes(compressed_file);
+
+  check(encodingOf(plain) == 0,what + ": uncompressed file has an encoding");
+  check(encodingOf(compressed) == encoding,
+        what + ": compressed with the wrong encoding");
+  check(compressed.size() < plain.size(),
+        what + ": compressed file is not smaller");
+
+  const BloomLoadMode modes[] = { LOAD_STREAM, LOAD_MEMORY, LOAD_MMAP };
+
+  for(size_t m = 0 ; m < sizeof(modes) / sizeof(modes[0]) ; m++)
+    {
+      std::ostringstream name;
+      name << what << ", load mode " << modes[m];
+
+      // Compressed bits are expanded in memory in every load mode, so even
+      // a streamed filter can be flushed again
+      BloomFilterUnthreaded loaded(compressed_file,modes[m]);
+
+      check(loaded.Compare(built),name.str() + ": parameters of the filter");
+      check(loaded.flush(copy_file) && fileBytes(copy_file) == plain,
+            name.str() + ": decoded bits differ from the uncompressed file");
+    }
+
+  // Decoding reads the exact length of the encoding
+  std::string truncated = compressed.substr(0,compressed.size() - 1);
+
+  writeFileBytes(compressed_file,truncated);
+  for(size_t m = 0 ; m < sizeof(modes) / sizeof(modes[0]) ; m++)
+    {
+      std::ostringstream name;
+      name << what << ": truncated file accepted in load mode " << modes[m];
+      check(exitsWithError(Load(compressed_file,modes[m])),name.str());
+    }
+
+  // The decoded bits are checked against the payload CRC in every load
+  // mode. Flipping a bit of the last varint or literal word either moves
+  // a set bit or runs the encoding past the end of the file.
+  std::string corrupt = compressed;
+
+  corrupt[corrupt.size() - 1] ^= 0x01;
+  writeFileBytes(compressed_file,corrupt);
+  for(size_t m = 0 ; m < sizeof(modes) / sizeof(modes[0]) ; m++)
+    {
+      std::ostringstream name;
+      name << what << ": corrupt file accepted in load mode " << modes[m];
+      check(exitsWithError(Load(compressed_file,modes[m])),name.str());
+    }
+
+  std::remove(plain_file.c_str());
+  std::remove(compressed_file.c_str());
+  std::remove(copy_file.c_str());
+}
+}
+
+int
+main()
+{
+  quietLogging();
+
+  // A few ngrams scattered over a large filter: almost every set bit is in
+  // a word of its own, so the gaps between them are smaller
+  {
+    std::vector<std::string> payloads = makePayloads(8,5,40);
+    BloomFilterUnthreaded sparse(100000,0.01,6,80,2,6,LAYOUT_STANDARD,
+                                 INDEX_PER_SEED,HASH_MURMUR3,
+                                 SIZING_POWER_OF_2,SHORT_NGRAMS_HASHED);
+
+    for(size_t p = 0 ; p < payloads.size() ; p++)
+      {
+        sparse.insertNgrams((const uint8_t *)payloads[p].data(),
+                            payloads[p].size(),2,6);
+      }
+    checkEncoding(sparse,BloomFilterHeader::FLAG_SET_BIT_GAPS,"sparse");
+  }
+
+  // Only ngrams of 1 and 2 bytes, all in the exact bitmaps. The payloads
+  // use 24 letters, so each 256-bit row of the 2-byte bitmap has its bits
+  // packed in a word or two and the set bits are too many to list.
+  {
+    std::vector<std::string> payloads = makePayloads(9,40,100);
+    BloomFilterUnthreaded clustered(1000,0.01,6,80,1,2,LAYOUT_STANDARD,
+                                    INDEX_DOUBLE_HASH,HASH_INCREMENTAL,
+                                    SIZING_EXACT,SHORT_NGRAMS_EXACT);
+
+    for(size_t p = 0 ; p < payloads.size() ; p++)
+      {
+        clustered.insertNgrams((const uint8_t *)payloads[p].data(),
+                               payloads[p].size(),1,2);
+      }
+    checkEncoding(clustered,BloomFilterHeader::FLAG_ZERO_RUNS,"clustered");
+  }
+  return testResult();
+}
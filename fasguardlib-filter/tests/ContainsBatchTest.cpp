@@ -0,0 +1,154 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <cstdio>
+#include <sstream>
+#include <fasguardfilter/BloomFilterUnthreaded.hh>
+#include "TestUtil.hh"
+
+// containsBatch() must give the same answers as containsSpan(), for every
+// layout and hashing of the filter and whether the bits are in memory,
+// mapped or streamed from the file.
+
+namespace
+{
+const int MinNgramSize = 2;
+const int MaxNgramSize = 6;
+
+struct FilterConfig
+{
+  BloomLayout layout;
+  BloomIndexMode index_mode;
+  BloomHashFamily hash_family;
+  BloomSizing sizing;
+  BloomShortNgrams short_ngrams;
+};
+
+const FilterConfig Configs[] =
+  {
+    { LAYOUT_STANDARD, INDEX_PER_SEED, HASH_MURMUR3, SIZING_POWER_OF_2,
+      SHORT_NGRAMS_HASHED },
+    { LAYOUT_BLOCKED, INDEX_DOUBLE_HASH, HASH_MURMUR3, SIZING_EXACT,
+      SHORT_NGRAMS_HASHED },
+    { LAYOUT_STANDARD, INDEX_DOUBLE_HASH, HASH_INCREMENTAL, SIZING_EXACT,
+      SHORT_NGRAMS_EXACT },
+    { LAYOUT_BLOCKED, INDEX_DOUBLE_HASH, HASH_INCREMENTAL, SIZING_POWER_OF_2,
+      SHORT_NGRAMS_EXACT }
+  };
+
+/**
+ * Every ngram of the payloads, with the lengths shuffled so that a batch
+ * has to be reordered by length.
+ */
+std::vector<NgramSpan>
+ngramsOf(const std::vector<std::string> &payloads)
+{
+  std::vector<NgramSpan> ngrams;
+
+  for(size_t p = 0 ; p < payloads.size() ; p++)
+    {
+      const uint8_t *data = (const uint8_t *)payloads[p].data();
+
+      for(size_t offset = 0 ;
+          offset + MaxNgramSize <= payloads[p].size() ; offset++)
+        {
+          size_t length = MinNgramSize +
+            (offset * 7 + p) % (MaxNgramSize - MinNgramSize + 1);
+
+          ngrams.push_back(NgramSpan(data + offset,length));
+        }
+    }
+  return ngrams;
+}
+
+void
+checkBatch(BloomFilterBase &bf, const std::vector<NgramSpan> &inserted,
+           const std::vector<NgramSpan> &probes, const std::string &what)
+{
+  std::vector<bool> results;
+
+  bf.containsBatch(inserted,results);
+  size_t missing = 0;
+  for(size_t i = 0 ; i < inserted.size() ; i++)
+    {
+      missing += results[i] ? 0 : 1;
+    }
+  check(missing == 0,what + ": inserted ngrams missing from the batch");
+
+  // A full batch, then a shorter one that reuses the scratch space and
+  // ends with a partial group
+  size_t sizes[] = { probes.size(), 37 };
+
+  for(size_t s = 0 ; s < sizeof(sizes) / sizeof(sizes[0]) ; s++)
+    {
+      std::vector<NgramSpan> batch(probes.begin(),probes.begin() + sizes[s]);
+      size_t mismatches = 0;
+
+      bf.containsBatch(batch,results);
+      check(results.size() == batch.size(),what + ": results size");
+      for(size_t i = 0 ; i < batch.size() && i < results.size() ; i++)
+        {
+          mismatches += (results[i] != bf.containsSpan(batch[i])) ? 1 : 0;
+        }
+
+      std::ostringstream msg;
+      msg << what << ": " << mismatches << " of " << batch.size() <<
+        " batch results differ from containsSpan";
+      check(mismatches == 0,msg.str());
+    }
+}
+}
+
+int
+main()
+{
+  quietLogging();
+
+  std::vector<std::string> payloads = makePayloads(1,40,100);
+  std::vector<std::string> others = makePayloads(2,40,100);
+  std::vector<NgramSpan> inserted = ngramsOf(payloads);
+  std::vector<NgramSpan> probes = ngramsOf(others);
+  const std::string filename = "ContainsBatchTest.bloom";
+
+  // Half of the probes were inserted
+  probes.insert(probes.end(),inserted.begin(),
+                inserted.begin() + inserted.size() / 2);
+
+  for(size_t c = 0 ; c < sizeof(Configs) / sizeof(Configs[0]) ; c++)
+    {
+      const FilterConfig &config = Configs[c];
+      std::ostringstream name;
+      name << "config " << c;
+
+      BloomFilterUnthreaded built(20000,0.01,6,80,MinNgramSize,MaxNgramSize,
+                                  config.layout,config.index_mode,
+                                  config.hash_family,config.sizing,
+                                  config.short_ngrams);
+
+      for(size_t p = 0 ; p < payloads.size() ; p++)
+        {
+          built.insertNgrams((const uint8_t *)payloads[p].data(),
+                             payloads[p].size(),MinNgramSize,MaxNgramSize);
+        }
+      checkBatch(built,inserted,probes,name.str() + " built");
+      check(built.flush(filename),name.str() + ": flush");
+
+      BloomLoadMode modes[] = { LOAD_STREAM, LOAD_MEMORY, LOAD_MMAP };
+
+      for(size_t m = 0 ; m < sizeof(modes) / sizeof(modes[0]) ; m++)
+        {
+          std::ostringstream loaded_name;
+          loaded_name << name.str() << " load mode " << modes[m];
+
+          BloomFilterUnthreaded loaded(filename,modes[m]);
+
+          checkBatch(loaded,inserted,probes,loaded_name.str());
+          loaded.setConcurrentReads(true);
+          checkBatch(loaded,inserted,probes,
+                     loaded_name.str() + " concurrent");
+        }
+    }
+  std::remove(filename.c_str());
+  return testResult();
+}
@@ -0,0 +1,50 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <cstring>
+#include <sstream>
+#include <fasguardfilter/MurmurHash3.h>
+#include "TestUtil.hh"
+
+// MurmurHash3_x86_128_x8 must give the same 128-bit hashes as eight calls
+// of MurmurHash3_x86_128, bit for bit, for every tail length and whatever
+// the alignment of the keys. The AVX2 version is checked when the CPU has
+// AVX2, the portable one otherwise.
+
+int
+main()
+{
+  // Keys overlap and start at every alignment, as ngrams of a payload do
+  std::string buffer = makePayloads(7,1,64 + 8)[0];
+  const uint32_t seeds[] = { 0, 1, 0x9747b28c, 0xffffffff };
+
+  for(size_t s = 0 ; s < sizeof(seeds) / sizeof(seeds[0]) ; s++)
+    {
+      // Tails of 0 to 15 bytes after zero, one, two and three blocks
+      for(int len = 0 ; len < 64 ; len++)
+        {
+          for(size_t start = 0 ; start < 8 ; start++)
+            {
+              const void *keys[8];
+              uint32_t expected[8][4];
+              uint32_t actual[8][4];
+
+              for(size_t lane = 0 ; lane < 8 ; lane++)
+                {
+                  keys[lane] = buffer.data() + (start + lane) % 8;
+                  MurmurHash3_x86_128(keys[lane],len,seeds[s],
+                                      expected[lane]);
+                }
+              MurmurHash3_x86_128_x8(keys,len,seeds[s],actual);
+
+              std::ostringstream msg;
+              msg << "x8 hash differs for seed " << seeds[s] <<
+                ", length " << len << ", first key at offset " << start;
+              check(memcmp(expected,actual,sizeof(expected)) == 0,
+                    msg.str());
+            }
+        }
+    }
+  return testResult();
+}
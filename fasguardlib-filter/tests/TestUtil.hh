@@ -0,0 +1,138 @@
+#ifndef TEST_UTIL_HH
+#define TEST_UTIL_HH
+#include <inttypes.h>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
+#include <boost/log/trivial.hpp>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/**
+ * @file
+ * @brief Helpers shared by the test programs run by make check.
+ *
+ * A test program calls check() for every expectation and returns
+ * testResult() from main, so it exits non-zero if any check failed.
+ */
+
+static int test_failures = 0;
+
+/**
+ * Record an expectation.
+ * @param ok Whether the expectation holds.
+ * @param what Printed when it does not.
+ */
+inline void
+check(bool ok, const std::string &what)
+{
+  if(!ok)
+    {
+      std::cerr << "FAILED: " << what << std::endl;
+      test_failures++;
+    }
+}
+
+/**
+ * Exit status of a test program.
+ */
+inline int
+testResult()
+{
+  return (test_failures == 0) ? 0 : 1;
+}
+
+/**
+ * Only log warnings and errors; the filters log every step at debug and
+ * info level.
+ */
+inline void
+quietLogging()
+{
+  boost::log::core::get()->set_filter
+    (
+     boost::log::trivial::severity >= boost::log::trivial::warning
+     );
+}
+
+/**
+ * Deterministic payloads that look a little like traffic: bytes from a
+ * small alphabet, so ngrams repeat within and across payloads.
+ * @param seed Selects the payloads.
+ * @param count Number of payloads.
+ * @param length Length of each payload.
+ */
+inline std::vector<std::string>
+makePayloads(uint64_t seed, size_t count, size_t length)
+{
+  std::vector<std::string> payloads(count);
+  uint64_t state = seed * 0x9e3779b97f4a7c15ULL + 1;
+
+  for(size_t p = 0 ; p < count ; p++)
+    {
+      for(size_t i = 0 ; i < length ; i++)
+        {
+          // xorshift64
+          state ^= state << 13;
+          state ^= state >> 7;
+          state ^= state << 17;
+          payloads[p].push_back((char)('a' + state % 24));
+        }
+    }
+  return payloads;
+}
+
+/**
+ * Contents of a file, or an empty string if it can not be read.
+ */
+inline std::string
+fileBytes(const std::string &filename)
+{
+  std::ifstream in(filename.c_str(),std::ios::in | std::ios::binary);
+
+  return std::string(std::istreambuf_iterator<char>(in),
+                     std::istreambuf_iterator<char>());
+}
+
+/**
+ * Replace the contents of a file.
+ */
+inline void
+writeFileBytes(const std::string &filename, const std::string &bytes)
+{
+  std::ofstream out(filename.c_str(),std::ios::out | std::ios::binary);
+
+  out.write(bytes.data(),bytes.size());
+}
+
+/**
+ * Run a function in a child process, for the failures the library reports
+ * by logging an error and exiting.
+ * @param body The function, called with no arguments.
+ * @return True if the child exited with a non-zero status.
+ */
+template<class Body> bool
+exitsWithError(const Body &body)
+{
+  pid_t pid = fork();
+
+  if(pid == 0)
+    {
+      boost::log::core::get()->set_logging_enabled(false);
+      body();
+      _exit(0);
+    }
+
+  int status = 0;
+
+  if(pid < 0 || waitpid(pid,&status,0) != pid)
+    {
+      return false;
+    }
+  return !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
+#endif
@@ -0,0 +1,107 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <cstdio>
+#include <sstream>
+#include <fasguardfilter/BloomFilterThreaded.hh>
+#include <fasguardfilter/BloomFilterUnthreaded.hh>
+#include "TestUtil.hh"
+
+// A BloomFilterThreaded must write the same file as a BloomFilterUnthreaded
+// given the same payloads, whatever its build strategy and number of
+// threads.
+
+namespace
+{
+const int MinNgramSize = 3;
+const int MaxNgramSize = 8;
+const size_t InsertedItems = 300000;
+const double ProbabilityFalsePositive = 0.001;
+
+struct FilterConfig
+{
+  BloomLayout layout;
+  BloomIndexMode index_mode;
+  BloomHashFamily hash_family;
+  BloomSizing sizing;
+  BloomShortNgrams short_ngrams;
+};
+
+const FilterConfig Configs[] =
+  {
+    { LAYOUT_STANDARD, INDEX_PER_SEED, HASH_MURMUR3, SIZING_POWER_OF_2,
+      SHORT_NGRAMS_HASHED },
+    { LAYOUT_BLOCKED, INDEX_DOUBLE_HASH, HASH_INCREMENTAL, SIZING_EXACT,
+      SHORT_NGRAMS_EXACT }
+  };
+}
+
+int
+main()
+{
+  quietLogging();
+
+  std::vector<std::string> payloads = makePayloads(3,200,200);
+  const std::string reference_file = "ThreadedBuildTest.reference.bloom";
+  const std::string threaded_file = "ThreadedBuildTest.threaded.bloom";
+  const BloomBuildStrategy strategies[] =
+    { BUILD_SHARED, BUILD_PARTIAL, BUILD_PARTIAL_IN_PLACE };
+  const int thread_nums[] = { 1, 3 };
+
+  for(size_t c = 0 ; c < sizeof(Configs) / sizeof(Configs[0]) ; c++)
+    {
+      const FilterConfig &config = Configs[c];
+      BloomFilterUnthreaded reference(InsertedItems,ProbabilityFalsePositive,
+                                      6,80,MinNgramSize,MaxNgramSize,
+                                      config.layout,config.index_mode,
+                                      config.hash_family,config.sizing,
+                                      config.short_ngrams);
+
+      for(size_t p = 0 ; p < payloads.size() ; p++)
+        {
+          reference.insertNgrams((const uint8_t *)payloads[p].data(),
+                                 payloads[p].size(),MinNgramSize,
+                                 MaxNgramSize);
+        }
+      check(reference.flush(reference_file),"flush of the reference");
+
+      std::string expected = fileBytes(reference_file);
+
+      for(size_t s = 0 ; s < sizeof(strategies) / sizeof(strategies[0]) ;
+          s++)
+        {
+          for(size_t t = 0 ; t < sizeof(thread_nums) / sizeof(thread_nums[0]) ;
+              t++)
+            {
+              std::ostringstream name;
+              name << "config " << c << ", strategy " << strategies[s] <<
+                ", " << thread_nums[t] << " threads";
+
+              BloomFilterThreaded threaded(InsertedItems,
+                                           ProbabilityFalsePositive,6,80,
+                                           MinNgramSize,MaxNgramSize,
+                                           thread_nums[t],config.layout,
+                                           config.index_mode,
+                                           config.hash_family,config.sizing,
+                                           strategies[s],
+                                           config.short_ngrams);
+
+              for(size_t p = 0 ; p < payloads.size() ; p++)
+                {
+                  threaded.insertNgrams((const uint8_t *)payloads[p].data(),
+                                        payloads[p].size(),MinNgramSize,
+                                        MaxNgramSize);
+                }
+              threaded.signalDone();
+              threaded.threadsCompleted();
+              check(threaded.flush(threaded_file),name.str() + ": flush");
+              check(fileBytes(threaded_file) == expected,
+                    name.str() + ": file differs from the unthreaded build");
+            }
+        }
+    }
+  std::remove(reference_file.c_str());
+  std::remove(threaded_file.c_str());
+  return testResult();
+}
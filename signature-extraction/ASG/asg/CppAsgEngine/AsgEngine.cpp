@@ -59,11 +59,16 @@ AsgEngine::AsgEngine(dict properties, bool debug_flag) :
 
   if(blm_frm_mem.compare(std::string("T")) == 0)
     {
-      m_blm_frm_mem = true;
+      m_blm_load_mode = LOAD_MEMORY;
     }
   else if(blm_frm_mem.compare(std::string("F")) == 0)
     {
-      m_blm_frm_mem = false;
+      m_blm_load_mode = LOAD_STREAM;
+    }
+  else if(blm_frm_mem.compare(std::string("M")) == 0)
+    {
+      // Map the filter read-only so ASG processes share the page cache
+      m_blm_load_mode = LOAD_MMAP;
     }
   else
     {
@@ -316,16 +321,7 @@ AsgEngine::unsupervisedClustering()
   BOOST_LOG_TRIVIAL(debug) << "Bloom Filter File Name: "
                            << bf_name << std::endl;
 
-  BloomFilterBase *bf;
-
-  if(m_threaded_flag)
-    {
-      bf = new BloomFilterThreaded(bf_name,m_blm_frm_mem);
-    }
-  else
-    {
-      bf = new BloomFilterUnthreaded(bf_name,m_blm_frm_mem);
-    }
+  BenignNgramStorage *bf = loadBenignStorage(bf_name);
 
   std::string rule_file =
     extract<std::string>
@@ -444,8 +440,38 @@ AsgEngine::unsupervisedClustering()
   delete bf;
 }
 
+BenignNgramStorage *
+AsgEngine::loadBenignStorage(const std::string &bf_name)
+{
+  if(BloomFilterGenerations::isManifest(bf_name))
+    {
+      return new BloomFilterGenerations(bf_name,m_blm_load_mode);
+    }
+  if(BinaryFuseNgramStorage::isBinaryFuseFile(bf_name))
+    {
+      return new BinaryFuseNgramStorage(bf_name,m_blm_load_mode);
+    }
+  if(BloomFilterPartitioned::isPartitionedFile(bf_name))
+    {
+      return new BloomFilterPartitioned(bf_name,m_blm_load_mode);
+    }
+  if(BloomFilterScalable::isScalableFile(bf_name))
+    {
+      return new BloomFilterScalable(bf_name,m_blm_load_mode);
+    }
+  if(CuckooNgramStorage::isCuckooFile(bf_name))
+    {
+      return new CuckooNgramStorage(bf_name,m_blm_load_mode);
+    }
+  if(m_threaded_flag)
+    {
+      return new BloomFilterThreaded(bf_name,m_blm_load_mode);
+    }
+  return new BloomFilterUnthreaded(bf_name,m_blm_load_mode);
+}
+
 std::vector<std::string>
-AsgEngine::filtSigFrags(BloomFilterBase &bf,
+AsgEngine::filtSigFrags(BenignNgramStorage &bf,
                         std::vector<std::string> &frag_pieces)
 {
   std::vector<std::string> result;
@@ -457,13 +483,16 @@ AsgEngine::filtSigFrags(BloomFilterBase &bf,
 
   while(it != frag_pieces.end())
     {
-      std::set<std::string> ngrams;
-
       if((*it).size() < m_max_depth)
         {
           it++;
           continue;
         }
+
+      // Look the ngrams up in place rather than copying each one out of the
+      // fragment, and all in one batch so the lookups overlap
+      const uint8_t *frag = (const uint8_t *)((*it).data());
+      std::vector<NgramSpan> frag_ngrams;
       for(int depth=m_min_depth;depth<=m_max_depth;depth++)
         {
           BOOST_LOG_TRIVIAL(debug)   << "Size of frag_piece: " <<
@@ -471,21 +500,15 @@ AsgEngine::filtSigFrags(BloomFilterBase &bf,
 
           for(unsigned int i=0;i<=(*it).size()-depth;i++)
             {
-              ngrams.insert((*it).substr(i,depth));
+              frag_ngrams.push_back(NgramSpan(frag + i,depth));
             }
         }
-      std::set<std::string>::iterator nit = ngrams.begin();
+      std::vector<bool> in_filter;
+      bf.containsBatch(frag_ngrams,in_filter);
 
-      bool novel_flag = false;
-      while(nit != ngrams.end())
-        {
-          if(!bf.contains((uint8_t *)((*nit).data()),(*nit).size()))
-            {
-              novel_flag = true;
-              break;
-            }
-          nit++;
-        }
+      bool novel_flag =
+        (std::find(in_filter.begin(),in_filter.end(),false) !=
+         in_filter.end());
       if(novel_flag)
         {
           result.push_back(*it);
@@ -595,16 +618,7 @@ AsgEngine::singleAttack()
                            << bf_name << std::endl;
 
   //BloomFilter bf(bf_name,m_blm_frm_mem);
-  BloomFilterBase *bf;
-
-  if(m_threaded_flag)
-    {
-      bf = new BloomFilterThreaded(bf_name,m_blm_frm_mem);
-    }
-  else
-    {
-      bf = new BloomFilterUnthreaded(bf_name,m_blm_frm_mem);
-    }
+  BenignNgramStorage *bf = loadBenignStorage(bf_name);
 
   std::string action =
     extract<std::string>
@@ -740,7 +754,7 @@ AsgEngine::singleAttack()
 }
 
 std::pair<std::vector<Ngram>,std::vector<std::vector<std::string> > >
-AsgEngine::filtNgrams(BloomFilterBase &bf,
+AsgEngine::filtNgrams(BenignNgramStorage &bf,
                       std::vector<std::string> &pkts)
 {
   std::set<std::string> ngrams;
@@ -776,6 +790,10 @@ AsgEngine::filtNgrams(BloomFilterBase &bf,
       //std::cout << "Packet " << pkt_num << std::endl;
       //std::cout.flush();
 
+      // Gather every ngram of the packet and look them up in one batch so
+      // the lookups overlap
+      const uint8_t *pkt = (const uint8_t *)((*it).data());
+      std::vector<NgramSpan> pkt_spans;
       for(int i=0;i<=(*it).size()-m_min_depth;i++)
         {
           //std::cout << "Offset " << i << std::endl;
@@ -784,19 +802,27 @@ AsgEngine::filtNgrams(BloomFilterBase &bf,
             m_max_depth:((*it).size()-i);
           for(int depth=m_min_depth;depth<=local_max_depth;depth++)
             {
-              std::string ngram = (*it).substr(i,depth);
-
-              if(!bf.contains((uint8_t *)(ngram.data()),ngram.size()))
-                {
-                  ngrams.insert(ngram);
-                  Ngram ngram_obj(ngram,i,pkt_num);
-                  pkt_ngrams.push_back(ngram_obj);
-                  pkt_ngram_strings.push_back(ngram);
-                  svv_ngram++;
-                  //break;
-                }
-              total_ngram++;
+              pkt_spans.push_back(NgramSpan(pkt + i,depth));
+            }
+        }
+      std::vector<bool> in_filter;
+      bf.containsBatch(pkt_spans,in_filter);
+
+      for(size_t n=0;n<pkt_spans.size();n++)
+        {
+          if(!in_filter[n])
+            {
+              // Only copy out the ngrams that survive the filter
+              int i = pkt_spans[n].data - pkt;
+              std::string ngram = (*it).substr(i,pkt_spans[n].length);
+              ngrams.insert(ngram);
+              Ngram ngram_obj(ngram,i,pkt_num);
+              pkt_ngrams.push_back(ngram_obj);
+              pkt_ngram_strings.push_back(ngram);
+              svv_ngram++;
+              //break;
             }
+          total_ngram++;
         }
       BOOST_LOG_TRIVIAL(debug)   << "Total ngram: " <<  total_ngram <<
         " Surviving ngram: " << svv_ngram << std::endl;
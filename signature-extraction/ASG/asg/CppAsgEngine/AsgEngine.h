@@ -9,8 +9,13 @@
 #include "Trie.h"
 #include "AbstractTrieNodeFactory.h"
 #include "MemoryTrieNodeFactory.h"
+#include <fasguardfilter/BinaryFuseNgramStorage.hh>
 #include <fasguardfilter/BloomFilterThreaded.hh>
 #include <fasguardfilter/BloomFilterUnthreaded.hh>
+#include <fasguardfilter/BloomFilterGenerations.hh>
+#include <fasguardfilter/BloomFilterPartitioned.hh>
+#include <fasguardfilter/BloomFilterScalable.hh>
+#include <fasguardfilter/CuckooNgramStorage.hh>
 
 /**
  * This class is for a single ngram. It contains both the string that
@@ -126,17 +131,27 @@ class AsgEngine
    * takes place.
    */
   void singleAttack();
+  /**
+   * Load the benign traffic storage for an attack. This is a
+   * BloomFilterGenerations store if the file is a generations manifest, a
+   * CuckooNgramStorage, BinaryFuseNgramStorage, BloomFilterPartitioned or
+   * BloomFilterScalable if it holds a cuckoo, binary fuse, partitioned or
+   * scalable Bloom filter, and a Bloom filter otherwise.
+   * @param bf_name Name of the .bloom file.
+   * @return The storage. The caller deletes it.
+   */
+  BenignNgramStorage *loadBenignStorage(const std::string &bf_name);
   /**
    * Filter list of signature fragments. Each fragment must have at least
    * one that is not in the Bloom filter.
-   * @param bf Bloom filter.
+   * @param bf Benign traffic storage.
    * @param sig_frags vector of strings that will be part of the signature.
    * @return Vector of strings that survive filtering.
    */
   std::vector<std::string>
-    filtSigFrags(BloomFilterBase &bf, std::vector<std::string> &frag_pieces);
+    filtSigFrags(BenignNgramStorage &bf, std::vector<std::string> &frag_pieces);
   std::pair<std::vector<Ngram>,std::vector<std::vector<std::string> > >
-    filtNgrams(BloomFilterBase &bf,
+    filtNgrams(BenignNgramStorage &bf,
                std::vector<std::string> &pkts);
 
   void
@@ -154,7 +169,7 @@ class AsgEngine
   int m_max_depth;
   int m_min_depth;
   std::string m_bloom_filter_dir;
-  bool m_blm_frm_mem;
+  BloomLoadMode m_blm_load_mode;
   boost::python::dict m_properties;
   bool m_debug;
   bool m_multiple_attack_flag;